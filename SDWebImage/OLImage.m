@@ -10,6 +10,7 @@
 #import <MobileCoreServices/MobileCoreServices.h>
 #import "OLImage.h"
 #import "SDImageCache.h"
+#import "SDImageMemoryCache.h"
 #import "HTCachePair.h"
 
 //Define FLT_EPSILON because, reasons.
@@ -618,8 +619,13 @@ CGImageRef OLCreateDecodedCGImageFromCGImage(CGImageRef imageRef, NSDictionary *
                         CGImageRelease(decodedImageRef);
                         
                         if (image) {
-                            CGFloat cost = image.size.height * image.size.width * image.scale;
-                            [self.frameCache setObject:image forCachePairKey:[self cachePairKeyForIndex:idx] cost:cost];
+                            NSCache *frameCache = self.frameCache;
+                            
+                            // Frames can be decoded again from the source, so they are the first to go under memory pressure
+                            if ([frameCache isKindOfClass:[SDImageMemoryCache class]])
+                                [(SDImageMemoryCache *)frameCache setObject:image forKey:[self cachePairKeyForIndex:idx] cost:SDImageMemoryCostForImage(image) options:SDImageMemoryCacheObjectRegenerable];
+                            else
+                                [frameCache setObject:image forCachePairKey:[self cachePairKeyForIndex:idx] cost:SDImageMemoryCostForImage(image)];
                         }
                     }
                 }
@@ -8,6 +8,9 @@
 
 #import <Foundation/Foundation.h>
 #import "SDWebImageCompat.h"
+#import "SDImageCacheEvictionPolicy.h"
+#import "SDWebImageStatistics.h"
+#import "SDImageMemoryBudget.h"
 
 typedef NS_ENUM(NSInteger, SDImageCacheType) {
     /**
@@ -24,7 +27,62 @@ typedef NS_ENUM(NSInteger, SDImageCacheType) {
     SDImageCacheTypeMemory,
 };
 
+typedef NS_ENUM(NSInteger, SDImageCacheWritePriority) {
+    /**
+     * The disk write is always performed.
+     */
+    SDImageCacheWritePriorityDefault,
+    /**
+     * The disk write waits behind default priority writes, and is dropped when too many bytes are pending (e.g. prefetching).
+     */
+    SDImageCacheWritePriorityLow,
+};
+
+typedef NS_ENUM(NSInteger, SDImageCacheMemoryPressure) {
+    /**
+     * Drop animated image frames, which can be decoded again without I/O, and images not used for `memoryPressureIdleTime`.
+     */
+    SDImageCacheMemoryPressureLow,
+    /**
+     * Also drop images cached ahead of use (prefetched or warmed up) and never displayed since, and the encoded data tier.
+     */
+    SDImageCacheMemoryPressureModerate,
+    /**
+     * Drop everything, including the images on screen, like `clearMemory`.
+     */
+    SDImageCacheMemoryPressureCritical,
+};
+
+typedef NS_ENUM(NSInteger, SDImageCacheDiskLayout) {
+    /**
+     * Files are named after the MD5 of their key and all sit in the cache directory.
+     */
+    SDImageCacheDiskLayoutFlat,
+    /**
+     * Files are named after a fast 128 bit non-cryptographic hash of their key and spread over 256×256 subdirectories
+     * named after its first two bytes (`ab/cd/abcd…`), which keeps directories small with hundreds of thousands of files.
+     */
+    SDImageCacheDiskLayoutSharded,
+};
+
+typedef NS_ENUM(NSInteger, SDImageCacheLookupResult) {
+    /**
+     * The cache doesn't hold the image.
+     */
+    SDImageCacheLookupResultNotFound,
+    /**
+     * The cache holds the image.
+     */
+    SDImageCacheLookupResultFound,
+    /**
+     * Answering would have taken longer than the timeout, e.g. the disk index is still loading or the image has to be
+     * read from disk. A read keeps going in the background and fills the memory cache, so asking again later is cheap.
+     */
+    SDImageCacheLookupResultWouldBlock,
+};
+
 typedef void(^SDWebImageQueryCompletedBlock)(UIImage *image, SDImageCacheType cacheType);
+typedef void(^SDWebImageBatchQueryCompletedBlock)(NSDictionary *images, SDImageCacheType cacheType, BOOL finished);
 typedef void(^SDWebImageCheckCacheCompletionBlock)(BOOL isInCache);
 typedef void(^SDWebImageImageDataCompletionBlock)(NSData *data);
 
@@ -37,12 +95,15 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
 @interface SDImageCache : NSObject
 
 /**
- * The maximum "total cost" of the in-memory image cache. The cost function is the number of pixels held in memory.
+ * The maximum "total cost" of the in-memory image cache. The cost function is the number of bytes of decoded bitmap held in memory.
+ * Defaults to an eighth of the device's physical memory. 0 removes the limit: the memory cache then only shrinks on
+ * memory warnings and under a shared budget, if any.
  */
 @property (assign, nonatomic) NSUInteger maxMemoryCost;
 
 /**
- * The maximum length of time to keep an image in the cache, in seconds
+ * The maximum length of time to keep an image in the cache, in seconds. Images past the freshness lifetime the server
+ * gave them are kept until then as well, so that they can be revalidated.
  */
 @property (assign, nonatomic) NSInteger maxCacheAge;
 
@@ -103,6 +164,22 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk;
 
+/**
+ * Same as `storeImage:recalculateFromImage:imageData:forKey:toDisk:`, with the priority of the disk write.
+ *
+ * @param priority The priority of the disk write, see SDImageCacheWritePriority
+ */
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk priority:(SDImageCacheWritePriority)priority;
+
+/**
+ * Same as `storeImage:recalculateFromImage:imageData:forKey:toDisk:priority:`, keeping the freshness lifetime
+ * (`Cache-Control` max-age) and the validators (`ETag`, `Last-Modified`) of the response the image was downloaded with
+ * along with the disk entry. See `isDiskImageFreshForKey:` and `revalidationHeadersForKey:`.
+ *
+ * @param response The response the image data was downloaded with, ignored unless it's an NSHTTPURLResponse
+ */
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk priority:(SDImageCacheWritePriority)priority response:(NSURLResponse *)response;
+
 /**
  * Query the disk cache asynchronously.
  *
@@ -110,6 +187,22 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (NSOperation *)queryCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options done:(SDWebImageQueryCompletedBlock)doneBlock;
 
+/**
+ * Query the caches for several keys at once, e.g. for every cell a collection view is about to lay out.
+ *
+ * Memory hits are answered synchronously, in a single call of the done block. The other keys are read and decoded
+ * from disk in parallel, at most `maxConcurrentDiskReads` at a time like any other disk read, starting in the order of
+ * `keys` (put the most important first). Disk results are handed to the main queue in a few batches rather than one call per key.
+ * The last call has `finished` set; keys that weren't in any batch are in neither cache.
+ *
+ * @param keys      The keys, in priority order
+ * @param options   Scaling options, as for `queryCacheForKey:options:done:`
+ * @param doneBlock Called with the images found (key -> UIImage), where they were found, and whether it's the last call
+ *
+ * @return The operation finishing the disk lookups, which can be cancelled, or nil if every key was in memory
+ */
+- (NSOperation *)queryCacheForKeys:(NSArray *)keys options:(SDWebImageScaledOptions)options done:(SDWebImageBatchQueryCompletedBlock)doneBlock;
+
 /**
  * Query the memory cache synchronously.
  *
@@ -161,6 +254,16 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
  */
 - (void)clearMemory;
 
+/**
+ * Free memory according to the given pressure level, see SDImageCacheMemoryPressure. Memory warnings go through here:
+ * the first one is handled as low pressure, each further one within a few seconds one level higher.
+ *
+ * @param pressure The pressure level
+ *
+ * @return The number of bytes freed
+ */
+- (NSUInteger)reduceMemoryUsageForPressure:(SDImageCacheMemoryPressure)pressure;
+
 /**
  * Clear all disk cached images. Non-blocking method - returns immediately.
  * @param completionBlock An block that should be executed after cache expiration completes (optional)
@@ -174,7 +277,13 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
 - (void)clearDisk;
 
 /**
- * Remove all expired cached image from disk. Non-blocking method - returns immediately.
+ * Remove all expired cached image from disk, then evict down to `maxCacheSize`. Non-blocking method - returns immediately.
+ *
+ * The cleanup runs on the IO queue in slices bounded by `cleanupSliceEntryLimit` and `cleanupSliceTimeLimit`, so stores
+ * and removals queued meanwhile run in between, and it holds back while reads are in flight. Its position is saved
+ * after every slice; a cleanup interrupted by the end of the app resumes at the next launch. Calling this while a
+ * cleanup runs only adds the completion block to it.
+ *
  * @param completionBlock An block that should be executed after cache expiration completes (optional)
  */
 - (void)cleanDiskWithCompletionBlock:(void (^)())completionBlock;
@@ -229,7 +338,7 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
 - (NSString *)cachePathForKey:(NSString *)key inPath:(NSString *)path;
 
 /**
- *  Get the default cache path for a certain key
+ *  Get the default cache path for a certain key, in the current `diskLayout`
  *
  *  @param key the key (can be obtained from url using cacheKeyForURL)
  *
@@ -240,8 +349,250 @@ typedef void(^SDWebImageCalculateSizeBlock)(NSUInteger fileCount, NSUInteger tot
 
 // JvL Additions //
 
+/**
+ * The in-memory image cache, an SDImageMemoryCache (segmented LRU, byte costs, hit/miss/eviction counters).
+ */
 @property (strong, nonatomic) NSCache *memCache;
 
+/**
+ * Images not looked up or stored for this long, in seconds, are dropped under low memory pressure. Defaults to 30 s.
+ */
+@property (assign, nonatomic) NSTimeInterval memoryPressureIdleTime;
+
+/**
+ * Share a global memory budget with the memory caches of other namespaces. The budget evicts from whichever namespace
+ * uses the most relative to its weight once they together exceed its limit; `maxMemoryCost` keeps applying to this
+ * namespace alone (set it to 0 to let the budget decide). Animated image frames are cached in the memory cache of
+ * `sharedImageCache`, so they count against its namespace.
+ *
+ * @param budget      The shared budget, see SDImageMemoryBudget
+ * @param weight      The relative share of the budget this namespace is entitled to under pressure, e.g. 1
+ * @param minimumCost The memory cost, in bytes, the budget never trims this namespace below for the others
+ */
+- (void)addToMemoryBudget:(SDImageMemoryBudget *)budget weight:(double)weight minimumCost:(NSUInteger)minimumCost;
+
+/**
+ * How files are named and placed in the disk cache directory. Defaults to SDImageCacheDiskLayoutFlat.
+ *
+ * Switching to SDImageCacheDiskLayoutSharded migrates online: an image stored under the flat layout is still found,
+ * and moved to its sharded location the first time it is read or stored again. Images never asked for again expire
+ * in place. Images cached under the sharded layout are not found anymore after switching back to the flat one.
+ * Read-only paths added through `addReadOnlyCachePath:` keep the flat layout.
+ */
+@property (assign, nonatomic) SDImageCacheDiskLayout diskLayout;
+
+/**
+ * Pack payloads no larger than `packedStorageThreshold` into shared segment files instead of writing one file per key.
+ * Segments are compacted during `cleanDisk`. Larger payloads keep using one file per key. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldUsePackedStorage;
+
+/**
+ * Largest payload, in bytes, stored in a segment when `shouldUsePackedStorage` is set. Defaults to 32 KB.
+ */
+@property (assign, nonatomic) NSUInteger packedStorageThreshold;
+
+/**
+ * Store identical payloads once: each payload is kept under a digest of its content, and every key whose data has
+ * that content points at the same copy, which is only deleted once no key refers to it anymore. Useful when the same
+ * image is served under several URLs (signed query strings, aliases, mirrors). Payloads packed through
+ * `shouldUsePackedStorage` are not deduplicated. Sizes and eviction account for shared content once. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldDeduplicateDiskCache;
+
+/**
+ * Decode disk cache hits straight from a memory-mapped file instead of copying the file into a heap buffer first.
+ * The mapping only lives for the duration of the decode. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldUseMappedReads;
+
+/**
+ * Files smaller than this size, in bytes, are still read into memory when `shouldUseMappedReads` is set. Defaults to 64 KB.
+ */
+@property (assign, nonatomic) NSUInteger mappedReadThreshold;
+
+/**
+ * Maximum number of asynchronous disk reads (queries, existence and data lookups) running at once. Reads don't wait
+ * for the serial queue that handles stores, removals and cleanup; writes are atomic so a read never sees a partial file.
+ * Defaults to 4.
+ */
+@property (assign, nonatomic) NSInteger maxConcurrentDiskReads;
+
+/**
+ * Negative lookup statistics per cache directory, keyed by path. Misses on the default path are answered by the disk
+ * index, misses on read-only paths by a Bloom filter built when the path is added; neither touches the file system.
+ * Each value holds `lookups`, `negatives`, `falsePositives`, `falsePositiveRate` and `expectedFalsePositiveRate`.
+ */
+- (NSDictionary *)lookupFilterStatistics;
+
+/**
+ * Also keep the decoded pixels of images read back from disk, so later reads (including after a relaunch) map them
+ * straight into an image instead of decoding the JPEG/PNG/WebP data again. Only the default cache path and
+ * non-animated 8 bit RGB or grayscale images take part. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldCacheDecodedBitmaps;
+
+/**
+ * The maximum size of the decoded bitmap tier, in bytes, on top of `maxCacheSize`. Least recently used bitmaps are
+ * evicted first. Defaults to 50 MB.
+ */
+@property (assign, nonatomic) unsigned long long maxDecodedBitmapCacheSize;
+
+/**
+ * Also keep the encoded data (JPEG/PNG/WebP) of recently downloaded and recently read images in memory, under its
+ * own budget. Once the decoded image has been evicted from `memCache`, a query for it is answered from there without
+ * touching the disk, paying only for the decode. Encoded data is typically 5-10 times smaller than the decoded bitmap,
+ * so the same memory holds many more images. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldCacheEncodedDataInMemory;
+
+/**
+ * The maximum number of bytes of encoded data kept in memory when `shouldCacheEncodedDataInMemory` is set. Images
+ * larger than a quarter of it are not kept. Defaults to 8 MB.
+ */
+@property (assign, nonatomic) NSUInteger maxEncodedMemoryCost;
+
+/**
+ * Save a snapshot of the hot set (see `saveHotSetSnapshot`) whenever the app enters the background or terminates, for
+ * `warmUpMemoryCacheWithTimeLimit:costLimit:completion:` to use on the next launch. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL shouldSaveHotSetSnapshot;
+
+/**
+ * Write the keys of the images currently in the memory cache to disk, the most often and most recently used first,
+ * with their memory cost. Non-blocking method - returns immediately.
+ */
+- (void)saveHotSetSnapshot;
+
+/**
+ * Load the images of the last saved hot set snapshot from disk into the memory cache, most valuable first, until
+ * either limit is reached. Runs in the background at low priority without holding up queries, which still read from
+ * disk anything not loaded yet. Call it right after creating the cache, typically at launch.
+ *
+ * Memory cache hits the warm-up answered are counted under `warmUpHits` in `statistics`.
+ *
+ * @param timeLimit  The time after which to stop, in seconds
+ * @param costLimit  The maximum memory cost to load, in bytes, 0 for `maxMemoryCost` alone
+ * @param completion A block called on the main queue with the number of images loaded and their total cost (optional)
+ */
+- (void)warmUpMemoryCacheWithTimeLimit:(NSTimeInterval)timeLimit costLimit:(NSUInteger)costLimit completion:(void (^)(NSUInteger imageCount, NSUInteger totalCost))completion;
+
+/**
+ * Disk writes are queued and flushed in batches on the IO queue; reads see queued writes right away. Once more than
+ * this many bytes are pending, low priority writes are dropped to make room. Defaults to 16 MB.
+ */
+@property (assign, nonatomic) NSUInteger maxPendingWriteBytes;
+
+/**
+ * Number of disk writes waiting to be flushed.
+ */
+@property (assign, nonatomic, readonly) NSUInteger pendingWriteCount;
+
+/**
+ * Number of bytes held by the disk writes waiting to be flushed.
+ */
+@property (assign, nonatomic, readonly) NSUInteger pendingWriteBytes;
+
+/**
+ * Number of low priority disk writes dropped because too many bytes were pending.
+ */
+@property (assign, nonatomic, readonly) NSUInteger droppedWriteCount;
+
+/**
+ * Moving average of the time between queueing a disk write and its completion, in seconds.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval averageWriteLatency;
+
+/**
+ * Returns YES if the disk entry for the key is still fresh according to the response it was downloaded with, so it can
+ * be used without asking the server. Entries stored without a response are never fresh. Doesn't wait for the disk
+ * index to load, answers NO meanwhile.
+ */
+- (BOOL)isDiskImageFreshForKey:(NSString *)key;
+
+/**
+ * The conditional request headers (`If-None-Match`, `If-Modified-Since`) revalidating the disk entry for the key, or
+ * nil if the response it was downloaded with had no validators. Doesn't wait for the disk index to load either.
+ */
+- (NSDictionary *)revalidationHeadersForKey:(NSString *)key;
+
+/**
+ * Records that the server confirmed the disk entry for the key unchanged (a 304 answer to a conditional request): its
+ * age restarts, and it takes the freshness lifetime and any new validators of the response.
+ */
+- (void)refreshDiskImageForKey:(NSString *)key response:(NSURLResponse *)response;
+
+/**
+ * Maximum number of disk cache entries a slice of the disk cleanup processes. Defaults to 200.
+ */
+@property (assign, nonatomic) NSUInteger cleanupSliceEntryLimit;
+
+/**
+ * Maximum time a slice of the disk cleanup holds the IO queue, in seconds. Defaults to 0.008. The time slices actually
+ * took is recorded in `statistics` (`SDWebImageStatisticsCleanupSliceTime`).
+ */
+@property (assign, nonatomic) NSTimeInterval cleanupSliceTimeLimit;
+
+/**
+ * Progress of the running disk cleanup, from 0 to 1: the expiration pass over the entries makes up the first half, the
+ * eviction down to `maxCacheSize` the second. 1 when no cleanup is running.
+ */
+@property (assign, atomic, readonly) double cleanupProgress;
+
+/**
+ * Decides which disk cache entries are evicted first once the cache grows past `maxCacheSize`. Defaults to an
+ * SDImageCacheGDSFEvictionPolicy, which keeps small, often read images over large one-off ones.
+ */
+@property (strong, nonatomic) id<SDImageCacheEvictionPolicy> evictionPolicy;
+
+/**
+ * Eviction starts once the disk cache holds more than this fraction of `maxCacheSize`, right after the write that
+ * crossed it rather than at the next `cleanDisk`. It runs in the same slices as the disk cleanup, see
+ * `cleanupSliceEntryLimit`. Defaults to 1.
+ */
+@property (assign, nonatomic) double diskCacheHighWatermark;
+
+/**
+ * Eviction stops once the disk cache is back under this fraction of `maxCacheSize`. Defaults to 0.8.
+ */
+@property (assign, nonatomic) double diskCacheLowWatermark;
+
+/**
+ * Hit and miss counts per tier, bytes read and written, evictions, and disk read, decode and query latencies.
+ */
+@property (strong, nonatomic, readonly) SDWebImageStatistics *statistics;
+
+/**
+ * `statistics` as a dictionary (see `-[SDWebImageStatistics snapshot]`), plus the memory cache counters under
+ * `memoryCache`, those of the encoded data tier under `encodedMemoryCache`, the usage of every namespace sharing the
+ * memory budget under `memoryBudget`, the write-behind queue under `pendingWrites`, the number of times each memory
+ * pressure level was handled and the bytes it freed under `memoryPressure`, the state of the disk cleanup under
+ * `cleanup` and, when `shouldDeduplicateDiskCache` is set, the number of contents and references to them, bytes stored,
+ * bytes saved and the deduplication ratio under `deduplication`.
+ */
+- (NSDictionary *)statisticsSnapshot;
+
+/**
+ * Same as `imageFromDiskCacheExistsForKey:`, but never waits longer than `timeout` seconds. Answered from the disk index
+ * in memory, so the timeout only matters while the index is loading.
+ */
+- (SDImageCacheLookupResult)tryImageFromDiskCacheExistsForKey:(NSString *)key timeout:(NSTimeInterval)timeout;
+
+/**
+ * Same as `imageDataFromDiskCacheForKey:`, but never waits longer than `timeout` seconds.
+ *
+ * @param data On return, the image data if found
+ */
+- (SDImageCacheLookupResult)tryImageDataFromDiskCacheForKey:(NSString *)key timeout:(NSTimeInterval)timeout data:(NSData **)data;
+
+/**
+ * Same as `imageFromCacheForKey:options:`, but never waits longer than `timeout` seconds. With a timeout of 0 only the
+ * memory cache is used, and keys known not to be on disk are answered as not found.
+ *
+ * @param image On return, the image if found
+ */
+- (SDImageCacheLookupResult)tryImageFromCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options timeout:(NSTimeInterval)timeout image:(UIImage **)image;
+
 - (BOOL)imageFromCacheExistsForKey:(NSString *)key;
 - (void)imageFromCacheExistsForKey:(NSString *)key completion:(SDWebImageCheckCacheCompletionBlock)completionBlock;
 
@@ -11,25 +11,289 @@
 #import "UIImage+MultiFormat.h"
 #import "NSData+ImageContentType.h"
 #import "OLImage.h"
+#import "SDImageCacheIndex.h"
+#import "SDImageCacheSegmentStore.h"
+#import "SDImageCacheLookupFilter.h"
+#import "SDImageCacheBitmapStore.h"
+#import "SDImageMemoryCache.h"
+#import "SDWebImageStatistics.h"
 #import <CommonCrypto/CommonDigest.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <libkern/OSAtomic.h>
 #import "HTCachePair.h"
 
 static const NSInteger kDefaultCacheMaxCacheAge = 60 * 60 * 24 * 7; // 1 week
+static const NSUInteger kDefaultPackedStorageThreshold = 32 * 1024;
+static const NSUInteger kDefaultMappedReadThreshold = 64 * 1024;
+static const NSInteger kDefaultMaxConcurrentDiskReads = 4;
+static const double kLookupFilterFalsePositiveRate = 0.01;
+static const unsigned long long kDefaultMaxDecodedBitmapCacheSize = 50 * 1024 * 1024;
+static const NSUInteger kDefaultMaxPendingWriteBytes = 16 * 1024 * 1024;
+static const NSUInteger kPendingWriteBatchSize = 16;
+static const double kWriteLatencySmoothing = 0.1;
+static const double kDefaultDiskCacheHighWatermark = 1.0;
+static const double kDefaultDiskCacheLowWatermark = 0.8;
+static const NSUInteger kDefaultMaxEncodedMemoryCost = 8 * 1024 * 1024;
+static const unsigned long long kDefaultMemoryCostDivisor = 8; // Share of physical memory the decoded images may hold
+static NSString *const kHotSetFileName = @".sdhotset";
+static const NSUInteger kMaxHotSetCount = 512;
+static const NSUInteger kMaxBatchQueryDeliveries = 4;
+static const NSTimeInterval kDefaultMemoryPressureIdleTime = 30;
+static const NSTimeInterval kMemoryWarningEscalationInterval = 10;
+static NSString *const kCleanupCursorFileName = @".sdcleanup";
+static const NSUInteger kDefaultCleanupSliceEntryLimit = 200;
+static const NSTimeInterval kDefaultCleanupSliceTimeLimit = 0.008;
+static const NSTimeInterval kCleanupYieldInterval = 0.02;
+static const NSUInteger kMaxConsecutiveCleanupYields = 10;
+#define SDImageCacheMemoryPressureLevelCount (SDImageCacheMemoryPressureCritical + 1)
 // PNG signature bytes and data (below)
 static unsigned char kPNGSignatureBytes[8] = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
 static NSData *kPNGSignatureData = nil;
 
+// A disk write waiting for the IO queue. Holds either the data to write or the image to encode it from.
+@interface SDImageCachePendingWrite : NSObject
+@property (strong, nonatomic) NSString *key;
+@property (strong, nonatomic) NSData *data;
+@property (strong, nonatomic) UIImage *image;
+@property (strong, nonatomic) NSString *contentType;
+@property (assign, nonatomic) SDImageCacheWritePriority priority;
+@property (assign, nonatomic) NSUInteger cost;
+@property (assign, nonatomic) CFAbsoluteTime enqueueTime;
+@property (assign, nonatomic) NSTimeInterval expirationTime;
+@property (strong, nonatomic) NSString *entityTag;
+@property (strong, nonatomic) NSString *lastModified;
+@end
+@implementation SDImageCachePendingWrite
+@end
+
+typedef NS_ENUM(NSInteger, SDImageCacheCleanupPhase) {
+    SDImageCacheCleanupPhaseExpire,
+    SDImageCacheCleanupPhaseEvict,
+    SDImageCacheCleanupPhaseCompact
+};
+
+// A disk cleanup in progress, only touched on the IO queue
+@interface SDImageCacheCleanup : NSObject
+@property (assign, nonatomic) SDImageCacheCleanupPhase phase;
+@property (strong, nonatomic) NSArray *fileNames; // Sorted, so a saved cursor still means the same position next launch
+@property (assign, nonatomic) NSUInteger nextFileNameIndex;
+@property (strong, nonatomic) id<SDImageCacheEvictionPolicy> evictionPolicy;
+@property (strong, nonatomic) NSArray *rankedEntries; // @[priority, entry], least valuable first
+@property (assign, nonatomic) NSUInteger nextRankedEntryIndex;
+@property (assign, nonatomic) unsigned long long evictionStartSize;
+@property (strong, nonatomic) NSArray *segments;
+@property (assign, nonatomic) NSUInteger nextSegmentIndex;
+@property (assign, nonatomic) NSUInteger consecutiveYields;
+@property (strong, nonatomic) NSMutableArray *completionBlocks;
+@end
+@implementation SDImageCacheCleanup
+@end
+
+static NSString *SDImageCacheHeaderValue(NSDictionary *headers, NSString *name) {
+    // Header names are case insensitive, and NSHTTPURLResponse doesn't canonicalize them consistently (e.g. "Etag")
+    for (NSString *field in headers) {
+        if ([field caseInsensitiveCompare:name] == NSOrderedSame) {
+            return headers[field];
+        }
+    }
+    return nil;
+}
+
+// Extracts what the disk cache keeps from an HTTP response: the end of its freshness lifetime (0 if the response
+// doesn't give one) and its validators. Returns NO if the response isn't an HTTP response.
+static BOOL SDImageCacheHTTPMetadataFromResponse(NSURLResponse *response, NSTimeInterval *expirationTime, NSString **entityTag, NSString **lastModified) {
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return NO;
+    }
+    
+    NSDictionary *headers = [(NSHTTPURLResponse *)response allHeaderFields];
+    NSString *cacheControl = SDImageCacheHeaderValue(headers, @"Cache-Control");
+    NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+    BOOL mustRevalidate = NO;
+    double maxAge = -1;
+    
+    for (NSString *directive in [cacheControl componentsSeparatedByString:@","]) {
+        NSString *trimmedDirective = [[directive stringByTrimmingCharactersInSet:whitespace] lowercaseString];
+        
+        if ([trimmedDirective isEqualToString:@"no-cache"] || [trimmedDirective isEqualToString:@"no-store"]) {
+            mustRevalidate = YES;
+        } else if ([trimmedDirective hasPrefix:@"max-age="]) {
+            maxAge = MAX(0, [[trimmedDirective substringFromIndex:8] doubleValue]);
+        }
+    }
+    
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    
+    if (mustRevalidate) {
+        *expirationTime = now; // Stale right away, revalidated on every refresh
+    } else if (maxAge >= 0) {
+        // Time the response already spent in shared caches on the way counts against its lifetime
+        double age = MAX(0, [SDImageCacheHeaderValue(headers, @"Age") doubleValue]);
+        *expirationTime = now + MAX(0, maxAge - age);
+    } else {
+        *expirationTime = 0;
+    }
+    
+    *entityTag = SDImageCacheHeaderValue(headers, @"ETag");
+    *lastModified = SDImageCacheHeaderValue(headers, @"Last-Modified");
+    
+    return YES;
+}
+
+static inline uint64_t SDImageCacheRotateLeft64(uint64_t x, int8_t r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t SDImageCacheFinalizationMix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t SDImageCacheReadLittleEndian64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    for (NSUInteger i = 0; i < 8; ++i) {
+        value |= (uint64_t)bytes[i] << (i * 8);
+    }
+    return value;
+}
+
+// MurmurHash3 x64 128 (public domain, Austin Appleby). Not meant to resist attacks, only to spread keys evenly; the
+// digest is written little-endian so file names don't depend on the byte order of the device.
+static void SDImageCacheMurmurHash3(const uint8_t *bytes, NSUInteger length, unsigned char digest[16]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const NSUInteger blockCount = length / 16;
+    uint64_t h1 = 0, h2 = 0;
+    
+    for (NSUInteger i = 0; i < blockCount; ++i) {
+        uint64_t k1 = SDImageCacheReadLittleEndian64(bytes + i * 16);
+        uint64_t k2 = SDImageCacheReadLittleEndian64(bytes + i * 16 + 8);
+        
+        k1 *= c1; k1 = SDImageCacheRotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = SDImageCacheRotateLeft64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        
+        k2 *= c2; k2 = SDImageCacheRotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = SDImageCacheRotateLeft64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    
+    const uint8_t *tail = bytes + blockCount * 16;
+    uint64_t k1 = 0, k2 = 0;
+    
+    switch (length & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48;
+        case 14: k2 ^= (uint64_t)tail[13] << 40;
+        case 13: k2 ^= (uint64_t)tail[12] << 32;
+        case 12: k2 ^= (uint64_t)tail[11] << 24;
+        case 11: k2 ^= (uint64_t)tail[10] << 16;
+        case 10: k2 ^= (uint64_t)tail[9] << 8;
+        case 9:  k2 ^= (uint64_t)tail[8];
+            k2 *= c2; k2 = SDImageCacheRotateLeft64(k2, 33); k2 *= c1; h2 ^= k2;
+        case 8:  k1 ^= (uint64_t)tail[7] << 56;
+        case 7:  k1 ^= (uint64_t)tail[6] << 48;
+        case 6:  k1 ^= (uint64_t)tail[5] << 40;
+        case 5:  k1 ^= (uint64_t)tail[4] << 32;
+        case 4:  k1 ^= (uint64_t)tail[3] << 24;
+        case 3:  k1 ^= (uint64_t)tail[2] << 16;
+        case 2:  k1 ^= (uint64_t)tail[1] << 8;
+        case 1:  k1 ^= (uint64_t)tail[0];
+            k1 *= c1; k1 = SDImageCacheRotateLeft64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = SDImageCacheFinalizationMix64(h1);
+    h2 = SDImageCacheFinalizationMix64(h2);
+    h1 += h2; h2 += h1;
+    
+    for (NSUInteger i = 0; i < 8; ++i) {
+        digest[i] = (unsigned char)(h1 >> (i * 8));
+        digest[i + 8] = (unsigned char)(h2 >> (i * 8));
+    }
+}
+
+// File name of a key in the sharded layout
+static NSString *SDImageCacheShardedFileNameForKey(NSString *key) {
+    // Typical keys are URLs that fit on the stack, which saves the autoreleased copy behind UTF8String
+    uint8_t buffer[512];
+    NSUInteger length = 0;
+    NSRange remainingRange = NSMakeRange(0, 0);
+    const uint8_t *bytes = buffer;
+    
+    if (![key getBytes:buffer maxLength:sizeof(buffer) usedLength:&length encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, key.length) remainingRange:&remainingRange] || remainingRange.length) {
+        const char *str = [key UTF8String] ?: "";
+        bytes = (const uint8_t *)str;
+        length = strlen(str);
+    }
+    
+    unsigned char digest[16];
+    SDImageCacheMurmurHash3(bytes, length, digest);
+    
+    return SDImageCacheIndexFileNameFromDigest(digest);
+}
+
 @interface SDImageCache ()
 
 @property (strong, nonatomic) NSString *diskCachePath;
-@property (strong, nonatomic) NSMutableArray *customPaths;
+@property (strong, atomic) NSArray *customPaths; // Replaced, never mutated, so readers can enumerate it from any thread
+@property (strong, atomic) NSDictionary *customPathFilters; // Read-only path -> SDImageCacheLookupFilter, same rule
+// Serializes every disk mutation (stores, removals, cleanup)
 @property (SDDispatchQueueSetterSementics, nonatomic) dispatch_queue_t ioQueue;
+// Runs asynchronous disk reads concurrently, independently from ioQueue
+@property (strong, nonatomic) NSOperationQueue *readQueue;
+@property (strong, nonatomic) SDImageCacheIndex *index;
+@property (strong, nonatomic) SDImageCacheSegmentStore *segmentStore;
+@property (strong, nonatomic) SDImageCacheBitmapStore *bitmapStore;
+// Deduplicated payloads, named after a digest of their content
+@property (strong, nonatomic) NSString *contentDirectory;
+// contentFileName -> number of index entries sharing it, guarded by @synchronized (contentReferenceCounts), mutated on ioQueue
+@property (strong, nonatomic) NSMutableDictionary *contentReferenceCounts;
+// Encoded data of recently downloaded or read images, key -> NSData, cost = length
+@property (strong, nonatomic) SDImageMemoryCache *encodedMemCache;
+// Write-behind queue, all guarded by @synchronized (pendingWrites)
+@property (strong, nonatomic) NSMutableDictionary *pendingWrites; // key -> SDImageCachePendingWrite
+@property (strong, nonatomic) NSMutableArray *pendingWriteQueue; // FIFO, may hold superseded writes (skipped when popped)
+@property (strong, nonatomic) NSMutableArray *pendingLowPriorityWriteQueue; // Same, for SDImageCacheWritePriorityLow
+@property (assign, nonatomic, readwrite) NSUInteger pendingWriteBytes;
+@property (assign, nonatomic, readwrite) NSUInteger droppedWriteCount;
+@property (assign, nonatomic, readwrite) NSTimeInterval averageWriteLatency;
+@property (assign, nonatomic) BOOL flushScheduled;
+@property (strong, nonatomic, readwrite) SDWebImageStatistics *statistics;
+// Keys loaded by the launch warm-up and not hit since, guarded by @synchronized (warmedUpKeys). Nil until a warm-up starts.
+@property (strong, atomic) NSMutableSet *warmedUpKeys;
+@property (strong, nonatomic) SDImageCacheCleanup *cleanup; // Nil while no cleanup runs, ioQueue only
+@property (assign, atomic, readwrite) double cleanupProgress;
 
 @end
 
 
 @implementation SDImageCache {
     NSFileManager *_fileManager;
+    
+    // Lookups on the default path answered by the index
+    volatile int64_t _indexLookupCount;
+    volatile int64_t _indexNegativeCount;
+    volatile int64_t _indexFalsePositiveCount;
+    
+    // Guarded by @synchronized (contentReferenceCounts)
+    unsigned long long _contentBytes;      // Bytes of the content blobs on disk
+    unsigned long long _deduplicatedBytes; // Bytes the blobs would take again if every key held its own copy
+    
+    // Memory warnings, main thread only
+    CFAbsoluteTime _lastMemoryWarningTime;
+    SDImageCacheMemoryPressure _lastMemoryWarningPressure;
+    
+    volatile int64_t _memoryPressureCounts[SDImageCacheMemoryPressureLevelCount];
+    volatile int64_t _memoryPressureFreedBytes[SDImageCacheMemoryPressureLevelCount];
+    
+    volatile int64_t _cleanupRunCount;
+    volatile int64_t _cleanupResumeCount;
+    volatile int64_t _cleanupSliceCount;
+    volatile int64_t _cleanupYieldCount;
 }
 
 + (SDImageCache *)sharedImageCache {
@@ -53,12 +317,39 @@ static NSData *kPNGSignatureData = nil;
         // Create IO serial queue
         _ioQueue = dispatch_queue_create("com.hackemist.SDWebImageCache", DISPATCH_QUEUE_SERIAL);
         
+        // Create the bounded read pool
+        _readQueue = [NSOperationQueue new];
+        _readQueue.name = @"com.hackemist.SDWebImageCache.read";
+        _readQueue.maxConcurrentOperationCount = kDefaultMaxConcurrentDiskReads;
+        
         // Init default values
         _maxCacheAge = kDefaultCacheMaxCacheAge;
+        _packedStorageThreshold = kDefaultPackedStorageThreshold;
+        _mappedReadThreshold = kDefaultMappedReadThreshold;
+        _maxPendingWriteBytes = kDefaultMaxPendingWriteBytes;
+        _evictionPolicy = [SDImageCacheGDSFEvictionPolicy new];
+        _diskCacheHighWatermark = kDefaultDiskCacheHighWatermark;
+        _diskCacheLowWatermark = kDefaultDiskCacheLowWatermark;
+        _memoryPressureIdleTime = kDefaultMemoryPressureIdleTime;
+        _cleanupSliceEntryLimit = kDefaultCleanupSliceEntryLimit;
+        _cleanupSliceTimeLimit = kDefaultCleanupSliceTimeLimit;
+        _cleanupProgress = 1;
+        _statistics = [SDWebImageStatistics new];
+        
+        // Init the write-behind queue
+        _pendingWrites = [NSMutableDictionary new];
+        _pendingWriteQueue = [NSMutableArray new];
+        _pendingLowPriorityWriteQueue = [NSMutableArray new];
+        _contentReferenceCounts = [NSMutableDictionary new];
         
         // Init the memory cache
-        _memCache = [[NSCache alloc] init];
+        _memCache = [[SDImageMemoryCache alloc] init];
         _memCache.name = fullNamespace;
+        _memCache.totalCostLimit = (NSUInteger)MIN([NSProcessInfo processInfo].physicalMemory / kDefaultMemoryCostDivisor, NSUIntegerMax);
+        
+        _encodedMemCache = [[SDImageMemoryCache alloc] init];
+        _encodedMemCache.name = [fullNamespace stringByAppendingString:@".encoded"];
+        _encodedMemCache.totalCostLimit = kDefaultMaxEncodedMemoryCost;
         
         // Init the disk cache
         NSArray *paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
@@ -68,11 +359,39 @@ static NSData *kPNGSignatureData = nil;
             _fileManager = [NSFileManager new];
         });
 
+        // Load the disk index in the background, queries against it wait for the load to finish
+        _index = [[SDImageCacheIndex alloc] initWithDirectory:_diskCachePath];
+        [_index load];
+        
+        _segmentStore = [[SDImageCacheSegmentStore alloc] initWithDirectory:[_diskCachePath stringByAppendingPathComponent:@"segments"]];
+        _contentDirectory = [_diskCachePath stringByAppendingPathComponent:@"contents"];
+        dispatch_async(_ioQueue, ^{
+            [self _loadSegmentStore];
+            [self _loadContentReferenceCounts];
+            
+            // Finish the cleanup the previous session was interrupted in
+            [self _startCleanupResuming:YES completionBlock:nil];
+        });
+        
+        _bitmapStore = [[SDImageCacheBitmapStore alloc] initWithDirectory:[_diskCachePath stringByAppendingPathComponent:@"bitmaps"]];
+        _bitmapStore.maxSize = kDefaultMaxDecodedBitmapCacheSize;
+
 #if TARGET_OS_IPHONE
         // Subscribe to app events
         
+        // Registered before the cleanup below, so the snapshot is queued ahead of it and covered by its background task
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_saveHotSetSnapshotIfNeeded)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_saveHotSetSnapshotIfNeeded)
+                                                     name:UIApplicationWillTerminateNotification
+                                                   object:nil];
+        
         [[NSNotificationCenter defaultCenter] addObserver:self
-                                                 selector:@selector(clearMemory)
+                                                 selector:@selector(_didReceiveMemoryWarning)
                                                      name:UIApplicationDidReceiveMemoryWarningNotification
                                                    object:nil];
         
@@ -97,15 +416,96 @@ static NSData *kPNGSignatureData = nil;
 }
 
 - (void)addReadOnlyCachePath:(NSString *)path {
-    if (!self.customPaths) {
-        self.customPaths = [NSMutableArray new];
+    @synchronized (self) {
+        NSArray *customPaths = self.customPaths ?: @[];
+
+        if (![customPaths containsObject:path]) {
+            self.customPaths = [customPaths arrayByAddingObject:path];
+            [self _buildLookupFilterForReadOnlyCachePath:path];
+        }
+    }
+}
+
+- (void)_buildLookupFilterForReadOnlyCachePath:(NSString *)path {
+    // Read-only paths never change once added, so the filter is built once and never updated. Until it's ready the
+    // path is probed as before.
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        @autoreleasepool {
+            NSArray *fileNames = [[NSFileManager new] contentsOfDirectoryAtPath:path error:NULL];
+            SDImageCacheLookupFilter *filter = [[SDImageCacheLookupFilter alloc] initWithCapacity:fileNames.count falsePositiveRate:kLookupFilterFalsePositiveRate];
+            
+            for (NSString *fileName in fileNames) {
+                [filter addFileName:fileName];
+            }
+            
+            @synchronized (self) {
+                NSMutableDictionary *customPathFilters = [NSMutableDictionary dictionaryWithDictionary:self.customPathFilters];
+                customPathFilters[path] = filter;
+                self.customPathFilters = customPathFilters;
+            }
+        }
+    });
+}
+
+- (NSDictionary *)lookupFilterStatistics {
+    NSMutableDictionary *statistics = [NSMutableDictionary new];
+    
+    int64_t lookups = _indexLookupCount, negatives = _indexNegativeCount, falsePositives = _indexFalsePositiveCount;
+    statistics[self.diskCachePath] = @{@"lookups": @(lookups),
+                                       @"negatives": @(negatives),
+                                       @"falsePositives": @(falsePositives),
+                                       @"falsePositiveRate": @(negatives + falsePositives > 0 ? (double)falsePositives / (negatives + falsePositives) : 0),
+                                       @"expectedFalsePositiveRate": @0};
+    
+    NSDictionary *customPathFilters = self.customPathFilters;
+    for (NSString *path in customPathFilters) {
+        statistics[path] = [customPathFilters[path] statistics];
     }
+    
+    return statistics;
+}
 
-    if (![self.customPaths containsObject:path]) {
-        [self.customPaths addObject:path];
+- (void)addToMemoryBudget:(SDImageMemoryBudget *)budget weight:(double)weight minimumCost:(NSUInteger)minimumCost {
+    if ([self.memCache isKindOfClass:[SDImageMemoryCache class]]) {
+        [budget addCache:(SDImageMemoryCache *)self.memCache name:self.memCache.name weight:weight minimumCost:minimumCost];
     }
 }
 
+- (void)setMaxConcurrentDiskReads:(NSInteger)maxConcurrentDiskReads {
+    self.readQueue.maxConcurrentOperationCount = maxConcurrentDiskReads;
+}
+
+- (void)setMaxDecodedBitmapCacheSize:(unsigned long long)maxDecodedBitmapCacheSize {
+    dispatch_async(self.ioQueue, ^{
+        self.bitmapStore.maxSize = maxDecodedBitmapCacheSize;
+        [self.bitmapStore trimToSize:maxDecodedBitmapCacheSize];
+    });
+}
+
+- (unsigned long long)maxDecodedBitmapCacheSize {
+    return self.bitmapStore.maxSize;
+}
+
+- (NSInteger)maxConcurrentDiskReads {
+    return self.readQueue.maxConcurrentOperationCount;
+}
+
+- (void)setShouldCacheEncodedDataInMemory:(BOOL)shouldCacheEncodedDataInMemory {
+    _shouldCacheEncodedDataInMemory = shouldCacheEncodedDataInMemory;
+    
+    if (!shouldCacheEncodedDataInMemory) {
+        [self.encodedMemCache removeAllObjects];
+    }
+}
+
+- (void)setMaxEncodedMemoryCost:(NSUInteger)maxEncodedMemoryCost {
+    self.encodedMemCache.totalCostLimit = maxEncodedMemoryCost;
+}
+
+- (NSUInteger)maxEncodedMemoryCost {
+    return self.encodedMemCache.totalCostLimit;
+}
+
 #pragma mark SDImageCache (private)
 
 - (NSString *)cachePathForKey:(NSString *)key inPath:(NSString *)path {
@@ -114,9 +514,11 @@ static NSData *kPNGSignatureData = nil;
 }
 
 - (NSString *)defaultCachePathForKey:(NSString *)key {
-    return [self cachePathForKey:key inPath:self.diskCachePath];
+    BOOL sharded = self.diskLayout == SDImageCacheDiskLayoutSharded;
+    return [self _pathForFileName:[self _fileNameForKey:key sharded:sharded] sharded:sharded];
 }
 
+// File name of a key in the flat layout, also the one of the read-only paths
 - (NSString *)cachedFileNameForKey:(NSString *)key {
     const char *str = [key UTF8String];
     if (str == NULL) {
@@ -124,50 +526,553 @@ static NSData *kPNGSignatureData = nil;
     }
     unsigned char r[CC_MD5_DIGEST_LENGTH];
     CC_MD5(str, (CC_LONG)strlen(str), r);
-    NSString *filename = [NSString stringWithFormat:@"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-                                                    r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10], r[11], r[12], r[13], r[14], r[15]];
 
-    return filename;
+    return SDImageCacheIndexFileNameFromDigest(r);
+}
+
+- (NSString *)_fileNameForKey:(NSString *)key sharded:(BOOL)sharded {
+    return sharded ? SDImageCacheShardedFileNameForKey(key) : [self cachedFileNameForKey:key];
+}
+
+- (NSString *)_fileNameForKey:(NSString *)key {
+    return [self _fileNameForKey:key sharded:self.diskLayout == SDImageCacheDiskLayoutSharded];
+}
+
+// The file name the index holds a key under: the one of the current layout, or its flat layout name until it's migrated
+- (NSString *)_indexedFileNameForKey:(NSString *)key {
+    if (self.diskLayout != SDImageCacheDiskLayoutSharded) {
+        return [self cachedFileNameForKey:key];
+    }
+    
+    NSString *fileName = SDImageCacheShardedFileNameForKey(key);
+    
+    // The MD5 is only worth computing while flat entries are left
+    if (!self.index.isLoaded || self.index.flatCount == 0 || [self.index containsFileName:fileName]) {
+        return fileName;
+    }
+    
+    NSString *flatFileName = [self cachedFileNameForKey:key];
+    return [self.index containsFileName:flatFileName] ? flatFileName : fileName;
+}
+
+- (NSString *)_pathForFileName:(NSString *)fileName sharded:(BOOL)sharded {
+    if (!sharded || fileName.length != 32) {
+        return [self.diskCachePath stringByAppendingPathComponent:fileName];
+    }
+    
+    // "ab/cd/abcd…"
+    char relativePath[6 + 32];
+    [fileName getBytes:relativePath + 6 maxLength:32 usedLength:NULL encoding:NSASCIIStringEncoding options:0 range:NSMakeRange(0, 32) remainingRange:NULL];
+    relativePath[0] = relativePath[6];
+    relativePath[1] = relativePath[7];
+    relativePath[2] = '/';
+    relativePath[3] = relativePath[8];
+    relativePath[4] = relativePath[9];
+    relativePath[5] = '/';
+    
+    return [self.diskCachePath stringByAppendingPathComponent:[[NSString alloc] initWithBytes:relativePath length:sizeof(relativePath) encoding:NSASCIIStringEncoding]];
 }
 
 #pragma mark ImageCache
 
 - (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk {
+    [self storeImage:image recalculateFromImage:recalculate imageData:imageData forKey:key toDisk:toDisk priority:SDImageCacheWritePriorityDefault];
+}
+
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk priority:(SDImageCacheWritePriority)priority {
+    [self storeImage:image recalculateFromImage:recalculate imageData:imageData forKey:key toDisk:toDisk priority:priority response:nil];
+}
+
+- (void)storeImage:(UIImage *)image recalculateFromImage:(BOOL)recalculate imageData:(NSData *)imageData forKey:(NSString *)key toDisk:(BOOL)toDisk priority:(SDImageCacheWritePriority)priority response:(NSURLResponse *)response {
     if (!image || !key) {
         return;
     }
     
-    CGFloat cost = image.size.height * image.size.width * image.scale;
-    [self.memCache setObject:image forCachePairKey:key cost:cost];
+    // Low priority stores are typically prefetches, not yet displayed
+    [self _cacheImageInMemory:image forKey:key options:(priority == SDImageCacheWritePriorityLow ? SDImageMemoryCacheObjectSpeculative : 0)];
+    
+    // The server data is what a later read would decode; a recalculated image makes whatever we held stale
+    if (self.shouldCacheEncodedDataInMemory && !recalculate && imageData) {
+        [self _cacheEncodedData:imageData forKey:key];
+    } else {
+        [self.encodedMemCache removeObjectForKey:key];
+    }
     
     if (toDisk) {
-        dispatch_async(_ioQueue, ^{
-            NSData *data = imageData;
-            
-            if (image && (recalculate || !data)) {
-                #if TARGET_OS_IPHONE
-                    NSString *contentType = [NSData contentTypeForImageData:imageData];
-                    
-                    if ([contentType isEqualToString:@"image/png"] || [contentType isEqualToString:@"image/apng"] || [contentType isEqualToString:@"image/gif"])
-                        data = UIImagePNGRepresentation(image);
-                    else
-                        data = UIImageJPEGRepresentation(image, 0.95f);
-                #else
-                    data = [NSBitmapImageRep representationOfImageRepsInArray:image.representations usingType: NSJPEGFileType properties:nil];
-                #endif
+        SDImageCachePendingWrite *write = [SDImageCachePendingWrite new];
+        write.key = key;
+        write.priority = priority;
+        write.enqueueTime = CFAbsoluteTimeGetCurrent();
+        
+        // Only keep what the flush needs: the server data, or the image plus the hint for its encoding
+        if (recalculate || !imageData) {
+            write.image = image;
+            write.contentType = [NSData contentTypeForImageData:imageData];
+            write.cost = SDImageMemoryCostForImage(image);
+        } else {
+            write.data = imageData;
+            write.cost = imageData.length;
+        }
+        
+        NSTimeInterval expirationTime = 0;
+        NSString *entityTag = nil, *lastModified = nil;
+        if (SDImageCacheHTTPMetadataFromResponse(response, &expirationTime, &entityTag, &lastModified)) {
+            write.expirationTime = expirationTime;
+            // Validators describe the server data; a recalculated image can't be revalidated with them
+            if (!recalculate) {
+                write.entityTag = entityTag;
+                write.lastModified = lastModified;
             }
+        }
+        
+        [self _enqueuePendingWrite:write];
+    }
+}
+
+#pragma mark Write-behind queue
+
+- (void)_enqueuePendingWrite:(SDImageCachePendingWrite *)write {
+    @synchronized (self.pendingWrites) {
+        if (write.priority == SDImageCacheWritePriorityLow && self.pendingWriteBytes + write.cost > self.maxPendingWriteBytes) {
+            self.droppedWriteCount++;
+            return;
+        }
+        
+        SDImageCachePendingWrite *supersededWrite = self.pendingWrites[write.key];
+        if (supersededWrite) {
+            self.pendingWriteBytes -= supersededWrite.cost;
+        }
+        
+        self.pendingWrites[write.key] = write;
+        self.pendingWriteBytes += write.cost;
+        [(write.priority == SDImageCacheWritePriorityLow ? self.pendingLowPriorityWriteQueue : self.pendingWriteQueue) addObject:write];
+        
+        // Make room for default priority writes by giving up on the oldest low priority ones
+        while (self.pendingWriteBytes > self.maxPendingWriteBytes && self.pendingLowPriorityWriteQueue.count) {
+            SDImageCachePendingWrite *droppedWrite = self.pendingLowPriorityWriteQueue[0];
+            [self.pendingLowPriorityWriteQueue removeObjectAtIndex:0];
             
-            if (data) {
-                if (![_fileManager fileExistsAtPath:_diskCachePath]) {
-                    [_fileManager createDirectoryAtPath:_diskCachePath withIntermediateDirectories:YES attributes:nil error:NULL];
+            if (self.pendingWrites[droppedWrite.key] == droppedWrite) {
+                [self.pendingWrites removeObjectForKey:droppedWrite.key];
+                self.pendingWriteBytes -= droppedWrite.cost;
+                self.droppedWriteCount++;
+            }
+        }
+        
+        if (!self.flushScheduled) {
+            self.flushScheduled = YES;
+            dispatch_async(self.ioQueue, ^{
+                [self _flushPendingWrites];
+            });
+        }
+    }
+}
+
+- (SDImageCachePendingWrite *)_pendingWriteForKey:(NSString *)key {
+    @synchronized (self.pendingWrites) {
+        return self.pendingWrites[key];
+    }
+}
+
+- (void)_cancelPendingWriteForKey:(NSString *)key {
+    @synchronized (self.pendingWrites) {
+        SDImageCachePendingWrite *write = self.pendingWrites[key];
+        if (write) {
+            [self.pendingWrites removeObjectForKey:key];
+            self.pendingWriteBytes -= write.cost;
+        }
+    }
+}
+
+- (void)_cancelAllPendingWrites {
+    @synchronized (self.pendingWrites) {
+        [self.pendingWrites removeAllObjects];
+        [self.pendingWriteQueue removeAllObjects];
+        [self.pendingLowPriorityWriteQueue removeAllObjects];
+        self.pendingWriteBytes = 0;
+    }
+}
+
+- (NSArray *)_nextPendingWriteBatch {
+    NSMutableArray *batch = [NSMutableArray new];
+    
+    @synchronized (self.pendingWrites) {
+        for (NSMutableArray *queue in @[self.pendingWriteQueue, self.pendingLowPriorityWriteQueue]) {
+            while (batch.count < kPendingWriteBatchSize && queue.count) {
+                SDImageCachePendingWrite *write = queue[0];
+                [queue removeObjectAtIndex:0];
+                
+                // Skip writes superseded or cancelled since they were queued
+                if (self.pendingWrites[write.key] == write) {
+                    [batch addObject:write];
                 }
+            }
+        }
+    }
+    
+    return batch;
+}
 
-                [_fileManager createFileAtPath:[self defaultCachePathForKey:key] contents:data attributes:nil];
+- (void)_flushPendingWrites { // Already on ioQueue
+    // One batch per block, so removals and cleanup queued meanwhile don't wait for the whole backlog
+    for (SDImageCachePendingWrite *write in [self _nextPendingWriteBatch]) {
+        @autoreleasepool {
+            NSData *data = write.data ?: [self _encodedDataForPendingWrite:write];
+            
+            if (data && [self _storeImageData:data forKey:write.key] && (write.expirationTime > 0 || write.entityTag || write.lastModified)) {
+                [self.index revalidateFileName:[self _fileNameForKey:write.key] expirationTime:write.expirationTime entityTag:write.entityTag lastModified:write.lastModified];
             }
-        });
+            
+            @synchronized (self.pendingWrites) {
+                // Readers were served from the pending write until now; a newer write or a removal may have replaced it meanwhile
+                if (self.pendingWrites[write.key] == write) {
+                    [self.pendingWrites removeObjectForKey:write.key];
+                    self.pendingWriteBytes -= write.cost;
+                }
+                
+                NSTimeInterval latency = CFAbsoluteTimeGetCurrent() - write.enqueueTime;
+                self.averageWriteLatency = self.averageWriteLatency > 0 ? self.averageWriteLatency + kWriteLatencySmoothing * (latency - self.averageWriteLatency) : latency;
+            }
+        }
+    }
+    
+    [self _evictIfAboveHighWatermark];
+    
+    @synchronized (self.pendingWrites) {
+        if (self.pendingWriteQueue.count || self.pendingLowPriorityWriteQueue.count) {
+            dispatch_async(self.ioQueue, ^{
+                [self _flushPendingWrites];
+            });
+        } else {
+            self.flushScheduled = NO;
+        }
     }
 }
 
+- (NSData *)_encodedDataForPendingWrite:(SDImageCachePendingWrite *)write {
+    #if TARGET_OS_IPHONE
+        NSString *contentType = write.contentType;
+        
+        if ([contentType isEqualToString:@"image/png"] || [contentType isEqualToString:@"image/apng"] || [contentType isEqualToString:@"image/gif"])
+            return UIImagePNGRepresentation(write.image);
+        else
+            return UIImageJPEGRepresentation(write.image, 0.95f);
+    #else
+        return [NSBitmapImageRep representationOfImageRepsInArray:write.image.representations usingType: NSJPEGFileType properties:nil];
+    #endif
+}
+
+- (NSDictionary *)statisticsSnapshot {
+    NSMutableDictionary *snapshot = [[self.statistics snapshot] mutableCopy];
+    
+    if ([self.memCache isKindOfClass:[SDImageMemoryCache class]]) {
+        snapshot[@"memoryCache"] = [(SDImageMemoryCache *)self.memCache statistics];
+        
+        SDImageMemoryBudget *memoryBudget = [(SDImageMemoryCache *)self.memCache memoryBudget];
+        if (memoryBudget) {
+            snapshot[@"memoryBudget"] = [memoryBudget usage];
+        }
+    }
+    
+    if (self.shouldCacheEncodedDataInMemory) {
+        snapshot[@"encodedMemoryCache"] = [self.encodedMemCache statistics];
+    }
+    
+    if (self.shouldDeduplicateDiskCache) {
+        @synchronized (self.contentReferenceCounts) {
+            NSUInteger referenceCount = 0;
+            for (NSNumber *count in [self.contentReferenceCounts objectEnumerator]) {
+                referenceCount += count.unsignedIntegerValue;
+            }
+            
+            snapshot[@"deduplication"] = @{@"contents": @(self.contentReferenceCounts.count),
+                                           @"references": @(referenceCount),
+                                           @"contentBytes": @(_contentBytes),
+                                           @"savedBytes": @(_deduplicatedBytes),
+                                           @"ratio": @(_contentBytes > 0 ? (double)(_contentBytes + _deduplicatedBytes) / _contentBytes : 1)};
+        }
+    }
+    
+    NSArray *memoryPressureNames = @[@"low", @"moderate", @"critical"];
+    NSMutableDictionary *memoryPressure = [NSMutableDictionary new];
+    for (NSUInteger pressure = 0; pressure < SDImageCacheMemoryPressureLevelCount; ++pressure) {
+        memoryPressure[memoryPressureNames[pressure]] = @{@"count": @(OSAtomicAdd64(0, &_memoryPressureCounts[pressure])),
+                                                          @"freedBytes": @(OSAtomicAdd64(0, &_memoryPressureFreedBytes[pressure]))};
+    }
+    snapshot[@"memoryPressure"] = memoryPressure;
+    
+    snapshot[@"cleanup"] = @{@"progress": @(self.cleanupProgress),
+                             @"runs": @(OSAtomicAdd64(0, &_cleanupRunCount)),
+                             @"resumed": @(OSAtomicAdd64(0, &_cleanupResumeCount)),
+                             @"slices": @(OSAtomicAdd64(0, &_cleanupSliceCount)),
+                             @"yields": @(OSAtomicAdd64(0, &_cleanupYieldCount))};
+    
+    snapshot[@"pendingWrites"] = @{@"count": @(self.pendingWriteCount),
+                                   @"bytes": @(self.pendingWriteBytes),
+                                   @"dropped": @(self.droppedWriteCount),
+                                   @"averageLatency": @(self.averageWriteLatency)};
+    
+    return snapshot;
+}
+
+- (NSUInteger)pendingWriteCount {
+    @synchronized (self.pendingWrites) {
+        return self.pendingWrites.count;
+    }
+}
+
+- (NSUInteger)pendingWriteBytes {
+    @synchronized (self.pendingWrites) {
+        return _pendingWriteBytes;
+    }
+}
+
+- (NSUInteger)droppedWriteCount {
+    @synchronized (self.pendingWrites) {
+        return _droppedWriteCount;
+    }
+}
+
+- (NSTimeInterval)averageWriteLatency {
+    @synchronized (self.pendingWrites) {
+        return _averageWriteLatency;
+    }
+}
+
+#pragma mark Disk storage
+
+- (BOOL)_storeImageData:(NSData *)data forKey:(NSString *)key { // Already on ioQueue
+    BOOL sharded = self.diskLayout == SDImageCacheDiskLayoutSharded;
+    
+    if (![self _storeImageData:data fileName:[self _fileNameForKey:key sharded:sharded] sharded:sharded]) {
+        return NO;
+    }
+    
+    // The copy stored under the flat layout is outdated now
+    if (sharded && self.index.flatCount) {
+        SDImageCacheIndexEntry *flatEntry = [self.index entryForFileName:[self cachedFileNameForKey:key]];
+        if (flatEntry && !flatEntry.sharded) {
+            [self _removeDiskEntry:flatEntry];
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)_storeImageData:(NSData *)data fileName:(NSString *)fileName sharded:(BOOL)sharded { // Already on ioQueue
+    SDImageCacheIndexEntry *previousEntry = [self.index entryForFileName:fileName];
+    
+    // The decoded bitmap of the previous data is stale now
+    [self.bitmapStore removeFileName:fileName];
+    
+    // Small payloads are appended to a shared segment instead of paying for a file of their own
+    if (self.shouldUsePackedStorage && data.length <= self.packedStorageThreshold) {
+        uint32_t segment = 0;
+        uint64_t offset = 0;
+        
+        if ([self.segmentStore appendData:data fileName:fileName sharded:sharded segment:&segment offset:&offset]) {
+            if (previousEntry) {
+                [self _releaseDiskEntry:previousEntry];
+            }
+            
+            [self.index recordFileName:fileName size:data.length expirationTime:0 segment:segment offset:offset sharded:sharded];
+            [self.statistics addValue:data.length toCounter:SDWebImageStatisticsDiskBytesWritten];
+            return YES;
+        }
+    }
+    
+    if (self.shouldDeduplicateDiskCache && [self _storeContentData:data fileName:fileName sharded:sharded previousEntry:previousEntry]) {
+        return YES;
+    }
+    
+    NSString *path = [self _pathForFileName:fileName sharded:sharded];
+    
+    // Write aside and rename: a file being replaced may still be mapped by a reader, truncating it in place would fault that reader
+    BOOL written = [data writeToFile:path options:NSDataWritingAtomic error:NULL];
+    if (!written) {
+        // First file of its shard, or of the cache
+        [_fileManager createDirectoryAtPath:[path stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:NULL];
+        written = [data writeToFile:path options:NSDataWritingAtomic error:NULL];
+    }
+    
+    if (written) {
+        if (previousEntry.segment || previousEntry.contentFileName) {
+            [self _releaseDiskEntry:previousEntry];
+        }
+        
+        [self.index recordFileName:fileName size:data.length expirationTime:0 sharded:sharded];
+        [self.statistics addValue:data.length toCounter:SDWebImageStatisticsDiskBytesWritten];
+        return YES;
+    }
+    
+    return NO;
+}
+
+#pragma mark Deduplicated storage
+
+- (NSString *)_contentFileNameForData:(NSData *)data {
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(data.bytes, (CC_LONG)data.length, digest);
+    
+    // 128 bits are plenty to tell payloads apart, and keep content names in the format of key names
+    return SDImageCacheIndexFileNameFromDigest(digest);
+}
+
+- (BOOL)_storeContentData:(NSData *)data fileName:(NSString *)fileName sharded:(BOOL)sharded previousEntry:(SDImageCacheIndexEntry *)previousEntry { // Already on ioQueue
+    NSString *contentFileName = [self _contentFileNameForData:data];
+    NSString *contentPath = [self.contentDirectory stringByAppendingPathComponent:contentFileName];
+    
+    // Another key may already hold the same bytes, then this one just points at them
+    if (![self _referenceCountForContentFileName:contentFileName] || ![_fileManager fileExistsAtPath:contentPath]) {
+        [_fileManager createDirectoryAtPath:self.contentDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+        
+        if (![data writeToFile:contentPath options:NSDataWritingAtomic error:NULL]) {
+            return NO;
+        }
+        
+        [self.statistics addValue:data.length toCounter:SDWebImageStatisticsDiskBytesWritten];
+    }
+    
+    // Take the new reference before dropping the previous one, both may be to the same content
+    [self _retainContentFileName:contentFileName size:data.length];
+    
+    if (previousEntry) {
+        [self _releaseDiskEntry:previousEntry];
+    }
+    
+    [self.index recordFileName:fileName size:data.length expirationTime:0 contentFileName:contentFileName sharded:sharded];
+    
+    return YES;
+}
+
+- (NSUInteger)_referenceCountForContentFileName:(NSString *)contentFileName {
+    @synchronized (self.contentReferenceCounts) {
+        return [self.contentReferenceCounts[contentFileName] unsignedIntegerValue];
+    }
+}
+
+- (void)_retainContentFileName:(NSString *)contentFileName size:(unsigned long long)size {
+    @synchronized (self.contentReferenceCounts) {
+        NSUInteger referenceCount = [self.contentReferenceCounts[contentFileName] unsignedIntegerValue];
+        self.contentReferenceCounts[contentFileName] = @(referenceCount + 1);
+        
+        if (referenceCount) {
+            _deduplicatedBytes += size;
+        } else {
+            _contentBytes += size;
+        }
+    }
+}
+
+- (void)_releaseContentFileName:(NSString *)contentFileName size:(unsigned long long)size { // Already on ioQueue
+    BOOL unreferenced = NO;
+    
+    @synchronized (self.contentReferenceCounts) {
+        NSUInteger referenceCount = [self.contentReferenceCounts[contentFileName] unsignedIntegerValue];
+        
+        if (referenceCount > 1) {
+            self.contentReferenceCounts[contentFileName] = @(referenceCount - 1);
+            _deduplicatedBytes -= MIN(size, _deduplicatedBytes);
+        } else {
+            [self.contentReferenceCounts removeObjectForKey:contentFileName];
+            if (referenceCount) _contentBytes -= MIN(size, _contentBytes);
+            unreferenced = YES;
+        }
+    }
+    
+    if (unreferenced) {
+        [_fileManager removeItemAtPath:[self.contentDirectory stringByAppendingPathComponent:contentFileName] error:nil];
+    }
+}
+
+- (void)_loadContentReferenceCounts { // Already on ioQueue
+    // Which keys point at which content is only known to the journal; if it was lost, so is the content
+    if (self.index.rebuilt) {
+        [_fileManager removeItemAtPath:self.contentDirectory error:nil];
+        return;
+    }
+    
+    for (SDImageCacheIndexEntry *entry in [self.index allEntries]) {
+        if (entry.contentFileName) {
+            [self _retainContentFileName:entry.contentFileName size:entry.size];
+        }
+    }
+    
+    // Content written right before a crash, with no entry pointing at it yet
+    for (NSString *contentFileName in [_fileManager contentsOfDirectoryAtPath:self.contentDirectory error:NULL]) {
+        if (![self _referenceCountForContentFileName:contentFileName]) {
+            [_fileManager removeItemAtPath:[self.contentDirectory stringByAppendingPathComponent:contentFileName] error:nil];
+        }
+    }
+}
+
+- (unsigned long long)_diskCacheSize {
+    unsigned long long totalSize = self.index.totalSize;
+    
+    @synchronized (self.contentReferenceCounts) {
+        return totalSize - MIN(_deduplicatedBytes, totalSize);
+    }
+}
+
+#pragma mark HTTP expiration
+
+- (BOOL)isDiskImageFreshForKey:(NSString *)key {
+    if (!key) return NO;
+    
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    
+    // A pending write supersedes whatever the index holds
+    SDImageCachePendingWrite *pendingWrite = [self _pendingWriteForKey:key];
+    if (pendingWrite) {
+        return pendingWrite.expirationTime > now;
+    }
+    
+    if (!self.index.isLoaded) return NO;
+    
+    return [self.index entryForFileName:[self _indexedFileNameForKey:key]].expirationTime > now;
+}
+
+- (NSDictionary *)revalidationHeadersForKey:(NSString *)key {
+    if (!key) return nil;
+    
+    NSString *entityTag = nil, *lastModified = nil;
+    
+    SDImageCachePendingWrite *pendingWrite = [self _pendingWriteForKey:key];
+    if (pendingWrite) {
+        entityTag = pendingWrite.entityTag;
+        lastModified = pendingWrite.lastModified;
+    } else if (self.index.isLoaded) {
+        SDImageCacheIndexEntry *entry = [self.index entryForFileName:[self _indexedFileNameForKey:key]];
+        entityTag = entry.entityTag;
+        lastModified = entry.lastModified;
+    }
+    
+    if (!entityTag && !lastModified) return nil;
+    
+    NSMutableDictionary *headers = [NSMutableDictionary new];
+    if (entityTag) headers[@"If-None-Match"] = entityTag;
+    if (lastModified) headers[@"If-Modified-Since"] = lastModified;
+    return headers;
+}
+
+- (void)refreshDiskImageForKey:(NSString *)key response:(NSURLResponse *)response {
+    NSTimeInterval expirationTime = 0;
+    NSString *entityTag = nil, *lastModified = nil;
+    
+    if (!key || !SDImageCacheHTTPMetadataFromResponse(response, &expirationTime, &entityTag, &lastModified)) {
+        return;
+    }
+    
+    dispatch_async(self.ioQueue, ^{
+        NSString *fileName = [self _indexedFileNameForKey:key];
+        SDImageCacheIndexEntry *entry = [self.index entryForFileName:fileName];
+        if (!entry) return;
+        
+        // A 304 only has to repeat the validators if they changed
+        [self.index revalidateFileName:fileName expirationTime:expirationTime entityTag:(entityTag ?: entry.entityTag) lastModified:(lastModified ?: entry.lastModified)];
+    });
+}
+
 - (void)storeImage:(UIImage *)image forKey:(NSString *)key {
     [self storeImage:image recalculateFromImage:YES imageData:nil forKey:key toDisk:YES];
 }
@@ -196,24 +1101,183 @@ static NSData *kPNGSignatureData = nil;
 }
 
 - (BOOL)imageFromDiskCacheExistsForKey:(NSString *)key {
-    __block BOOL exists = NO;
-    
-    dispatch_sync(_ioQueue, ^{
-        exists = [_fileManager fileExistsAtPath:[self defaultCachePathForKey:key]];
-    });
-    
-    return exists;
+    return [self _diskCacheExistsForKey:key];
 }
 
 - (void)imageFromDiskCacheExistsForKey:(NSString *)key completion:(SDWebImageCheckCacheCompletionBlock)completionBlock {
-    dispatch_async(_ioQueue, ^{
-        BOOL exists = [_fileManager fileExistsAtPath:[self defaultCachePathForKey:key]];
+    [self.readQueue addOperationWithBlock:^{
+        BOOL exists = [self _diskCacheExistsForKey:key];
         
         dispatch_async_main_queue(^{
             if (completionBlock)
                 completionBlock(exists);
         });
-    });
+    }];
+}
+
+- (BOOL)_diskCacheExistsForKey:(NSString *)key { // Any thread, writes are atomic renames so a file either exists whole or not at all
+    if ([self _pendingWriteForKey:key]) {
+        return YES;
+    }
+    
+    // Once loaded the index knows every entry of the default path, no need to hit the file system
+    if (self.index.isLoaded) {
+        OSAtomicIncrement64(&_indexLookupCount);
+        
+        if ([self.index containsFileName:[self _indexedFileNameForKey:key]]) {
+            return YES;
+        }
+        
+        OSAtomicIncrement64(&_indexNegativeCount);
+        return NO;
+    }
+    
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    
+    if (self.diskLayout == SDImageCacheDiskLayoutSharded && [fileManager fileExistsAtPath:[self _pathForFileName:SDImageCacheShardedFileNameForKey(key) sharded:YES]]) {
+        return YES;
+    }
+    
+    return [fileManager fileExistsAtPath:[self _pathForFileName:[self cachedFileNameForKey:key] sharded:NO]];
+}
+
+#pragma mark Lookups with a timeout
+
+- (SDImageCacheLookupResult)tryImageFromDiskCacheExistsForKey:(NSString *)key timeout:(NSTimeInterval)timeout {
+    if (!key) return SDImageCacheLookupResultNotFound;
+    
+    if ([self _pendingWriteForKey:key]) {
+        return SDImageCacheLookupResultFound;
+    }
+    
+    SDImageCacheIndexEntry *entry = nil;
+    if (![self.index getEntry:&entry forFileName:[self _indexedFileNameForKey:key] timeout:timeout]) {
+        return SDImageCacheLookupResultWouldBlock;
+    }
+    
+    OSAtomicIncrement64(&_indexLookupCount);
+    if (!entry) OSAtomicIncrement64(&_indexNegativeCount);
+    
+    return entry ? SDImageCacheLookupResultFound : SDImageCacheLookupResultNotFound;
+}
+
+- (SDImageCacheLookupResult)tryImageDataFromDiskCacheForKey:(NSString *)key timeout:(NSTimeInterval)timeout data:(NSData **)data {
+    if (!key) return SDImageCacheLookupResultNotFound;
+    
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + MAX(timeout, 0);
+    
+    NSData *foundData = self.shouldCacheEncodedDataInMemory ? [self.encodedMemCache objectForKey:key] : nil;
+    
+    if (foundData) {
+        [self.statistics addValue:1 toCounter:SDWebImageStatisticsEncodedMemoryHits];
+    } else {
+        if ([self _indexRulesOutKey:key deadline:deadline]) {
+            return SDImageCacheLookupResultNotFound;
+        }
+        
+        id diskData = nil;
+        SDImageCacheLookupResult result = [self _performDiskAccess:^id{
+            return [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
+        } deadline:deadline result:&diskData];
+        
+        if (result == SDImageCacheLookupResultWouldBlock) return result;
+        foundData = diskData;
+    }
+    
+    if (data) *data = foundData;
+    return foundData ? SDImageCacheLookupResultFound : SDImageCacheLookupResultNotFound;
+}
+
+- (SDImageCacheLookupResult)tryImageFromCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options timeout:(NSTimeInterval)timeout image:(UIImage **)image {
+    if (!key) return SDImageCacheLookupResultNotFound;
+    
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + MAX(timeout, 0);
+    
+    UIImage *foundImage = [self imageFromMemoryCacheForKey:key options:options];
+    
+    if (!foundImage) {
+        if ([self _indexRulesOutKey:key deadline:deadline]) {
+            return SDImageCacheLookupResultNotFound;
+        }
+        
+        id diskImage = nil;
+        SDImageCacheLookupResult result = [self _performDiskAccess:^id{
+            UIImage *cachedImage = [self _imageFromDiskCacheForKey:key options:(options & SDWebImageScaledLoadAsRetinaImage)];
+            
+            if (cachedImage) {
+                [self.memCache setObject:cachedImage forCachePairKey:key cost:SDImageMemoryCostForImage(cachedImage)];
+            }
+            
+            return cachedImage;
+        } deadline:deadline result:&diskImage];
+        
+        if (result == SDImageCacheLookupResultWouldBlock) return result;
+        foundImage = diskImage;
+    }
+    
+    if (image) *image = foundImage;
+    return foundImage ? SDImageCacheLookupResultFound : SDImageCacheLookupResultNotFound;
+}
+
+// YES if the key is known not to be cached on disk without reading anything: no pending write, no read-only path that
+// could hold it, and no index entry
+- (BOOL)_indexRulesOutKey:(NSString *)key deadline:(CFAbsoluteTime)deadline {
+    if (self.customPaths.count || [self _pendingWriteForKey:key]) {
+        return NO;
+    }
+    
+    SDImageCacheIndexEntry *entry = nil;
+    if (![self.index getEntry:&entry forFileName:[self _indexedFileNameForKey:key] timeout:deadline - CFAbsoluteTimeGetCurrent()]) {
+        return NO;
+    }
+    
+    OSAtomicIncrement64(&_indexLookupCount);
+    if (entry) return NO;
+    
+    OSAtomicIncrement64(&_indexNegativeCount);
+    [self.statistics addValue:1 toCounter:SDWebImageStatisticsDiskMisses];
+    return YES;
+}
+
+// Runs a disk access on the read queue, ahead of the queued reads, and waits for it until the deadline. Past it the
+// access still completes in the background; its result is dropped, but it warms the caches for the next lookup.
+- (SDImageCacheLookupResult)_performDiskAccess:(id (^)(void))access deadline:(CFAbsoluteTime)deadline result:(id *)result {
+    if (CFAbsoluteTimeGetCurrent() >= deadline) {
+        return SDImageCacheLookupResultWouldBlock;
+    }
+    
+    NSCondition *condition = [NSCondition new];
+    __block BOOL finished = NO;
+    __block id value = nil;
+    
+    NSBlockOperation *operation = [NSBlockOperation blockOperationWithBlock:^{
+        id accessResult = access();
+        
+        [condition lock];
+        value = accessResult;
+        finished = YES;
+        [condition signal];
+        [condition unlock];
+    }];
+    operation.queuePriority = NSOperationQueuePriorityVeryHigh;
+    [self.readQueue addOperation:operation];
+    
+    NSDate *limit = [NSDate dateWithTimeIntervalSinceReferenceDate:deadline];
+    
+    [condition lock];
+    while (!finished) {
+        if (![condition waitUntilDate:limit]) break;
+    }
+    BOOL accessFinished = finished;
+    id accessResult = value;
+    [condition unlock];
+    
+    if (!accessFinished) {
+        return SDImageCacheLookupResultWouldBlock;
+    }
+    
+    *result = accessResult;
+    return accessResult ? SDImageCacheLookupResultFound : SDImageCacheLookupResultNotFound;
 }
 
 - (UIImage *)imageFromCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options {
@@ -221,16 +1285,12 @@ static NSData *kPNGSignatureData = nil;
     
     if (image) return image;
     
-    __block UIImage *diskImage = nil;
+    // Reads don't need ioQueue, so don't queue up behind pending writes or a cleanup pass
+    UIImage *diskImage = [self _imageFromDiskCacheForKey:key options:(options & SDWebImageScaledLoadAsRetinaImage)];
     
-    dispatch_sync(_ioQueue, ^{
-        diskImage = [self _imageFromDiskCacheForKey:key options:(options & SDWebImageScaledLoadAsRetinaImage)];
-        
-        if (diskImage) {
-            CGFloat cost = diskImage.size.height * diskImage.size.width * diskImage.scale;
-            [self.memCache setObject:diskImage forCachePairKey:key cost:cost];
-        }
-    });
+    if (diskImage) {
+        [self.memCache setObject:diskImage forCachePairKey:key cost:SDImageMemoryCostForImage(diskImage)];
+    }
     
     return diskImage;
 }
@@ -238,6 +1298,18 @@ static NSData *kPNGSignatureData = nil;
 - (UIImage *)imageFromMemoryCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options {
     UIImage *image = [self.memCache objectForCachePairKey:key];
     
+    [self.statistics addValue:1 toCounter:(image ? SDWebImageStatisticsMemoryHits : SDWebImageStatisticsMemoryMisses)];
+    
+    NSMutableSet *warmedUpKeys = self.warmedUpKeys;
+    if (image && warmedUpKeys) {
+        @synchronized (warmedUpKeys) {
+            if ([warmedUpKeys containsObject:key]) {
+                [warmedUpKeys removeObject:key];
+                [self.statistics addValue:1 toCounter:SDWebImageStatisticsWarmUpHits];
+            }
+        }
+    }
+    
     if (image && options)
         image = [self scaledImageForKey:nil options:options image:image];
     
@@ -245,55 +1317,319 @@ static NSData *kPNGSignatureData = nil;
 }
 
 - (UIImage *)_imageFromDiskCacheForKey:(NSString *)key options:(SDWebImageScaledOptions)options {
-    NSData *data = [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
+    UIImage *image = nil;
+    NSString *fileName = nil;
+    NSTimeInterval readTime = 0;
+    
+    // A write still waiting for the IO queue is newer than anything on disk
+    SDImageCachePendingWrite *pendingWrite = [self _pendingWriteForKey:key];
+    if (pendingWrite.image) {
+        return [self scaledImageForKey:key options:options image:pendingWrite.image];
+    }
+    
+    if (self.shouldCacheDecodedBitmaps && !pendingWrite) {
+        fileName = [self _indexedFileNameForKey:key];
+        image = [self.bitmapStore imageForFileName:fileName];
+        
+        if (image) {
+            // Keep the encoded file as warm as its bitmap, evicting it would drop the bitmap too
+            [self.index touchFileName:fileName];
+            
+            [self.statistics addValue:1 toCounter:SDWebImageStatisticsDiskHits];
+            [self.statistics addValue:1 toCounter:SDWebImageStatisticsDecodedBitmapHits];
+            
+            // The stored scale reflects the options of the read that wrote the bitmap, apply ours instead
+            image = [[UIImage alloc] initWithCGImage:image.CGImage scale:[self _diskImageScaleForKey:key options:options] orientation:image.imageOrientation];
+            return [self scaledImageForKey:key options:options image:image];
+        }
+        
+        readTime = [NSDate timeIntervalSinceReferenceDate];
+    }
+    
+    // The pool unmaps the file once decoded, only images kept undecoded (animated or oversized) keep the mapping alive
+    @autoreleasepool {
+        NSData *data = [self _imageDataFromDiskCacheBySearchingAllCachePathsForKey:key mapped:self.shouldUseMappedReads];
+        
+        if (data) {
+            CFAbsoluteTime decodeStartTime = CFAbsoluteTimeGetCurrent();
+            
+            image = [UIImage sd_imageWithData:data scale:[self _diskImageScaleForKey:key options:options]];
+            
+            image = [self scaledImageForKey:key options:options image:image];
+            image = [UIImage decodedImageWithImage:image];
+            
+            [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - decodeStartTime inHistogram:SDWebImageStatisticsDecodeLatency];
+        }
+    }
+    
+    if (fileName && [self.bitmapStore canStoreImage:image]) {
+        UIImage *decodedImage = image;
+        
+        dispatch_async(self.ioQueue, ^{
+            // Only for images of the default path, and only if no store replaced the data since we read it
+            SDImageCacheIndexEntry *entry = [self.index entryForFileName:fileName];
+            
+            if (entry && entry.creationTime <= readTime && ![self.bitmapStore containsFileName:fileName]) {
+                [self.bitmapStore storeImage:decodedImage fileName:fileName];
+            }
+        });
+    }
+    
+    return image;
+}
+
+#pragma mark Hot set
+
+- (void)_saveHotSetSnapshotIfNeeded {
+    if (self.shouldSaveHotSetSnapshot) {
+        [self saveHotSetSnapshot];
+    }
+}
+
+- (void)saveHotSetSnapshot {
+    if (![self.memCache isKindOfClass:[SDImageMemoryCache class]]) return;
+    
+    // The memory cache already ranks its images by recency and reuse, keep its order
+    NSMutableArray *hotSet = [NSMutableArray new];
+    [(SDImageMemoryCache *)self.memCache enumerateKeysAndObjectsInRetentionOrderUsingBlock:^(id key, UIImage *image, NSUInteger cost, SDImageMemoryCacheObjectOptions options, BOOL *stop) {
+        // Animation frames and the like are rebuilt in memory under per-process keys, they never exist on disk
+        if ((options & SDImageMemoryCacheObjectRegenerable) || ![key isKindOfClass:[NSString class]]) return;
+        
+        [hotSet addObject:@{@"key": key,
+                            @"cost": @(cost),
+                            @"options": @(image.scale == 2 ? SDWebImageScaledLoadAsRetinaImage : 0)}];
+        *stop = hotSet.count >= kMaxHotSetCount;
+    }];
+    
+    // Right after a memory warning the cache is empty, keep the previous snapshot then
+    if (!hotSet.count) return;
+    
+    dispatch_async(self.ioQueue, ^{
+        NSData *data = [NSPropertyListSerialization dataWithPropertyList:hotSet format:NSPropertyListBinaryFormat_v1_0 options:0 error:NULL];
+        
+        if (![_fileManager fileExistsAtPath:_diskCachePath]) {
+            [_fileManager createDirectoryAtPath:_diskCachePath withIntermediateDirectories:YES attributes:nil error:NULL];
+        }
+        
+        [data writeToFile:[self.diskCachePath stringByAppendingPathComponent:kHotSetFileName] options:NSDataWritingAtomic error:NULL];
+    });
+}
+
+- (void)warmUpMemoryCacheWithTimeLimit:(NSTimeInterval)timeLimit costLimit:(NSUInteger)costLimit completion:(void (^)(NSUInteger imageCount, NSUInteger totalCost))completion {
+    NSMutableSet *warmedUpKeys = self.warmedUpKeys ?: [NSMutableSet new];
+    self.warmedUpKeys = warmedUpKeys;
+    
+    // Off ioQueue and the read pool: launch queries must not wait behind the warm-up
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeLimit;
+        NSUInteger maxCost = costLimit ?: NSUIntegerMax;
+        NSUInteger imageCount = 0, totalCost = 0;
+        
+        if (self.maxMemoryCost > 0) {
+            maxCost = MIN(maxCost, self.maxMemoryCost);
+        }
+        
+        NSData *data = [NSData dataWithContentsOfFile:[self.diskCachePath stringByAppendingPathComponent:kHotSetFileName]];
+        NSArray *hotSet = data ? [NSPropertyListSerialization propertyListWithData:data options:NSPropertyListImmutable format:NULL error:NULL] : nil;
+        BOOL checksMemoryCache = [self.memCache isKindOfClass:[SDImageMemoryCache class]];
+        
+        for (NSDictionary *item in ([hotSet isKindOfClass:[NSArray class]] ? hotSet : nil)) {
+            if (CFAbsoluteTimeGetCurrent() >= deadline) break;
+            if (![item isKindOfClass:[NSDictionary class]]) continue;
+            
+            NSString *key = item[@"key"];
+            if (![key isKindOfClass:[NSString class]]) continue;
+            
+            // Skip what doesn't fit, a smaller image further down may still do
+            if ([item[@"cost"] unsignedIntegerValue] > maxCost - totalCost) continue;
+            
+            // A launch query may have loaded it already
+            if (checksMemoryCache && [(SDImageMemoryCache *)self.memCache containsObjectForKey:key]) continue;
+            
+            @autoreleasepool {
+                UIImage *image = [self _imageFromDiskCacheForKey:key options:[item[@"options"] unsignedIntegerValue]];
+                NSUInteger cost = SDImageMemoryCostForImage(image);
+                
+                if (!image || cost > maxCost - totalCost) continue;
+                if (checksMemoryCache && [(SDImageMemoryCache *)self.memCache containsObjectForKey:key]) continue;
+                
+                [self _cacheImageInMemory:image forKey:key options:SDImageMemoryCacheObjectSpeculative];
+                
+                @synchronized (warmedUpKeys) {
+                    [warmedUpKeys addObject:key];
+                }
+                
+                imageCount++;
+                totalCost += cost;
+            }
+        }
+        
+        if (completion) {
+            dispatch_async_main_queue(^{
+                completion(imageCount, totalCost);
+            });
+        }
+    });
+}
+
+- (CGFloat)_diskImageScaleForKey:(NSString *)key options:(SDWebImageScaledOptions)options {
+    return [key rangeOfString:@"@3x" options:NSCaseInsensitiveSearch].location != NSNotFound ? 3 : ((([key rangeOfString:@"@2x" options:NSCaseInsensitiveSearch].location != NSNotFound) || (options & SDWebImageScaledLoadAsRetinaImage)) ? 2 : 1);
+}
+
+- (NSData *)imageDataFromDiskCacheForKey:(NSString *)key {
+    return [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
+}
+
+- (void)imageDataFromDiskCacheForKey:(NSString *)key completion:(SDWebImageImageDataCompletionBlock)completionBlock {
+    [self.readQueue addOperationWithBlock:^{
+        NSData *data = [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
+        
+        dispatch_async_main_queue(^{
+            if (completionBlock)
+                completionBlock(data);
+        });
+    }];
+}
+
+- (NSData *)imageDataFromDiskCacheBySearchingAllCachePathsForKey:(NSString *)key {
+    return [self _imageDataFromDiskCacheBySearchingAllCachePathsForKey:key mapped:NO];
+}
+
+- (NSData *)_dataWithContentsOfFile:(NSString *)path size:(unsigned long long)size mapped:(BOOL)mapped {
+    if (mapped) {
+        if (!size) {
+            struct stat fileStat;
+            if (stat([path fileSystemRepresentation], &fileStat) == 0) {
+                size = fileStat.st_size;
+            }
+        }
+        
+        // Below the threshold a plain read is cheaper than setting up and tearing down a mapping
+        if (size >= self.mappedReadThreshold) {
+            return [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+        }
+    }
+    
+    return [NSData dataWithContentsOfFile:path];
+}
+
+- (NSData *)_imageDataFromDiskCacheBySearchingAllCachePathsForKey:(NSString *)key mapped:(BOOL)mapped {
+    if (self.shouldCacheEncodedDataInMemory) {
+        NSData *data = [self.encodedMemCache objectForKey:key];
+        
+        if (data) {
+            [self.statistics addValue:1 toCounter:SDWebImageStatisticsEncodedMemoryHits];
+            return data;
+        }
+    }
+    
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    NSData *data = [self _readImageDataForKey:key mapped:mapped];
     
     if (data) {
-        CGFloat scale = [key rangeOfString:@"@3x" options:NSCaseInsensitiveSearch].location != NSNotFound ? 3 : ((([key rangeOfString:@"@2x" options:NSCaseInsensitiveSearch].location != NSNotFound) || (options & SDWebImageScaledLoadAsRetinaImage)) ? 2 : 1);
-        UIImage *image = [UIImage sd_imageWithData:data scale:scale];
+        [self.statistics addValue:1 toCounter:SDWebImageStatisticsDiskHits];
+        [self.statistics addValue:data.length toCounter:SDWebImageStatisticsDiskBytesRead];
+        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsDiskReadLatency];
+        
+        // A mapped read must not outlive its decode (see _imageFromDiskCacheForKey:), keep a heap copy instead
+        if (self.shouldCacheEncodedDataInMemory) {
+            [self _cacheEncodedData:(mapped ? [NSData dataWithData:data] : data) forKey:key];
+        }
+    } else {
+        [self.statistics addValue:1 toCounter:SDWebImageStatisticsDiskMisses];
+    }
+    
+    return data;
+}
+
+- (void)_cacheEncodedData:(NSData *)data forKey:(NSString *)key {
+    // Don't let a single large image flush the whole tier
+    NSUInteger totalCostLimit = self.encodedMemCache.totalCostLimit;
+    if (totalCostLimit > 0 && data.length > totalCostLimit / 4) {
+        [self.encodedMemCache removeObjectForKey:key];
+        return;
+    }
+    
+    [self.encodedMemCache setObject:data forKey:key cost:data.length];
+}
+
+- (NSData *)_readImageDataForKey:(NSString *)key mapped:(BOOL)mapped {
+    SDImageCachePendingWrite *pendingWrite = [self _pendingWriteForKey:key];
+    if (pendingWrite) {
+        return pendingWrite.data ?: [self _encodedDataForPendingWrite:pendingWrite];
+    }
+    
+    // While the index is still loading, fall back to probing the file system rather than waiting for it
+    BOOL indexLoaded = self.index.isLoaded;
+    BOOL sharded = self.diskLayout == SDImageCacheDiskLayoutSharded;
+    NSString *fileName = indexLoaded ? [self _indexedFileNameForKey:key] : [self _fileNameForKey:key sharded:sharded];
+    SDImageCacheIndexEntry *entry = indexLoaded ? [self.index entryForFileName:fileName] : nil;
+    NSData *data = nil;
+    
+    if (indexLoaded) {
+        OSAtomicIncrement64(&_indexLookupCount);
+    }
+    
+    if (entry.segment) {
+        data = [self.segmentStore dataInSegment:entry.segment offset:entry.segmentOffset length:entry.size];
         
-        image = [self scaledImageForKey:key options:options image:image];
-        image = [UIImage decodedImageWithImage:image];
+        if (!data) {
+            // Compaction may have moved the payload between our lookup and the read; the relocation is visible by now
+            SDImageCacheIndexEntry *currentEntry = [self.index entryForFileName:fileName];
+            
+            if (currentEntry.segment && (currentEntry.segment != entry.segment || currentEntry.segmentOffset != entry.segmentOffset)) {
+                entry = currentEntry;
+                data = [self.segmentStore dataInSegment:entry.segment offset:entry.segmentOffset length:entry.size];
+            }
+        }
+    } else if (entry.contentFileName) {
+        data = [self _dataWithContentsOfFile:[self.contentDirectory stringByAppendingPathComponent:entry.contentFileName] size:entry.size mapped:mapped];
+    } else if (entry || !indexLoaded) {
+        data = [self _dataWithContentsOfFile:[self _pathForFileName:fileName sharded:(entry ? entry.sharded : sharded)] size:entry.size mapped:mapped];
         
-        return image;
+        if (!data && !indexLoaded && sharded) {
+            data = [self _dataWithContentsOfFile:[self _pathForFileName:[self cachedFileNameForKey:key] sharded:NO] size:0 mapped:mapped];
+        }
     } else {
-        return nil;
+        OSAtomicIncrement64(&_indexNegativeCount);
     }
-}
-
-- (NSData *)imageDataFromDiskCacheForKey:(NSString *)key {
-    __block NSData *data = nil;
     
-    dispatch_sync(_ioQueue, ^{
-        data = [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
-    });
-    
-    return data;
-}
-
-- (void)imageDataFromDiskCacheForKey:(NSString *)key completion:(SDWebImageImageDataCompletionBlock)completionBlock {
-    dispatch_async(_ioQueue, ^{
-        NSData *data = [self imageDataFromDiskCacheBySearchingAllCachePathsForKey:key];
-        
-        dispatch_async_main_queue(^{
-            if (completionBlock)
-                completionBlock(data);
-        });
-    });
-}
-
-- (NSData *)imageDataFromDiskCacheBySearchingAllCachePathsForKey:(NSString *)key {
-    NSString *defaultPath = [self defaultCachePathForKey:key];
-    NSData *data = [NSData dataWithContentsOfFile:defaultPath];
     if (data) {
+        [self.index touchFileName:fileName];
+        
+        // Moved once read rather than on lookup, so the move doesn't pull the file from under this read
+        if (sharded && entry && !entry.sharded) {
+            [self _migrateKeyToShardedLayout:key];
+        }
         return data;
     }
     
-    for (NSString *path in self.customPaths) {
-        NSString *filePath = [self cachePathForKey:key inPath:path];
-        NSData *imageData = [NSData dataWithContentsOfFile:filePath];
+    // The file may have been purged behind our back, keep the index honest (unless a store replaced the entry meanwhile)
+    if (entry) {
+        OSAtomicIncrement64(&_indexFalsePositiveCount);
+        [self.index removeEntry:entry];
+    }
+    
+    NSArray *customPaths = self.customPaths;
+    if (!customPaths.count) {
+        return nil;
+    }
+    
+    NSDictionary *customPathFilters = self.customPathFilters;
+    NSString *flatFileName = sharded ? [self cachedFileNameForKey:key] : fileName;
+    
+    for (NSString *path in customPaths) {
+        SDImageCacheLookupFilter *filter = customPathFilters[path];
+        if (filter && ![filter mayContainFileName:flatFileName]) {
+            continue;
+        }
+        
+        NSData *imageData = [self _dataWithContentsOfFile:[path stringByAppendingPathComponent:flatFileName] size:0 mapped:mapped];
         if (imageData) {
             return imageData;
         }
+        
+        [filter recordFalsePositive];
     }
     
     return nil;
@@ -312,16 +1648,20 @@ static NSData *kPNGSignatureData = nil;
         return nil;
     }
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    
     // First check the in-memory cache...
     UIImage *image = [self imageFromMemoryCacheForKey:key options:options];
     if (image) {
+        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsQueryLatency];
         doneBlock(image, SDImageCacheTypeMemory);
         return nil;
     }
     
-    NSOperation *operation = [NSOperation new];
-    dispatch_async(_ioQueue, ^{
-        if (operation.isCancelled) {
+    NSBlockOperation *operation = [NSBlockOperation new];
+    __weak NSBlockOperation *weakOperation = operation;
+    [operation addExecutionBlock:^{
+        if (weakOperation.isCancelled) {
             return;
         }
         
@@ -330,15 +1670,110 @@ static NSData *kPNGSignatureData = nil;
         @autoreleasepool {
             diskImage = [self _imageFromDiskCacheForKey:key options:(options & SDWebImageScaledLoadAsRetinaImage)];
             if (diskImage) {
-                CGFloat cost = diskImage.size.height * diskImage.size.width * diskImage.scale;
-                [self.memCache setObject:diskImage forCachePairKey:key cost:cost];
+                [self.memCache setObject:diskImage forCachePairKey:key cost:SDImageMemoryCostForImage(diskImage)];
             }
         }
         
+        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsQueryLatency];
+        
         dispatch_async(dispatch_get_main_queue(), ^{
             doneBlock(diskImage, SDImageCacheTypeDisk);
         });
-    });
+    }];
+    [self.readQueue addOperation:operation];
+    
+    return operation;
+}
+
+- (NSOperation *)queryCacheForKeys:(NSArray *)keys options:(SDWebImageScaledOptions)options done:(SDWebImageBatchQueryCompletedBlock)doneBlock {
+    if (!doneBlock) return nil;
+    
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    NSMutableDictionary *memoryImages = [NSMutableDictionary new];
+    NSMutableArray *diskKeys = [NSMutableArray new];
+    NSMutableSet *seenKeys = [NSMutableSet new];
+    
+    // First check the in-memory cache, in one pass...
+    for (NSString *key in keys) {
+        if (![key isKindOfClass:[NSString class]] || [seenKeys containsObject:key]) continue;
+        [seenKeys addObject:key];
+        
+        UIImage *image = [self imageFromMemoryCacheForKey:key options:options];
+        if (image) {
+            memoryImages[key] = image;
+        } else {
+            [diskKeys addObject:key];
+        }
+    }
+    
+    if (memoryImages.count || !diskKeys.count) {
+        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsQueryLatency];
+        doneBlock(memoryImages, SDImageCacheTypeMemory, diskKeys.count == 0);
+    }
+    
+    if (!diskKeys.count) return nil;
+    
+    // ...then the disk, one read per key on the read queue so the batch stays within maxConcurrentDiskReads. The
+    // returned operation delivers the last images once every read is done, cancelling it skips the remaining reads
+    const NSUInteger count = diskKeys.count;
+    const NSUInteger batchSize = (count + kMaxBatchQueryDeliveries - 1) / kMaxBatchQueryDeliveries;
+    __block NSMutableDictionary *batch = [NSMutableDictionary new];
+    __block NSUInteger completedCount = 0;
+    
+    NSBlockOperation *operation = [NSBlockOperation new];
+    __weak NSBlockOperation *weakOperation = operation;
+    [operation addExecutionBlock:^{
+        if (weakOperation.isCancelled) {
+            return;
+        }
+        
+        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsQueryLatency];
+        
+        NSDictionary *delivery = batch;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            doneBlock(delivery, SDImageCacheTypeDisk, YES);
+        });
+    }];
+    
+    // Queued in key order, so the first keys are read first
+    for (NSString *key in diskKeys) {
+        NSBlockOperation *readOperation = [NSBlockOperation blockOperationWithBlock:^{
+            UIImage *diskImage = nil;
+            
+            if (!weakOperation.isCancelled) {
+                @autoreleasepool {
+                    diskImage = [self _imageFromDiskCacheForKey:key options:(options & SDWebImageScaledLoadAsRetinaImage)];
+                    if (diskImage) {
+                        [self.memCache setObject:diskImage forCachePairKey:key cost:SDImageMemoryCostForImage(diskImage)];
+                    }
+                }
+            }
+            
+            NSDictionary *delivery = nil;
+            
+            @synchronized (diskKeys) {
+                if (diskImage) {
+                    batch[key] = diskImage;
+                }
+                
+                if (++completedCount % batchSize == 0 && completedCount < count && batch.count) {
+                    delivery = batch;
+                    batch = [NSMutableDictionary new];
+                }
+            }
+            
+            if (delivery && !weakOperation.isCancelled) {
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    doneBlock(delivery, SDImageCacheTypeDisk, NO);
+                });
+            }
+        }];
+        
+        [operation addDependency:readOperation];
+        [self.readQueue addOperation:readOperation];
+    }
+    
+    [self.readQueue addOperation:operation];
     
     return operation;
 }
@@ -361,10 +1796,22 @@ static NSData *kPNGSignatureData = nil;
     }
     
     [self.memCache removeObjectForCachePairKey:key];
+    [self.encodedMemCache removeObjectForKey:key];
     
     if (fromDisk) {
+        [self _cancelPendingWriteForKey:key];
+        
         dispatch_async(self.ioQueue, ^{
-            [_fileManager removeItemAtPath:[self defaultCachePathForKey:key] error:nil];
+            BOOL sharded = self.diskLayout == SDImageCacheDiskLayoutSharded;
+            
+            if (sharded) {
+                [self _removeDiskFileName:SDImageCacheShardedFileNameForKey(key) sharded:YES];
+            }
+            
+            // A key not migrated yet may be under its flat layout name
+            if (!sharded || self.index.flatCount) {
+                [self _removeDiskFileName:[self cachedFileNameForKey:key] sharded:NO];
+            }
             
             if (completion) {
                 dispatch_async(dispatch_get_main_queue(), ^{
@@ -387,6 +1834,64 @@ static NSData *kPNGSignatureData = nil;
 
 - (void)clearMemory {
     [_memCache removeAllObjects];
+    [_encodedMemCache removeAllObjects];
+}
+
+- (void)_cacheImageInMemory:(UIImage *)image forKey:(NSString *)key options:(SDImageMemoryCacheObjectOptions)options {
+    if ([self.memCache isKindOfClass:[SDImageMemoryCache class]]) {
+        [(SDImageMemoryCache *)self.memCache setObject:image forKey:key cost:SDImageMemoryCostForImage(image) options:options];
+    } else {
+        [self.memCache setObject:image forCachePairKey:key cost:SDImageMemoryCostForImage(image)];
+    }
+}
+
+- (void)_didReceiveMemoryWarning {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    SDImageCacheMemoryPressure pressure = SDImageCacheMemoryPressureLow;
+    
+    // Still warned right after the last pass, that wasn't enough
+    if (_lastMemoryWarningTime > 0 && now - _lastMemoryWarningTime < kMemoryWarningEscalationInterval) {
+        pressure = MIN(_lastMemoryWarningPressure + 1, SDImageCacheMemoryPressureCritical);
+    }
+    
+    _lastMemoryWarningTime = now;
+    _lastMemoryWarningPressure = pressure;
+    
+    [self reduceMemoryUsageForPressure:pressure];
+}
+
+- (NSUInteger)reduceMemoryUsageForPressure:(SDImageCacheMemoryPressure)pressure {
+    pressure = MIN(MAX(pressure, SDImageCacheMemoryPressureLow), SDImageCacheMemoryPressureCritical);
+    
+    NSUInteger freedBytes = 0;
+    
+    if (pressure == SDImageCacheMemoryPressureCritical || ![self.memCache isKindOfClass:[SDImageMemoryCache class]]) {
+        if ([self.memCache isKindOfClass:[SDImageMemoryCache class]]) {
+            freedBytes = [(SDImageMemoryCache *)self.memCache totalCost] + self.encodedMemCache.totalCost;
+        }
+        
+        [self clearMemory];
+    } else {
+        NSTimeInterval idleTime = self.memoryPressureIdleTime;
+        
+        freedBytes = [(SDImageMemoryCache *)self.memCache removeObjectsPassingTest:^BOOL(id key, id object, SDImageMemoryCacheObjectOptions options, NSTimeInterval objectIdleTime) {
+            if ((options & SDImageMemoryCacheObjectRegenerable) || objectIdleTime >= idleTime) {
+                return YES;
+            }
+            
+            return pressure >= SDImageCacheMemoryPressureModerate && (options & SDImageMemoryCacheObjectSpeculative);
+        }];
+        
+        if (pressure >= SDImageCacheMemoryPressureModerate) {
+            freedBytes += self.encodedMemCache.totalCost;
+            [self.encodedMemCache removeAllObjects];
+        }
+    }
+    
+    OSAtomicIncrement64(&_memoryPressureCounts[pressure]);
+    OSAtomicAdd64((int64_t)freedBytes, &_memoryPressureFreedBytes[pressure]);
+    
+    return freedBytes;
 }
 
 - (void)clearDisk {
@@ -395,12 +1900,24 @@ static NSData *kPNGSignatureData = nil;
 
 - (void)clearDiskOnCompletion:(void (^)())completion
 {
+    [self _cancelAllPendingWrites];
+    [self.encodedMemCache removeAllObjects];
+    
     dispatch_async(_ioQueue, ^{
+        [self.segmentStore removeAllSegments];
         [_fileManager removeItemAtPath:self.diskCachePath error:nil];
         [_fileManager createDirectoryAtPath:self.diskCachePath
                 withIntermediateDirectories:YES
                                  attributes:nil
                                       error:NULL];
+        [self.index removeAllEntries];
+        [self.bitmapStore removeAllBitmaps];
+        
+        @synchronized (self.contentReferenceCounts) {
+            [self.contentReferenceCounts removeAllObjects];
+            _contentBytes = 0;
+            _deduplicatedBytes = 0;
+        }
 
         if (completion) {
             dispatch_async(dispatch_get_main_queue(), ^{
@@ -416,82 +1933,377 @@ static NSData *kPNGSignatureData = nil;
 
 - (void)cleanDiskWithCompletionBlock:(void (^)())completionBlock {
     dispatch_async(_ioQueue, ^{
-        NSURL *diskCacheURL = [NSURL fileURLWithPath:self.diskCachePath isDirectory:YES];
-        NSArray *resourceKeys = @[NSURLIsDirectoryKey, NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey];
-
-        // This enumerator prefetches useful properties for our cache files.
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtURL:diskCacheURL
-                                                   includingPropertiesForKeys:resourceKeys
-                                                                      options:NSDirectoryEnumerationSkipsHiddenFiles
-                                                                 errorHandler:NULL];
-
-        NSDate *expirationDate = [NSDate dateWithTimeIntervalSinceNow:-self.maxCacheAge];
-        NSMutableDictionary *cacheFiles = [NSMutableDictionary dictionary];
-        NSUInteger currentCacheSize = 0;
-
-        // Enumerate all of the files in the cache directory.  This loop has two purposes:
-        //
-        //  1. Removing files that are older than the expiration date.
-        //  2. Storing file attributes for the size-based cleanup pass.
-        NSMutableArray *urlsToDelete = [[NSMutableArray alloc] init];
-        for (NSURL *fileURL in fileEnumerator) {
-            NSDictionary *resourceValues = [fileURL resourceValuesForKeys:resourceKeys error:NULL];
-
-            // Skip directories.
-            if ([resourceValues[NSURLIsDirectoryKey] boolValue]) {
-                continue;
-            }
+        [self _startCleanupResuming:NO completionBlock:completionBlock];
+    });
+}
 
-            // Remove files that are older than the expiration date;
-            NSDate *modificationDate = resourceValues[NSURLContentModificationDateKey];
-            if ([[modificationDate laterDate:expirationDate] isEqualToDate:expirationDate]) {
-                [urlsToDelete addObject:fileURL];
-                continue;
-            }
+- (void)_startCleanupResuming:(BOOL)resuming completionBlock:(void (^)())completionBlock { // Already on ioQueue
+    SDImageCacheCleanup *cleanup = self.cleanup;
+    
+    if (!cleanup) {
+        NSString *cursor = [NSString stringWithContentsOfFile:[self.diskCachePath stringByAppendingPathComponent:kCleanupCursorFileName]
+                                                     encoding:NSUTF8StringEncoding
+                                                        error:NULL];
+        if (resuming && !cursor) return;
+        
+        cleanup = [SDImageCacheCleanup new];
+        cleanup.completionBlocks = [NSMutableArray new];
+        
+        // The index holds size and access time of every cache file, so no directory enumeration is needed here.
+        cleanup.fileNames = [[[self.index allEntries] valueForKey:@"fileName"] sortedArrayUsingSelector:@selector(compare:)];
+        
+        // Pick up after the last entry the interrupted cleanup got through
+        if (cursor.length) {
+            cleanup.nextFileNameIndex = [cleanup.fileNames indexOfObject:cursor
+                                                           inSortedRange:NSMakeRange(0, cleanup.fileNames.count)
+                                                                 options:NSBinarySearchingInsertionIndex | NSBinarySearchingLastEqual
+                                                         usingComparator:^NSComparisonResult(NSString *fileName1, NSString *fileName2) {
+                                                             return [fileName1 compare:fileName2];
+                                                         }];
+            OSAtomicIncrement64(&_cleanupResumeCount);
+        }
+        
+        self.cleanup = cleanup;
+        self.cleanupProgress = 0;
+        OSAtomicIncrement64(&_cleanupRunCount);
+        
+        dispatch_async(self.ioQueue, ^{
+            [self _runCleanupSlice];
+        });
+    }
+    
+    if (completionBlock) {
+        [cleanup.completionBlocks addObject:[completionBlock copy]];
+    }
+}
 
-            // Store a reference to this file and account for its total size.
-            NSNumber *totalAllocatedSize = resourceValues[NSURLTotalFileAllocatedSizeKey];
-            currentCacheSize += [totalAllocatedSize unsignedIntegerValue];
-            [cacheFiles setObject:resourceValues forKey:fileURL];
+- (void)_runCleanupSlice { // Already on ioQueue
+    SDImageCacheCleanup *cleanup = self.cleanup;
+    if (!cleanup) return;
+    
+    // Reads in flight get the disk first, but only for so long, or a busy scroll would hold the cleanup off forever
+    if (self.readQueue.operationCount > 0 && cleanup.consecutiveYields < kMaxConsecutiveCleanupYields) {
+        cleanup.consecutiveYields++;
+        OSAtomicIncrement64(&_cleanupYieldCount);
+        
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kCleanupYieldInterval * NSEC_PER_SEC)), self.ioQueue, ^{
+            [self _runCleanupSlice];
+        });
+        return;
+    }
+    
+    cleanup.consecutiveYields = 0;
+    
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime deadline = startTime + self.cleanupSliceTimeLimit;
+    NSUInteger entryLimit = MAX(self.cleanupSliceEntryLimit, 1);
+    BOOL finished = NO;
+    
+    @autoreleasepool {
+        for (NSUInteger step = 0; step < entryLimit && !finished; ++step) {
+            finished = ![self _performCleanupStep:cleanup];
+            
+            if (CFAbsoluteTimeGetCurrent() >= deadline) break;
         }
         
-        for (NSURL *fileURL in urlsToDelete) {
-            [_fileManager removeItemAtURL:fileURL error:nil];
+        [self _saveCleanupCursor:cleanup];
+    }
+    
+    OSAtomicIncrement64(&_cleanupSliceCount);
+    [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsCleanupSliceTime];
+    
+    if (finished) {
+        [self _finishCleanup:cleanup];
+        return;
+    }
+    
+    self.cleanupProgress = [self _progressOfCleanup:cleanup];
+    
+    // Requeued behind the stores and removals that came in during the slice
+    dispatch_async(self.ioQueue, ^{
+        [self _runCleanupSlice];
+    });
+}
+
+- (BOOL)_performCleanupStep:(SDImageCacheCleanup *)cleanup { // Already on ioQueue, returns NO once the cleanup is done
+    switch (cleanup.phase) {
+        case SDImageCacheCleanupPhaseExpire: {
+            if (cleanup.nextFileNameIndex < cleanup.fileNames.count) {
+                // Re-read, the entry may have been stored again or removed since the cleanup started
+                SDImageCacheIndexEntry *entry = [self.index entryForFileName:cleanup.fileNames[cleanup.nextFileNameIndex++]];
+                
+                // Remove files that are older than the expiration date. Entries past their HTTP freshness lifetime are
+                // kept until then too, a conditional request can still refresh them without a new transfer.
+                if (entry && entry.creationTime <= [NSDate timeIntervalSinceReferenceDate] - self.maxCacheAge) {
+                    [self _removeDiskEntry:entry];
+                }
+                return YES;
+            }
+            
+            cleanup.fileNames = nil;
+            [_fileManager removeItemAtPath:[self.diskCachePath stringByAppendingPathComponent:kCleanupCursorFileName] error:nil];
+            
+            // If our remaining disk cache exceeds a configured maximum size, perform a second
+            // size-based cleanup pass in the order of the eviction policy.
+            unsigned long long currentCacheSize = [self _diskCacheSize];
+            
+            if (self.maxCacheSize > 0 && currentCacheSize > self.maxCacheSize) {
+                cleanup.evictionStartSize = currentCacheSize;
+                cleanup.phase = SDImageCacheCleanupPhaseEvict;
+            } else {
+                cleanup.segments = [self.segmentStore segmentsNeedingCompaction];
+                cleanup.phase = SDImageCacheCleanupPhaseCompact;
+            }
+            return YES;
+        }
+            
+        case SDImageCacheCleanupPhaseEvict: {
+            // Ranking the whole index takes a step of its own
+            if (!cleanup.evictionPolicy) {
+                cleanup.evictionPolicy = self.evictionPolicy ?: [SDImageCacheLRUEvictionPolicy new];
+                cleanup.rankedEntries = [self _rankEntries:[self.index allEntries] evictionPolicy:cleanup.evictionPolicy];
+                return YES;
+            }
+            
+            if (cleanup.nextRankedEntryIndex < cleanup.rankedEntries.count && [self _diskCacheSize] > self.maxCacheSize * self.diskCacheLowWatermark) {
+                NSArray *rankedEntry = cleanup.rankedEntries[cleanup.nextRankedEntryIndex++];
+                SDImageCacheIndexEntry *rankedIndexEntry = rankedEntry[1];
+                SDImageCacheIndexEntry *entry = [self.index entryForFileName:rankedIndexEntry.fileName];
+                
+                // An entry stored again since it was ranked is new data, its old rank doesn't apply
+                if (entry && entry.creationTime == rankedIndexEntry.creationTime) {
+                    [self _evictEntry:entry priority:[rankedEntry[0] doubleValue] evictionPolicy:cleanup.evictionPolicy];
+                }
+                return YES;
+            }
+            
+            cleanup.rankedEntries = nil;
+            cleanup.evictionPolicy = nil;
+            cleanup.segments = [self.segmentStore segmentsNeedingCompaction];
+            cleanup.phase = SDImageCacheCleanupPhaseCompact;
+            return YES;
+        }
+            
+        case SDImageCacheCleanupPhaseCompact: {
+            if (cleanup.nextSegmentIndex < cleanup.segments.count) {
+                [self _compactSegment:[cleanup.segments[cleanup.nextSegmentIndex++] unsignedIntValue]];
+                return YES;
+            }
+            
+            [self.index compactIfNeeded];
+            [self.bitmapStore trimToSize:self.bitmapStore.maxSize];
+            return NO;
         }
+    }
+    
+    return NO;
+}
 
-        // If our remaining disk cache exceeds a configured maximum size, perform a second
-        // size-based cleanup pass.  We delete the oldest files first.
-        if (self.maxCacheSize > 0 && currentCacheSize > self.maxCacheSize) {
-            // Target half of our maximum cache size for this cleanup pass.
-            const NSUInteger desiredCacheSize = self.maxCacheSize / 2;
+- (void)_saveCleanupCursor:(SDImageCacheCleanup *)cleanup { // Already on ioQueue
+    if (cleanup.phase != SDImageCacheCleanupPhaseExpire || cleanup.nextFileNameIndex == 0) return;
+    
+    NSString *cursor = cleanup.fileNames[cleanup.nextFileNameIndex - 1];
+    [cursor writeToFile:[self.diskCachePath stringByAppendingPathComponent:kCleanupCursorFileName]
+             atomically:YES
+               encoding:NSUTF8StringEncoding
+                  error:NULL];
+}
 
-            // Sort the remaining cache files by their last modification time (oldest first).
-            NSArray *sortedFiles = [cacheFiles keysSortedByValueWithOptions:NSSortConcurrent
-                                                            usingComparator:^NSComparisonResult(id obj1, id obj2) {
-                                                                return [obj1[NSURLContentModificationDateKey] compare:obj2[NSURLContentModificationDateKey]];
-                                                            }];
+- (double)_progressOfCleanup:(SDImageCacheCleanup *)cleanup { // Already on ioQueue
+    switch (cleanup.phase) {
+        case SDImageCacheCleanupPhaseExpire:
+            return cleanup.fileNames.count ? 0.5 * cleanup.nextFileNameIndex / cleanup.fileNames.count : 0.5;
+            
+        case SDImageCacheCleanupPhaseEvict: {
+            unsigned long long desiredCacheSize = self.maxCacheSize * self.diskCacheLowWatermark;
+            unsigned long long currentCacheSize = [self _diskCacheSize];
+            
+            if (cleanup.evictionStartSize <= desiredCacheSize || currentCacheSize <= desiredCacheSize) return 1;
+            if (currentCacheSize >= cleanup.evictionStartSize) return 0.5;
+            
+            return 0.5 + 0.5 * (cleanup.evictionStartSize - currentCacheSize) / (cleanup.evictionStartSize - desiredCacheSize);
+        }
+            
+        case SDImageCacheCleanupPhaseCompact:
+            return 1;
+    }
+    
+    return 1;
+}
 
-            // Delete files until we fall below our desired cache size.
-            for (NSURL *fileURL in sortedFiles) {
-                if ([_fileManager removeItemAtURL:fileURL error:nil]) {
-                    NSDictionary *resourceValues = cacheFiles[fileURL];
-                    NSNumber *totalAllocatedSize = resourceValues[NSURLTotalFileAllocatedSizeKey];
-                    currentCacheSize -= [totalAllocatedSize unsignedIntegerValue];
+- (void)_finishCleanup:(SDImageCacheCleanup *)cleanup { // Already on ioQueue
+    self.cleanup = nil;
+    self.cleanupProgress = 1;
+    
+    NSArray *completionBlocks = cleanup.completionBlocks;
+    if (completionBlocks.count) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            for (void (^completionBlock)() in completionBlocks) {
+                completionBlock();
+            }
+        });
+    }
+}
 
-                    if (currentCacheSize < desiredCacheSize) {
-                        break;
-                    }
-                }
+- (void)_evictIfAboveHighWatermark { // Already on ioQueue
+    // A running cleanup evicts on its own if it hasn't yet, otherwise the next flush after it comes back here
+    if (self.maxCacheSize == 0 || self.cleanup) return;
+    
+    unsigned long long currentCacheSize = [self _diskCacheSize];
+    if (currentCacheSize <= self.maxCacheSize * self.diskCacheHighWatermark) return;
+    
+    // Just the eviction phase, sliced and yielding to reads like any cleanup rather than holding up the writes behind us
+    SDImageCacheCleanup *cleanup = [SDImageCacheCleanup new];
+    cleanup.completionBlocks = [NSMutableArray new];
+    cleanup.phase = SDImageCacheCleanupPhaseEvict;
+    cleanup.evictionStartSize = currentCacheSize;
+    
+    self.cleanup = cleanup;
+    self.cleanupProgress = [self _progressOfCleanup:cleanup];
+    OSAtomicIncrement64(&_cleanupRunCount);
+    
+    dispatch_async(self.ioQueue, ^{
+        [self _runCleanupSlice];
+    });
+}
+
+- (NSArray *)_rankEntries:(NSArray *)entries evictionPolicy:(id<SDImageCacheEvictionPolicy>)evictionPolicy { // Already on ioQueue
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    
+    // Always every entry of the index, the policy may drop its state for the others
+    if ([evictionPolicy respondsToSelector:@selector(willRankEntries:)]) {
+        [evictionPolicy willRankEntries:entries];
+    }
+    
+    // @[priority, entry], least valuable first
+    NSMutableArray *rankedEntries = [[NSMutableArray alloc] initWithCapacity:entries.count];
+    for (SDImageCacheIndexEntry *entry in entries) {
+        [rankedEntries addObject:@[@([evictionPolicy retentionPriorityForEntry:entry now:now]), entry]];
+    }
+    
+    [rankedEntries sortUsingComparator:^NSComparisonResult(NSArray *rankedEntry1, NSArray *rankedEntry2) {
+        return [rankedEntry1[0] compare:rankedEntry2[0]];
+    }];
+    
+    return rankedEntries;
+}
+
+- (void)_evictEntry:(SDImageCacheIndexEntry *)entry priority:(double)priority evictionPolicy:(id<SDImageCacheEvictionPolicy>)evictionPolicy { // Already on ioQueue
+    [self _removeDiskEntry:entry];
+    [self.statistics addValue:1 toCounter:SDWebImageStatisticsDiskEvictions];
+    
+    if ([evictionPolicy respondsToSelector:@selector(didEvictEntry:priority:)]) {
+        [evictionPolicy didEvictEntry:entry priority:priority];
+    }
+}
+
+- (void)_removeDiskEntry:(SDImageCacheIndexEntry *)entry { // Already on ioQueue
+    [self _releaseDiskEntry:entry];
+    [self.index removeFileName:entry.fileName];
+    [self.bitmapStore removeFileName:entry.fileName];
+}
+
+- (void)_removeDiskFileName:(NSString *)fileName sharded:(BOOL)sharded { // Already on ioQueue
+    SDImageCacheIndexEntry *entry = [self.index entryForFileName:fileName];
+    
+    if (entry) {
+        [self _removeDiskEntry:entry];
+    } else {
+        [_fileManager removeItemAtPath:[self _pathForFileName:fileName sharded:sharded] error:nil];
+        [self.bitmapStore removeFileName:fileName];
+    }
+}
+
+- (void)_releaseDiskEntry:(SDImageCacheIndexEntry *)entry { // Already on ioQueue
+    if (entry.contentFileName) {
+        [self _releaseContentFileName:entry.contentFileName size:entry.size];
+    } else if (entry.segment) {
+        [self.segmentStore releaseSegment:entry.segment length:entry.size];
+    } else {
+        [_fileManager removeItemAtPath:[self _pathForFileName:entry.fileName sharded:entry.sharded] error:nil];
+    }
+}
+
+#pragma mark Sharded layout migration
+
+- (void)_migrateKeyToShardedLayout:(NSString *)key {
+    dispatch_async(self.ioQueue, ^{
+        NSString *flatFileName = [self cachedFileNameForKey:key];
+        NSString *fileName = SDImageCacheShardedFileNameForKey(key);
+        
+        // Already moved by an earlier read, or stored again meanwhile
+        SDImageCacheIndexEntry *entry = [self.index entryForFileName:flatFileName];
+        if (!entry || entry.sharded || [self.index containsFileName:fileName]) return;
+        
+        // Packed and deduplicated payloads aren't stored under the key's file name, only their entry is renamed
+        if (!entry.segment && !entry.contentFileName) {
+            NSString *flatPath = [self _pathForFileName:flatFileName sharded:NO];
+            NSString *path = [self _pathForFileName:fileName sharded:YES];
+            
+            [_fileManager createDirectoryAtPath:[path stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:NULL];
+            
+            // Link, rename the entry, then unlink: a reader that just resolved the flat name can still open the file
+            unlink([path fileSystemRepresentation]);
+            if (link([flatPath fileSystemRepresentation], [path fileSystemRepresentation]) != 0) {
+                [self _removeDiskEntry:entry];
+                return;
             }
+            
+            [self.index renameFileName:flatFileName toFileName:fileName sharded:YES];
+            unlink([flatPath fileSystemRepresentation]);
+        } else {
+            [self.index renameFileName:flatFileName toFileName:fileName sharded:YES];
         }
-        if (completionBlock) {
-            dispatch_async(dispatch_get_main_queue(), ^{
-                completionBlock();
-            });
-        }
+        
+        // The decoded bitmap is keyed by file name, it's decoded again under the new one
+        [self.bitmapStore removeFileName:flatFileName];
     });
 }
 
+#pragma mark Packed storage
+
+- (void)_loadSegmentStore { // Already on ioQueue
+    // Packed payloads are invisible to a directory enumeration, so recover them from the segment headers if the index was lost
+    if (self.index.rebuilt) {
+        [self.segmentStore enumeratePayloadsUsingBlock:^(NSString *fileName, BOOL sharded, uint32_t segment, uint64_t offset, unsigned long long length) {
+            // Still under its flat name if it was packed before the migration, which then picks it up again
+            [self.index recordFileName:fileName size:length expirationTime:0 segment:segment offset:offset sharded:sharded];
+        }];
+    }
+    
+    NSMutableDictionary *liveBytesBySegment = [NSMutableDictionary new];
+    
+    for (SDImageCacheIndexEntry *entry in [self.index allEntries]) {
+        if (entry.segment) {
+            unsigned long long liveBytes = [liveBytesBySegment[@(entry.segment)] unsignedLongLongValue];
+            liveBytesBySegment[@(entry.segment)] = @(liveBytes + [SDImageCacheSegmentStore storedSizeForPayloadLength:entry.size]);
+        }
+    }
+    
+    [self.segmentStore loadWithLiveBytesBySegment:liveBytesBySegment];
+}
+
+- (void)_compactSegment:(uint32_t)segment { // Already on ioQueue
+    @autoreleasepool {
+        // Move the surviving payloads to the active segment, then drop the whole segment file
+        for (SDImageCacheIndexEntry *entry in [self.index allEntries]) {
+            if (entry.segment != segment) continue;
+            
+            NSData *data = [self.segmentStore dataInSegment:entry.segment offset:entry.segmentOffset length:entry.size];
+            uint32_t newSegment = 0;
+            uint64_t newOffset = 0;
+            
+            if (data && [self.segmentStore appendData:data fileName:entry.fileName sharded:entry.sharded segment:&newSegment offset:&newOffset]) {
+                [self.index relocateFileName:entry.fileName segment:newSegment offset:newOffset];
+            } else {
+                [self.index removeFileName:entry.fileName];
+            }
+        }
+        
+        [self.segmentStore removeSegment:segment];
+    }
+}
+
 - (void)backgroundCleanDisk {
     UIApplication *application = [UIApplication sharedApplication];
     __block UIBackgroundTaskIdentifier bgTask = [application beginBackgroundTaskWithExpirationHandler:^{
@@ -509,45 +2321,18 @@ static NSData *kPNGSignatureData = nil;
 }
 
 - (NSUInteger)getSize {
-    __block NSUInteger size = 0;
-    dispatch_sync(_ioQueue, ^{
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtPath:self.diskCachePath];
-        for (NSString *fileName in fileEnumerator) {
-            NSString *filePath = [self.diskCachePath stringByAppendingPathComponent:fileName];
-            NSDictionary *attrs = [[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil];
-            size += [attrs fileSize];
-        }
-    });
-    return size;
+    return (NSUInteger)[self _diskCacheSize];
 }
 
 - (NSUInteger)getDiskCount {
-    __block NSUInteger count = 0;
-    dispatch_sync(_ioQueue, ^{
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtPath:self.diskCachePath];
-        count = [[fileEnumerator allObjects] count];
-    });
-    return count;
+    return self.index.count;
 }
 
 - (void)calculateSizeWithCompletionBlock:(void (^)(NSUInteger fileCount, NSUInteger totalSize))completionBlock {
-    NSURL *diskCacheURL = [NSURL fileURLWithPath:self.diskCachePath isDirectory:YES];
-
-    dispatch_async(_ioQueue, ^{
-        NSUInteger fileCount = 0;
-        NSUInteger totalSize = 0;
-
-        NSDirectoryEnumerator *fileEnumerator = [_fileManager enumeratorAtURL:diskCacheURL
-                                                   includingPropertiesForKeys:@[NSFileSize]
-                                                                      options:NSDirectoryEnumerationSkipsHiddenFiles
-                                                                 errorHandler:NULL];
-
-        for (NSURL *fileURL in fileEnumerator) {
-            NSNumber *fileSize;
-            [fileURL getResourceValue:&fileSize forKey:NSURLFileSizeKey error:NULL];
-            totalSize += [fileSize unsignedIntegerValue];
-            fileCount += 1;
-        }
+    // The index answers in O(1), but may still be loading, so don't wait for it on the calling thread
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSUInteger fileCount = self.index.count;
+        NSUInteger totalSize = (NSUInteger)[self _diskCacheSize];
 
         if (completionBlock) {
             dispatch_async(dispatch_get_main_queue(), ^{
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+/**
+ * SDImageCacheBitmapStore keeps already decoded images on disk as raw pixel buffers, one file per cache file name,
+ * preceded by a small header (dimensions, row stride, pixel format, scale and orientation). A hit maps the file and
+ * wraps it in a CGImage as is, so no JPEG/PNG/WebP decode and no redraw happen on the way back.
+ *
+ * The store keeps its own SDImageCacheIndex and byte budget, independent from the encoded disk cache.
+ *
+ * Writes and removals must be serialized by the caller (SDImageCache does them on its ioQueue).
+ * Reads can be issued from any thread.
+ */
+@interface SDImageCacheBitmapStore : NSObject
+
+/**
+ * The directory holding the bitmap files.
+ */
+@property (strong, nonatomic, readonly) NSString *directory;
+
+/**
+ * The maximum number of bytes the store may hold. Stores past this budget evict the least recently used bitmaps.
+ */
+@property (assign, nonatomic) unsigned long long maxSize;
+
+/**
+ * Number of bitmaps in the store.
+ */
+@property (assign, nonatomic, readonly) NSUInteger count;
+
+/**
+ * Sum of the sizes of all bitmap files, in bytes.
+ */
+@property (assign, nonatomic, readonly) unsigned long long totalSize;
+
+/**
+ * Init a store in the given directory and start loading its index in the background.
+ */
+- (id)initWithDirectory:(NSString *)directory;
+
+/**
+ * Returns YES if the image has a single bitmap in a pixel format the store can write back and map again.
+ */
+- (BOOL)canStoreImage:(UIImage *)image;
+
+/**
+ * Write the pixels of a decoded image. Does nothing if `canStoreImage:` returns NO or the bitmap alone would take
+ * more than a quarter of `maxSize`.
+ *
+ * @param image    The decoded image
+ * @param fileName The cache file name of the encoded image
+ *
+ * @return YES if the bitmap was written
+ */
+- (BOOL)storeImage:(UIImage *)image fileName:(NSString *)fileName;
+
+/**
+ * Map a stored bitmap into an image, or return nil.
+ */
+- (UIImage *)imageForFileName:(NSString *)fileName;
+
+/**
+ * Returns YES if a bitmap is stored for the given file name.
+ */
+- (BOOL)containsFileName:(NSString *)fileName;
+
+/**
+ * Delete the bitmap stored for the given file name, if any.
+ */
+- (void)removeFileName:(NSString *)fileName;
+
+/**
+ * Delete every bitmap.
+ */
+- (void)removeAllBitmaps;
+
+/**
+ * Delete the least recently used bitmaps until the store fits in the given number of bytes.
+ */
+- (void)trimToSize:(unsigned long long)size;
+
+@end
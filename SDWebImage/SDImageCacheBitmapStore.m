@@ -0,0 +1,245 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageCacheBitmapStore.h"
+#import "SDImageCacheIndex.h"
+#import "OLImage.h"
+
+static const uint32_t kBitmapMagic = 0x4D424453; // "SDBM"
+static const uint16_t kBitmapVersion = 1;
+static const uint16_t kBitmapHeaderLength = 64; // Keeps the pixels cache line aligned in the mapping
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerLength;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesPerRow;
+    uint32_t bitsPerComponent;
+    uint32_t bitsPerPixel;
+    uint32_t bitmapInfo;
+    uint32_t colorComponentCount; // 1 (gray) or 3 (RGB), alpha excluded
+    uint32_t orientation;
+    double scale;
+} SDImageCacheBitmapHeader;
+
+@interface SDImageCacheBitmapStore ()
+
+@property (strong, nonatomic, readwrite) NSString *directory;
+@property (strong, nonatomic) SDImageCacheIndex *index;
+
+@end
+
+static void SDImageCacheBitmapReleaseData(void *info, const void *data, size_t size) {
+    CFRelease(info);
+}
+
+@implementation SDImageCacheBitmapStore
+
+- (id)initWithDirectory:(NSString *)directory {
+    if ((self = [super init])) {
+        _directory = [directory copy];
+        _index = [[SDImageCacheIndex alloc] initWithDirectory:_directory];
+        [_index load];
+    }
+    return self;
+}
+
+- (NSString *)pathForFileName:(NSString *)fileName {
+    return [self.directory stringByAppendingPathComponent:fileName];
+}
+
+- (NSUInteger)count {
+    return self.index.count;
+}
+
+- (unsigned long long)totalSize {
+    return self.index.totalSize;
+}
+
+#pragma mark Writing
+
+- (BOOL)canStoreImage:(UIImage *)image {
+#if TARGET_OS_IPHONE
+    if (!image || image.images || [image isKindOfClass:[OLImage class]]) {
+        return NO;
+    }
+
+    CGImageRef imageRef = image.CGImage;
+    if (!imageRef || CGImageGetBitsPerComponent(imageRef) != 8) {
+        return NO;
+    }
+
+    CGColorSpaceModel model = CGColorSpaceGetModel(CGImageGetColorSpace(imageRef));
+    return model == kCGColorSpaceModelRGB || model == kCGColorSpaceModelMonochrome;
+#else
+    return NO;
+#endif
+}
+
+- (BOOL)storeImage:(UIImage *)image fileName:(NSString *)fileName {
+#if TARGET_OS_IPHONE
+    if (![self canStoreImage:image]) {
+        return NO;
+    }
+
+    CGImageRef imageRef = image.CGImage;
+    size_t bytesPerRow = CGImageGetBytesPerRow(imageRef);
+    size_t height = CGImageGetHeight(imageRef);
+
+    if ((unsigned long long)bytesPerRow * height > self.maxSize / 4) {
+        return NO;
+    }
+
+    // For a decoded image this hands back the bitmap itself, no redraw
+    CFDataRef pixels = CGDataProviderCopyData(CGImageGetDataProvider(imageRef));
+    if (!pixels) {
+        return NO;
+    }
+
+    if ((size_t)CFDataGetLength(pixels) < bytesPerRow * height) {
+        CFRelease(pixels);
+        return NO;
+    }
+
+    SDImageCacheBitmapHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kBitmapMagic;
+    header.version = kBitmapVersion;
+    header.headerLength = kBitmapHeaderLength;
+    header.width = (uint32_t)CGImageGetWidth(imageRef);
+    header.height = (uint32_t)height;
+    header.bytesPerRow = (uint32_t)bytesPerRow;
+    header.bitsPerComponent = (uint32_t)CGImageGetBitsPerComponent(imageRef);
+    header.bitsPerPixel = (uint32_t)CGImageGetBitsPerPixel(imageRef);
+    header.bitmapInfo = CGImageGetBitmapInfo(imageRef);
+    header.colorComponentCount = CGColorSpaceGetModel(CGImageGetColorSpace(imageRef)) == kCGColorSpaceModelRGB ? 3 : 1;
+    header.orientation = (uint32_t)image.imageOrientation;
+    header.scale = image.scale;
+
+    NSMutableData *data = [[NSMutableData alloc] initWithCapacity:kBitmapHeaderLength + bytesPerRow * height];
+    [data appendBytes:&header length:sizeof(header)];
+    [data setLength:kBitmapHeaderLength];
+    [data appendBytes:CFDataGetBytePtr(pixels) length:bytesPerRow * height];
+    CFRelease(pixels);
+
+    [[NSFileManager new] createDirectoryAtPath:self.directory withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    // Atomic, a reader may have the previous bitmap mapped
+    if (![data writeToFile:[self pathForFileName:fileName] options:NSDataWritingAtomic error:NULL]) {
+        return NO;
+    }
+
+    [self.index recordFileName:fileName size:data.length expirationTime:0];
+
+    if (self.maxSize > 0 && self.index.totalSize > self.maxSize) {
+        [self trimToSize:self.maxSize * 3 / 4];
+    }
+
+    return YES;
+#else
+    return NO;
+#endif
+}
+
+#pragma mark Reading
+
+- (UIImage *)imageForFileName:(NSString *)fileName {
+#if TARGET_OS_IPHONE
+    // Only trust the file if the index knows it, a bitmap being replaced may still be on its way in
+    if (!self.index.isLoaded || ![self.index containsFileName:fileName]) {
+        return nil;
+    }
+
+    NSData *data = [NSData dataWithContentsOfFile:[self pathForFileName:fileName] options:NSDataReadingMappedAlways error:NULL];
+    if (data.length < kBitmapHeaderLength) {
+        return nil;
+    }
+
+    SDImageCacheBitmapHeader header;
+    memcpy(&header, data.bytes, sizeof(header));
+
+    if (header.magic != kBitmapMagic || header.version != kBitmapVersion || header.headerLength < sizeof(header) ||
+        header.width == 0 || header.height == 0 || header.bytesPerRow < (unsigned long long)header.width * header.bitsPerPixel / 8 ||
+        data.length < header.headerLength + (unsigned long long)header.bytesPerRow * header.height) {
+        return nil;
+    }
+
+    // The provider points into the mapping and keeps it alive for as long as the image lives
+    CGDataProviderRef provider = CGDataProviderCreateWithData((__bridge_retained void *)data, (const unsigned char *)data.bytes + header.headerLength,
+                                                              (size_t)header.bytesPerRow * header.height, SDImageCacheBitmapReleaseData);
+    if (!provider) {
+        return nil;
+    }
+
+    CGColorSpaceRef colorSpace = header.colorComponentCount == 3 ? CGColorSpaceCreateDeviceRGB() : CGColorSpaceCreateDeviceGray();
+
+    CGImageRef imageRef = CGImageCreate(header.width, header.height, header.bitsPerComponent, header.bitsPerPixel, header.bytesPerRow,
+                                        colorSpace, header.bitmapInfo, provider, NULL, false, kCGRenderingIntentDefault);
+
+    CGColorSpaceRelease(colorSpace);
+    CGDataProviderRelease(provider);
+
+    if (!imageRef) {
+        return nil;
+    }
+
+    UIImage *image = [UIImage imageWithCGImage:imageRef scale:header.scale orientation:(UIImageOrientation)header.orientation];
+    CGImageRelease(imageRef);
+
+    [self.index touchFileName:fileName];
+
+    return image;
+#else
+    return nil;
+#endif
+}
+
+- (BOOL)containsFileName:(NSString *)fileName {
+    return self.index.isLoaded && [self.index containsFileName:fileName];
+}
+
+#pragma mark Removing
+
+- (void)removeFileName:(NSString *)fileName {
+    if (![self.index containsFileName:fileName]) return;
+
+    [self.index removeFileName:fileName];
+    [[NSFileManager new] removeItemAtPath:[self pathForFileName:fileName] error:NULL];
+}
+
+- (void)removeAllBitmaps {
+    [[NSFileManager new] removeItemAtPath:self.directory error:NULL];
+    [self.index removeAllEntries];
+}
+
+- (void)trimToSize:(unsigned long long)size {
+    unsigned long long currentSize = self.index.totalSize;
+    if (currentSize <= size) return;
+
+    NSArray *entries = [[self.index allEntries] sortedArrayUsingComparator:^NSComparisonResult(SDImageCacheIndexEntry *entry1, SDImageCacheIndexEntry *entry2) {
+        if (entry1.lastAccessTime < entry2.lastAccessTime) return NSOrderedAscending;
+        if (entry1.lastAccessTime > entry2.lastAccessTime) return NSOrderedDescending;
+        return NSOrderedSame;
+    }];
+
+    NSFileManager *fileManager = [NSFileManager new];
+
+    for (SDImageCacheIndexEntry *entry in entries) {
+        if (currentSize <= size) break;
+
+        [self.index removeFileName:entry.fileName];
+        [fileManager removeItemAtPath:[self pathForFileName:entry.fileName] error:NULL];
+        currentSize -= MIN(entry.size, currentSize);
+    }
+
+    [self.index compactIfNeeded];
+}
+
+@end
@@ -0,0 +1,76 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+@class SDImageCacheIndexEntry;
+
+/**
+ * Decides which disk cache entries go first when SDImageCache has to make room. Entries are evicted in increasing
+ * order of their retention priority.
+ *
+ * Policies are only called from SDImageCache's IO queue and may keep state between calls.
+ */
+@protocol SDImageCacheEvictionPolicy <NSObject>
+
+/**
+ * The retention priority of an entry; the lowest is evicted first.
+ *
+ * @param entry The entry, with its size, access time and access count
+ * @param now   The current time (seconds since reference date), the same for every entry of an eviction pass
+ */
+- (double)retentionPriorityForEntry:(SDImageCacheIndexEntry *)entry now:(NSTimeInterval)now;
+
+@optional
+
+/**
+ * Called before an eviction pass ranks the entries, with every entry of the index. Entries removed since the last pass
+ * by any means (eviction, removal, expiry, clearing) are missing, so per-entry state can be dropped for them here.
+ */
+- (void)willRankEntries:(NSArray *)entries;
+
+/**
+ * Called for every entry evicted, with the priority it was evicted at.
+ */
+- (void)didEvictEntry:(SDImageCacheIndexEntry *)entry priority:(double)priority;
+
+@end
+
+/**
+ * Least recently used first. Reads count as uses.
+ */
+@interface SDImageCacheLRUEvictionPolicy : NSObject <SDImageCacheEvictionPolicy>
+@end
+
+/**
+ * Least frequently used first, with aging: the access count of an entry halves every `halfLife` seconds it isn't read,
+ * so formerly popular images don't stay forever.
+ */
+@interface SDImageCacheLFUEvictionPolicy : NSObject <SDImageCacheEvictionPolicy>
+
+/**
+ * Time after which an idle entry's access count counts for half, in seconds. Defaults to 1 day.
+ */
+@property (assign, nonatomic) NSTimeInterval halfLife;
+
+@end
+
+/**
+ * Greedy-Dual-Size-Frequency: priority = L + accessCount / size, where L is the inflation value at the entry's last
+ * access, and the inflation value is raised to the priority of each evicted entry. Small, often read images
+ * (thumbnails) are kept over large one-off ones (banners), and entries that stopped being read age out as L rises.
+ * The inflation value starts over at every launch.
+ */
+@interface SDImageCacheGDSFEvictionPolicy : NSObject <SDImageCacheEvictionPolicy>
+
+/**
+ * The current inflation value.
+ */
+@property (assign, nonatomic, readonly) double inflation;
+
+@end
@@ -0,0 +1,90 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageCacheEvictionPolicy.h"
+#import "SDImageCacheIndex.h"
+
+static const NSTimeInterval kDefaultLFUHalfLife = 60 * 60 * 24; // 1 day
+
+@implementation SDImageCacheLRUEvictionPolicy
+
+- (double)retentionPriorityForEntry:(SDImageCacheIndexEntry *)entry now:(NSTimeInterval)now {
+    return entry.lastAccessTime;
+}
+
+@end
+
+@implementation SDImageCacheLFUEvictionPolicy
+
+- (id)init {
+    if ((self = [super init])) {
+        _halfLife = kDefaultLFUHalfLife;
+    }
+    return self;
+}
+
+- (double)retentionPriorityForEntry:(SDImageCacheIndexEntry *)entry now:(NSTimeInterval)now {
+    NSTimeInterval idleTime = MAX(now - entry.lastAccessTime, 0);
+
+    // The write counts as the first use; recency breaks ties between entries read equally often
+    return (1.0 + entry.accessCount) * exp2(-idleTime / MAX(self.halfLife, 1));
+}
+
+@end
+
+@implementation SDImageCacheGDSFEvictionPolicy {
+    // The inflation value each entry was last seen accessed at, with the access count it was seen with
+    NSMutableDictionary *_accessInflations;
+    NSMutableDictionary *_accessCounts;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _accessInflations = [NSMutableDictionary new];
+        _accessCounts = [NSMutableDictionary new];
+    }
+    return self;
+}
+
+- (double)retentionPriorityForEntry:(SDImageCacheIndexEntry *)entry now:(NSTimeInterval)now {
+    NSString *fileName = entry.fileName;
+
+    // The index only tells us how often an entry was read, so an access is noticed as a changed count
+    if (!_accessInflations[fileName] || [_accessCounts[fileName] unsignedIntValue] != entry.accessCount) {
+        _accessInflations[fileName] = @(_inflation);
+        _accessCounts[fileName] = @(entry.accessCount);
+    }
+
+    return [_accessInflations[fileName] doubleValue] + (1.0 + entry.accessCount) / MAX(entry.size, 1);
+}
+
+- (void)willRankEntries:(NSArray *)entries {
+    NSMutableDictionary *accessInflations = [[NSMutableDictionary alloc] initWithCapacity:entries.count];
+    NSMutableDictionary *accessCounts = [[NSMutableDictionary alloc] initWithCapacity:entries.count];
+
+    // Keep what we know of the entries still in the index, forget the others
+    for (SDImageCacheIndexEntry *entry in entries) {
+        NSString *fileName = entry.fileName;
+        if (!_accessInflations[fileName]) continue;
+
+        accessInflations[fileName] = _accessInflations[fileName];
+        accessCounts[fileName] = _accessCounts[fileName];
+    }
+
+    _accessInflations = accessInflations;
+    _accessCounts = accessCounts;
+}
+
+- (void)didEvictEntry:(SDImageCacheIndexEntry *)entry priority:(double)priority {
+    _inflation = MAX(_inflation, priority);
+
+    [_accessInflations removeObjectForKey:entry.fileName];
+    [_accessCounts removeObjectForKey:entry.fileName];
+}
+
+@end
@@ -0,0 +1,264 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Converts between a cache file name (32 hex characters) and the 16 byte key digest it encodes.
+ */
+extern BOOL SDImageCacheIndexDigestFromFileName(NSString *fileName, unsigned char digest[16]);
+extern NSString *SDImageCacheIndexFileNameFromDigest(const unsigned char digest[16]);
+
+/**
+ * A snapshot of the metadata SDImageCacheIndex keeps for one disk cache file.
+ */
+@interface SDImageCacheIndexEntry : NSObject <NSCopying>
+
+/**
+ * The cache file name (the hex digest of the key, see `sharded`).
+ */
+@property (strong, nonatomic, readonly) NSString *fileName;
+
+/**
+ * Size of the cached payload, in bytes.
+ */
+@property (assign, nonatomic) unsigned long long size;
+
+/**
+ * Time the entry was written (seconds since reference date). Plays the role the file modification date used to.
+ */
+@property (assign, nonatomic) NSTimeInterval creationTime;
+
+/**
+ * Time the entry was last read or written (seconds since reference date).
+ */
+@property (assign, nonatomic) NSTimeInterval lastAccessTime;
+
+/**
+ * Time until which the entry is fresh (seconds since reference date), as given by the HTTP caching headers of the
+ * response it was downloaded from, or 0 if unknown. A stale entry is still kept until `maxCacheAge` so that it can be
+ * revalidated.
+ */
+@property (assign, nonatomic) NSTimeInterval expirationTime;
+
+/**
+ * The `ETag` of the response the payload was downloaded from, or nil.
+ */
+@property (strong, nonatomic) NSString *entityTag;
+
+/**
+ * The `Last-Modified` header of the response the payload was downloaded from, kept verbatim, or nil.
+ */
+@property (strong, nonatomic) NSString *lastModified;
+
+/**
+ * Identifier of the segment holding the payload when it was packed by SDImageCacheSegmentStore, 0 for a standalone file.
+ */
+@property (assign, nonatomic) uint32_t segment;
+
+/**
+ * Offset of the packed payload inside its segment.
+ */
+@property (assign, nonatomic) uint64_t segmentOffset;
+
+/**
+ * File name of the shared content blob holding the payload when the cache deduplicates payloads (a digest of the
+ * payload itself), nil otherwise. Entries with the same content file name share one copy of the payload.
+ */
+@property (strong, nonatomic) NSString *contentFileName;
+
+/**
+ * Number of times the entry was read (see `touchFileName:`). Kept across stores of the same key.
+ */
+@property (assign, nonatomic) uint32_t accessCount;
+
+/**
+ * YES if the file name is the key hash of the sharded disk layout, and a standalone file lives in its shard directory
+ * (`ab/cd/abcd…`). NO for the MD5 file names of the flat layout, whose standalone files sit in the cache directory.
+ */
+@property (assign, nonatomic) BOOL sharded;
+
+- (id)initWithFileName:(NSString *)fileName;
+
+@end
+
+/**
+ * SDImageCacheIndex keeps the metadata of every file in a disk cache directory in memory, so size, count and
+ * eviction queries never have to enumerate the file system.
+ *
+ * The index is persisted as an append-only journal (a hidden file inside the cache directory). Every mutation
+ * appends one fixed-size record; the journal is rewritten from the in-memory state once it holds twice as many
+ * records as there are live entries. If the journal is missing or unreadable the index is rebuilt once by
+ * enumerating the directory.
+ *
+ * Records are length-prefixed and may carry typed extensions (e.g. the segment location of a packed payload).
+ *
+ * All methods are thread safe. Queries run concurrently and mutations apply right away; both only hold a reader-writer
+ * lock around the in-memory dictionary. The journal is written on a private serial queue, so once loaded the index
+ * never makes a caller wait for the disk.
+ */
+@interface SDImageCacheIndex : NSObject
+
+/**
+ * The directory this index describes.
+ */
+@property (strong, nonatomic, readonly) NSString *directory;
+
+/**
+ * Number of entries in the index.
+ */
+@property (assign, nonatomic, readonly) NSUInteger count;
+
+/**
+ * Number of entries not in the sharded layout (see `-[SDImageCacheIndexEntry sharded]`).
+ */
+@property (assign, nonatomic, readonly) NSUInteger flatCount;
+
+/**
+ * Sum of the sizes of all entries, in bytes.
+ */
+@property (assign, nonatomic, readonly) unsigned long long totalSize;
+
+/**
+ * YES if the last `load` had to rebuild the index from a directory enumeration because the journal was missing.
+ * Payloads packed into segments can't be discovered that way and must be re-recorded by the owner.
+ */
+@property (assign, nonatomic, readonly) BOOL rebuilt;
+
+/**
+ * YES once `load` completed. Unlike the other queries this never waits, so callers that must not block can check it
+ * first and fall back to the file system while the index is loading.
+ */
+@property (assign, atomic, readonly, getter = isLoaded) BOOL loaded;
+
+/**
+ * Init an index for the given cache directory. The index is empty until `load` is called.
+ *
+ * @param directory The disk cache directory
+ */
+- (id)initWithDirectory:(NSString *)directory;
+
+/**
+ * Asynchronously read the journal (or rebuild it from the directory). Queries issued afterwards wait for the load;
+ * mutations don't, they are applied once it completes.
+ */
+- (void)load;
+
+/**
+ * Returns a copy of the entry for the given file name, or nil.
+ */
+- (SDImageCacheIndexEntry *)entryForFileName:(NSString *)fileName;
+
+/**
+ * Same as `entryForFileName:`, but waits at most `timeout` seconds for a load or a mutation in progress.
+ *
+ * @param entry    On return, a copy of the entry, or nil if the index holds none. Untouched if the lookup gave up.
+ * @param fileName The cache file name
+ * @param timeout  The longest time to wait, 0 to only answer if the index is available right away
+ *
+ * @return NO if the lookup would have had to wait longer than `timeout`
+ */
+- (BOOL)getEntry:(SDImageCacheIndexEntry **)entry forFileName:(NSString *)fileName timeout:(NSTimeInterval)timeout;
+
+/**
+ * Returns YES if the index holds an entry for the given file name.
+ */
+- (BOOL)containsFileName:(NSString *)fileName;
+
+/**
+ * Returns a copy of every entry.
+ */
+- (NSArray *)allEntries;
+
+/**
+ * Record a newly written file.
+ *
+ * @param fileName       The cache file name
+ * @param size           The payload size, in bytes
+ * @param expirationTime Time until which the entry is fresh, or 0
+ */
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime;
+
+/**
+ * Same as `recordFileName:size:expirationTime:`, for a file name of the given layout.
+ */
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime sharded:(BOOL)sharded;
+
+/**
+ * Record a payload packed into a segment.
+ *
+ * @param fileName       The cache file name
+ * @param size           The payload size, in bytes
+ * @param expirationTime Time until which the entry is fresh, or 0
+ * @param segment        The segment identifier
+ * @param offset         The payload offset inside the segment
+ */
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime segment:(uint32_t)segment offset:(uint64_t)offset;
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime segment:(uint32_t)segment offset:(uint64_t)offset sharded:(BOOL)sharded;
+
+/**
+ * Record a key whose payload is stored once, in a content blob shared with other keys of the same content.
+ *
+ * @param fileName        The cache file name
+ * @param size            The payload size, in bytes
+ * @param expirationTime  Time until which the entry is fresh, or 0
+ * @param contentFileName The file name of the content blob
+ */
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime contentFileName:(NSString *)contentFileName;
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime contentFileName:(NSString *)contentFileName sharded:(BOOL)sharded;
+
+/**
+ * Point an existing entry at a new segment location, keeping its times. Used by segment compaction.
+ */
+- (void)relocateFileName:(NSString *)fileName segment:(uint32_t)segment offset:(uint64_t)offset;
+
+/**
+ * Move an existing entry to a new file name, keeping everything else. Used to migrate an entry between disk layouts
+ * once its file was moved. Does nothing if the entry is unknown or the new file name is taken.
+ */
+- (void)renameFileName:(NSString *)fileName toFileName:(NSString *)newFileName sharded:(BOOL)sharded;
+
+/**
+ * Set the HTTP metadata of an existing entry and restart its age, after a store or after the server confirmed the
+ * payload unchanged. Does nothing if the entry is unknown.
+ *
+ * @param fileName       The cache file name
+ * @param expirationTime Time until which the entry is fresh, or 0
+ * @param entityTag      The `ETag` of the response, or nil
+ * @param lastModified   The `Last-Modified` header of the response, or nil
+ */
+- (void)revalidateFileName:(NSString *)fileName expirationTime:(NSTimeInterval)expirationTime entityTag:(NSString *)entityTag lastModified:(NSString *)lastModified;
+
+/**
+ * Mark an entry as accessed now and count the access. Access times and counts are journaled at most once a minute
+ * per entry.
+ */
+- (void)touchFileName:(NSString *)fileName;
+
+/**
+ * Forget an entry. Does nothing if the entry is unknown.
+ */
+- (void)removeFileName:(NSString *)fileName;
+
+/**
+ * Forget an entry only if it is still the one described by the given snapshot (same creation time and location).
+ * Lets a reader drop a stale entry without racing a concurrent store of the same key.
+ */
+- (void)removeEntry:(SDImageCacheIndexEntry *)entry;
+
+/**
+ * Forget every entry and reset the journal.
+ */
+- (void)removeAllEntries;
+
+/**
+ * Rewrite the journal from the in-memory state if it has grown past its compaction threshold.
+ */
+- (void)compactIfNeeded;
+
+@end
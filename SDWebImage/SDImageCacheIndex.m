@@ -0,0 +1,889 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageCacheIndex.h"
+#import "SDWebImageCompat.h"
+#import <fcntl.h>
+#import <unistd.h>
+#import <pthread.h>
+
+static NSString *const kJournalFileName = @".sdindex";
+static const uint32_t kJournalMagic = 0x58494453; // "SDIX"
+static const uint32_t kJournalVersion = 1;
+static const NSUInteger kCompactionMinimumRecords = 1024;
+static const NSTimeInterval kAccessJournalInterval = 60;
+static const NSUInteger kMaxValidatorLength = 1024;
+static const useconds_t kTryLockRetryInterval = 50; // microseconds
+
+typedef NS_ENUM(uint8_t, SDImageCacheIndexOperation) {
+    SDImageCacheIndexOperationSet = 1,
+    SDImageCacheIndexOperationRemove = 2,
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} SDImageCacheIndexJournalHeader;
+
+// Records are length-prefixed so that newer writers can append fields; readers skip anything past the fields they know.
+// Optional fields follow the fixed part as extensions, each starting with a SDImageCacheIndexRecordExtension header.
+typedef struct {
+    uint32_t length;
+    uint8_t operation;
+    uint8_t flags; // SDImageCacheIndexRecordFlags, 0 in records of older writers
+    uint8_t reserved[2];
+    unsigned char digest[16];
+    uint64_t size;
+    double creationTime;
+    double lastAccessTime;
+    double expirationTime;
+} SDImageCacheIndexRecord;
+
+typedef NS_OPTIONS(uint8_t, SDImageCacheIndexRecordFlags) {
+    SDImageCacheIndexRecordFlagSharded = 1 << 0,
+};
+
+typedef NS_ENUM(uint16_t, SDImageCacheIndexExtensionType) {
+    SDImageCacheIndexExtensionSegmentLocation = 1,
+    SDImageCacheIndexExtensionAccessCount = 2,
+    SDImageCacheIndexExtensionContentDigest = 3,
+    SDImageCacheIndexExtensionValidators = 4,
+};
+
+typedef struct {
+    uint16_t type;
+    uint16_t length; // including this header
+} SDImageCacheIndexRecordExtension;
+
+typedef struct {
+    SDImageCacheIndexRecordExtension header;
+    uint32_t segment;
+    uint64_t offset;
+} SDImageCacheIndexSegmentLocationExtension;
+
+typedef struct {
+    SDImageCacheIndexRecordExtension header;
+    uint32_t accessCount;
+} SDImageCacheIndexAccessCountExtension;
+
+typedef struct {
+    SDImageCacheIndexRecordExtension header;
+    unsigned char digest[16];
+} SDImageCacheIndexContentDigestExtension;
+
+// Followed by the UTF-8 bytes of the entity tag, then those of the last modified date
+typedef struct {
+    SDImageCacheIndexRecordExtension header;
+    uint16_t entityTagLength;
+    uint16_t lastModifiedLength;
+} SDImageCacheIndexValidatorsExtension;
+
+BOOL SDImageCacheIndexDigestFromFileName(NSString *fileName, unsigned char digest[16]) {
+    if (fileName.length != 32) return NO;
+
+    const char *str = [fileName UTF8String];
+
+    for (NSUInteger i = 0; i < 16; ++i) {
+        unsigned char byte = 0;
+
+        for (NSUInteger j = 0; j < 2; ++j) {
+            char c = str[i * 2 + j];
+
+            byte <<= 4;
+            if (c >= '0' && c <= '9') byte |= c - '0';
+            else if (c >= 'a' && c <= 'f') byte |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') byte |= c - 'A' + 10;
+            else return NO;
+        }
+
+        digest[i] = byte;
+    }
+
+    return YES;
+}
+
+NSString *SDImageCacheIndexFileNameFromDigest(const unsigned char digest[16]) {
+    static const char hex[] = "0123456789abcdef";
+    char str[33];
+
+    for (NSUInteger i = 0; i < 16; ++i) {
+        str[i * 2] = hex[digest[i] >> 4];
+        str[i * 2 + 1] = hex[digest[i] & 0x0F];
+    }
+    str[32] = '\0';
+
+    return [[NSString alloc] initWithBytes:str length:32 encoding:NSASCIIStringEncoding];
+}
+
+// Shard directories of the sharded layout are named after one byte of the file name, in lowercase hex
+static BOOL SDImageCacheIndexIsShardName(NSString *name) {
+    if (name.length != 2) return NO;
+
+    for (NSUInteger i = 0; i < 2; ++i) {
+        unichar c = [name characterAtIndex:i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return NO;
+    }
+
+    return YES;
+}
+
+@interface SDImageCacheIndexEntry ()
+
+@property (strong, nonatomic, readwrite) NSString *fileName;
+@property (assign, nonatomic) NSTimeInterval journaledAccessTime;
+
+@end
+
+@implementation SDImageCacheIndexEntry
+
+- (id)initWithFileName:(NSString *)fileName {
+    if ((self = [super init])) {
+        _fileName = [fileName copy];
+    }
+    return self;
+}
+
+- (id)copyWithZone:(NSZone *)zone {
+    SDImageCacheIndexEntry *entry = [[[self class] allocWithZone:zone] initWithFileName:_fileName];
+    entry.size = _size;
+    entry.creationTime = _creationTime;
+    entry.lastAccessTime = _lastAccessTime;
+    entry.expirationTime = _expirationTime;
+    entry.segment = _segment;
+    entry.segmentOffset = _segmentOffset;
+    entry.contentFileName = _contentFileName;
+    entry.entityTag = _entityTag;
+    entry.lastModified = _lastModified;
+    entry.accessCount = _accessCount;
+    entry.sharded = _sharded;
+    entry.journaledAccessTime = _journaledAccessTime;
+    return entry;
+}
+
+@end
+
+@interface SDImageCacheIndex ()
+
+@property (strong, nonatomic, readwrite) NSString *directory;
+@property (strong, nonatomic) NSString *journalPath;
+@property (strong, nonatomic) NSMutableDictionary *entries;
+@property (assign, atomic, readwrite, getter = isLoaded) BOOL loaded;
+// Serial queue doing all the journal I/O, so that no lock is ever held across a disk access
+@property (SDDispatchQueueSetterSementics, nonatomic) dispatch_queue_t journalQueue;
+
+@end
+
+@implementation SDImageCacheIndex {
+    // Guards the in-memory state below; held around dictionary operations only
+    pthread_rwlock_t _lock;
+    NSUInteger _count;
+    NSUInteger _flatCount;
+    unsigned long long _totalSize;
+    BOOL _rebuilt;
+    BOOL _loading; // While set, only the load touches the entries, mutations are deferred
+    NSMutableArray *_deferredMutations;
+    dispatch_group_t _loadGroup;
+
+    // Only touched on journalQueue
+    int _journalFileDescriptor;
+    NSUInteger _journalRecordCount;
+}
+
+- (id)initWithDirectory:(NSString *)directory {
+    if ((self = [super init])) {
+        _directory = [directory copy];
+        _journalPath = [directory stringByAppendingPathComponent:kJournalFileName];
+        _entries = [NSMutableDictionary new];
+        _journalQueue = dispatch_queue_create("com.hackemist.SDImageCacheIndex", DISPATCH_QUEUE_SERIAL);
+        _deferredMutations = [NSMutableArray new];
+        _loadGroup = dispatch_group_create();
+        _journalFileDescriptor = -1;
+        pthread_rwlock_init(&_lock, NULL);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_journalFileDescriptor >= 0) {
+        close(_journalFileDescriptor);
+    }
+    pthread_rwlock_destroy(&_lock);
+    SDDispatchQueueRelease(_journalQueue);
+    SDDispatchQueueRelease(_loadGroup);
+}
+
+#pragma mark Locking
+
+- (void)_lockForReading {
+    while (YES) {
+        dispatch_group_wait(_loadGroup, DISPATCH_TIME_FOREVER);
+
+        pthread_rwlock_rdlock(&_lock);
+        if (!_loading) return;
+
+        // A load started between the wait and the lock
+        pthread_rwlock_unlock(&_lock);
+    }
+}
+
+- (BOOL)_tryLockForReadingWithTimeout:(NSTimeInterval)timeout {
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + MAX(timeout, 0);
+
+    while (YES) {
+        NSTimeInterval remaining = MAX(deadline - CFAbsoluteTimeGetCurrent(), 0);
+        if (dispatch_group_wait(_loadGroup, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(remaining * NSEC_PER_SEC))) != 0) {
+            return NO;
+        }
+
+        // Writers only hold the lock for a dictionary operation, polling is cheaper than a timed wait would be
+        while (pthread_rwlock_tryrdlock(&_lock) != 0) {
+            if (CFAbsoluteTimeGetCurrent() >= deadline) return NO;
+            usleep(kTryLockRetryInterval);
+        }
+
+        if (!_loading) return YES;
+
+        pthread_rwlock_unlock(&_lock);
+        if (CFAbsoluteTimeGetCurrent() >= deadline) return NO;
+    }
+}
+
+- (void)_unlock {
+    pthread_rwlock_unlock(&_lock);
+}
+
+- (void)_mutate:(void (^)(void))mutation {
+    pthread_rwlock_wrlock(&_lock);
+
+    if (_loading) {
+        [_deferredMutations addObject:[mutation copy]];
+    } else {
+        mutation();
+    }
+
+    pthread_rwlock_unlock(&_lock);
+}
+
+#pragma mark Queries
+
+- (NSUInteger)count {
+    [self _lockForReading];
+    NSUInteger count = _count;
+    [self _unlock];
+    return count;
+}
+
+- (NSUInteger)flatCount {
+    [self _lockForReading];
+    NSUInteger flatCount = _flatCount;
+    [self _unlock];
+    return flatCount;
+}
+
+- (unsigned long long)totalSize {
+    [self _lockForReading];
+    unsigned long long totalSize = _totalSize;
+    [self _unlock];
+    return totalSize;
+}
+
+- (BOOL)rebuilt {
+    [self _lockForReading];
+    BOOL rebuilt = _rebuilt;
+    [self _unlock];
+    return rebuilt;
+}
+
+- (SDImageCacheIndexEntry *)entryForFileName:(NSString *)fileName {
+    if (!fileName) return nil;
+
+    [self _lockForReading];
+    SDImageCacheIndexEntry *entry = [self.entries[fileName] copy];
+    [self _unlock];
+    return entry;
+}
+
+- (BOOL)getEntry:(SDImageCacheIndexEntry **)entry forFileName:(NSString *)fileName timeout:(NSTimeInterval)timeout {
+    if (!fileName) {
+        if (entry) *entry = nil;
+        return YES;
+    }
+
+    if (![self _tryLockForReadingWithTimeout:timeout]) {
+        return NO;
+    }
+
+    SDImageCacheIndexEntry *foundEntry = [self.entries[fileName] copy];
+    [self _unlock];
+
+    if (entry) *entry = foundEntry;
+    return YES;
+}
+
+- (BOOL)containsFileName:(NSString *)fileName {
+    if (!fileName) return NO;
+
+    [self _lockForReading];
+    BOOL contains = self.entries[fileName] != nil;
+    [self _unlock];
+    return contains;
+}
+
+- (NSArray *)allEntries {
+    [self _lockForReading];
+    NSMutableArray *allEntries = [[NSMutableArray alloc] initWithCapacity:self.entries.count];
+    for (SDImageCacheIndexEntry *entry in [self.entries objectEnumerator]) {
+        [allEntries addObject:[entry copy]];
+    }
+    [self _unlock];
+    return allEntries;
+}
+
+#pragma mark Mutations
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime {
+    [self recordFileName:fileName size:size expirationTime:expirationTime sharded:NO];
+}
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime sharded:(BOOL)sharded {
+    [self _recordFileName:fileName size:size expirationTime:expirationTime segment:0 offset:0 contentFileName:nil sharded:sharded];
+}
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime segment:(uint32_t)segment offset:(uint64_t)offset {
+    [self recordFileName:fileName size:size expirationTime:expirationTime segment:segment offset:offset sharded:NO];
+}
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime segment:(uint32_t)segment offset:(uint64_t)offset sharded:(BOOL)sharded {
+    [self _recordFileName:fileName size:size expirationTime:expirationTime segment:segment offset:offset contentFileName:nil sharded:sharded];
+}
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime contentFileName:(NSString *)contentFileName {
+    [self recordFileName:fileName size:size expirationTime:expirationTime contentFileName:contentFileName sharded:NO];
+}
+
+- (void)recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime contentFileName:(NSString *)contentFileName sharded:(BOOL)sharded {
+    [self _recordFileName:fileName size:size expirationTime:expirationTime segment:0 offset:0 contentFileName:contentFileName sharded:sharded];
+}
+
+- (void)_recordFileName:(NSString *)fileName size:(unsigned long long)size expirationTime:(NSTimeInterval)expirationTime segment:(uint32_t)segment offset:(uint64_t)offset contentFileName:(NSString *)contentFileName sharded:(BOOL)sharded {
+    if (!fileName) return;
+
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = [[SDImageCacheIndexEntry alloc] initWithFileName:fileName];
+        entry.size = size;
+        entry.creationTime = now;
+        entry.lastAccessTime = now;
+        entry.expirationTime = expirationTime;
+        entry.segment = segment;
+        entry.segmentOffset = offset;
+        entry.contentFileName = contentFileName;
+        entry.sharded = sharded;
+        entry.accessCount = [self.entries[fileName] accessCount];
+
+        [self _setEntry:entry];
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationSet];
+    }];
+}
+
+- (void)relocateFileName:(NSString *)fileName segment:(uint32_t)segment offset:(uint64_t)offset {
+    if (!fileName) return;
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[fileName];
+        if (!entry) return;
+
+        entry.segment = segment;
+        entry.segmentOffset = offset;
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationSet];
+    }];
+}
+
+- (void)renameFileName:(NSString *)fileName toFileName:(NSString *)newFileName sharded:(BOOL)sharded {
+    if (!fileName || !newFileName) return;
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[fileName];
+        if (!entry || self.entries[newFileName]) return;
+
+        SDImageCacheIndexEntry *renamedEntry = [entry copy];
+        renamedEntry.fileName = newFileName;
+        renamedEntry.sharded = sharded;
+
+        [self _removeEntry:entry];
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationRemove];
+        [self _setEntry:renamedEntry];
+        [self _appendRecordForEntry:renamedEntry operation:SDImageCacheIndexOperationSet];
+    }];
+}
+
+- (void)revalidateFileName:(NSString *)fileName expirationTime:(NSTimeInterval)expirationTime entityTag:(NSString *)entityTag lastModified:(NSString *)lastModified {
+    if (!fileName) return;
+
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[fileName];
+        if (!entry) return;
+
+        entry.creationTime = now;
+        entry.expirationTime = expirationTime;
+        entry.entityTag = entityTag;
+        entry.lastModified = lastModified;
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationSet];
+    }];
+}
+
+- (void)touchFileName:(NSString *)fileName {
+    if (!fileName) return;
+
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[fileName];
+        if (!entry) return;
+
+        entry.lastAccessTime = now;
+        if (entry.accessCount < UINT32_MAX) entry.accessCount++;
+
+        if (now - entry.journaledAccessTime >= kAccessJournalInterval) {
+            [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationSet];
+        }
+    }];
+}
+
+- (void)removeFileName:(NSString *)fileName {
+    if (!fileName) return;
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[fileName];
+        if (!entry) return;
+
+        [self _removeEntry:entry];
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationRemove];
+    }];
+}
+
+- (void)removeEntry:(SDImageCacheIndexEntry *)staleEntry {
+    if (!staleEntry.fileName) return;
+
+    [self _mutate:^{
+        SDImageCacheIndexEntry *entry = self.entries[staleEntry.fileName];
+        if (!entry || entry.creationTime != staleEntry.creationTime || entry.segment != staleEntry.segment || entry.segmentOffset != staleEntry.segmentOffset) return;
+
+        [self _removeEntry:entry];
+        [self _appendRecordForEntry:entry operation:SDImageCacheIndexOperationRemove];
+    }];
+}
+
+- (void)removeAllEntries {
+    [self _mutate:^{
+        [self.entries removeAllObjects];
+        _count = 0;
+        _flatCount = 0;
+        _totalSize = 0;
+
+        dispatch_async(self.journalQueue, ^{
+            [self _writeJournal];
+        });
+    }];
+}
+
+- (void)compactIfNeeded {
+    dispatch_async(self.journalQueue, ^{
+        [self _compactIfNeeded];
+    });
+}
+
+#pragma mark Loading
+
+- (void)load {
+    pthread_rwlock_wrlock(&_lock);
+    if (_loading) {
+        pthread_rwlock_unlock(&_lock);
+        return;
+    }
+    _loading = YES;
+    self.loaded = NO;
+    dispatch_group_enter(_loadGroup);
+    pthread_rwlock_unlock(&_lock);
+
+    dispatch_async(self.journalQueue, ^{
+        @autoreleasepool {
+            // No lock needed: readers wait for the load, and mutations are deferred until it's done
+            _rebuilt = NO;
+
+            if (![self _readJournal]) {
+                _rebuilt = YES;
+                [self _rebuildFromDirectory];
+                [self _writeJournal];
+            }
+
+            pthread_rwlock_wrlock(&_lock);
+            _loading = NO;
+            for (void (^mutation)(void) in _deferredMutations) {
+                mutation();
+            }
+            [_deferredMutations removeAllObjects];
+            self.loaded = YES;
+            pthread_rwlock_unlock(&_lock);
+
+            dispatch_group_leave(_loadGroup);
+        }
+    });
+}
+
+- (BOOL)_readJournal {
+    NSData *journal = [NSData dataWithContentsOfFile:self.journalPath options:NSDataReadingMappedIfSafe error:NULL];
+    if (journal.length < sizeof(SDImageCacheIndexJournalHeader)) {
+        return NO;
+    }
+
+    const unsigned char *bytes = journal.bytes;
+    const NSUInteger length = journal.length;
+
+    SDImageCacheIndexJournalHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (header.magic != kJournalMagic || header.version != kJournalVersion) {
+        return NO;
+    }
+
+    NSUInteger offset = sizeof(header);
+    NSUInteger recordCount = 0;
+
+    while (offset + sizeof(uint32_t) <= length) {
+        uint32_t recordLength = 0;
+        memcpy(&recordLength, bytes + offset, sizeof(recordLength));
+
+        // A short or torn record can only be the tail of an interrupted write, drop it
+        if (recordLength < sizeof(SDImageCacheIndexRecord) || offset + recordLength > length) {
+            break;
+        }
+
+        SDImageCacheIndexRecord record;
+        memcpy(&record, bytes + offset, sizeof(record));
+
+        NSUInteger extensionOffset = offset + sizeof(record);
+        offset += recordLength;
+        ++recordCount;
+
+        NSString *fileName = SDImageCacheIndexFileNameFromDigest(record.digest);
+
+        if (record.operation == SDImageCacheIndexOperationSet) {
+            SDImageCacheIndexEntry *entry = [[SDImageCacheIndexEntry alloc] initWithFileName:fileName];
+            entry.size = record.size;
+            entry.creationTime = record.creationTime;
+            entry.lastAccessTime = record.lastAccessTime;
+            entry.journaledAccessTime = record.lastAccessTime;
+            entry.expirationTime = record.expirationTime;
+            entry.sharded = (record.flags & SDImageCacheIndexRecordFlagSharded) != 0;
+
+            while (extensionOffset + sizeof(SDImageCacheIndexRecordExtension) <= offset) {
+                SDImageCacheIndexRecordExtension extension;
+                memcpy(&extension, bytes + extensionOffset, sizeof(extension));
+
+                if (extension.length < sizeof(extension) || extensionOffset + extension.length > offset) {
+                    break;
+                }
+
+                if (extension.type == SDImageCacheIndexExtensionSegmentLocation && extension.length >= sizeof(SDImageCacheIndexSegmentLocationExtension)) {
+                    SDImageCacheIndexSegmentLocationExtension location;
+                    memcpy(&location, bytes + extensionOffset, sizeof(location));
+                    entry.segment = location.segment;
+                    entry.segmentOffset = location.offset;
+                } else if (extension.type == SDImageCacheIndexExtensionAccessCount && extension.length >= sizeof(SDImageCacheIndexAccessCountExtension)) {
+                    SDImageCacheIndexAccessCountExtension accessCount;
+                    memcpy(&accessCount, bytes + extensionOffset, sizeof(accessCount));
+                    entry.accessCount = accessCount.accessCount;
+                } else if (extension.type == SDImageCacheIndexExtensionContentDigest && extension.length >= sizeof(SDImageCacheIndexContentDigestExtension)) {
+                    SDImageCacheIndexContentDigestExtension contentDigest;
+                    memcpy(&contentDigest, bytes + extensionOffset, sizeof(contentDigest));
+                    entry.contentFileName = SDImageCacheIndexFileNameFromDigest(contentDigest.digest);
+                } else if (extension.type == SDImageCacheIndexExtensionValidators && extension.length >= sizeof(SDImageCacheIndexValidatorsExtension)) {
+                    SDImageCacheIndexValidatorsExtension validators;
+                    memcpy(&validators, bytes + extensionOffset, sizeof(validators));
+
+                    if (sizeof(validators) + validators.entityTagLength + validators.lastModifiedLength <= extension.length) {
+                        const unsigned char *validatorBytes = bytes + extensionOffset + sizeof(validators);
+                        if (validators.entityTagLength) {
+                            entry.entityTag = [[NSString alloc] initWithBytes:validatorBytes length:validators.entityTagLength encoding:NSUTF8StringEncoding];
+                        }
+                        if (validators.lastModifiedLength) {
+                            entry.lastModified = [[NSString alloc] initWithBytes:validatorBytes + validators.entityTagLength length:validators.lastModifiedLength encoding:NSUTF8StringEncoding];
+                        }
+                    }
+                }
+
+                extensionOffset += extension.length;
+            }
+
+            [self _setEntry:entry];
+        } else if (record.operation == SDImageCacheIndexOperationRemove) {
+            SDImageCacheIndexEntry *entry = self.entries[fileName];
+            if (entry) [self _removeEntry:entry];
+        }
+    }
+
+    _journalRecordCount = recordCount;
+
+    _journalFileDescriptor = open([self.journalPath fileSystemRepresentation], O_WRONLY | O_APPEND);
+    if (_journalFileDescriptor < 0) {
+        return NO;
+    }
+
+    if (offset < length) {
+        ftruncate(_journalFileDescriptor, offset);
+    }
+
+    [self _compactIfNeeded];
+
+    return YES;
+}
+
+- (void)_rebuildFromDirectory {
+    [self.entries removeAllObjects];
+    _count = 0;
+    _flatCount = 0;
+    _totalSize = 0;
+
+    NSFileManager *fileManager = [NSFileManager new];
+
+    [self _rebuildFromDirectory:self.directory fileManager:fileManager sharded:NO];
+
+    // Files of the sharded layout live two levels down, in directories named after the first bytes of their name
+    for (NSString *shardName in [fileManager contentsOfDirectoryAtPath:self.directory error:NULL]) {
+        if (!SDImageCacheIndexIsShardName(shardName)) continue;
+
+        NSString *shardPath = [self.directory stringByAppendingPathComponent:shardName];
+
+        for (NSString *subshardName in [fileManager contentsOfDirectoryAtPath:shardPath error:NULL]) {
+            if (!SDImageCacheIndexIsShardName(subshardName)) continue;
+
+            [self _rebuildFromDirectory:[shardPath stringByAppendingPathComponent:subshardName] fileManager:fileManager sharded:YES];
+        }
+    }
+}
+
+- (void)_rebuildFromDirectory:(NSString *)directory fileManager:(NSFileManager *)fileManager sharded:(BOOL)sharded {
+    NSURL *directoryURL = [NSURL fileURLWithPath:directory isDirectory:YES];
+    NSArray *resourceKeys = @[NSURLIsDirectoryKey, NSURLContentModificationDateKey, NSURLFileSizeKey];
+
+    NSDirectoryEnumerator *fileEnumerator = [fileManager enumeratorAtURL:directoryURL
+                                              includingPropertiesForKeys:resourceKeys
+                                                                 options:NSDirectoryEnumerationSkipsHiddenFiles | NSDirectoryEnumerationSkipsSubdirectoryDescendants
+                                                            errorHandler:NULL];
+
+    for (NSURL *fileURL in fileEnumerator) {
+        NSDictionary *resourceValues = [fileURL resourceValuesForKeys:resourceKeys error:NULL];
+
+        if ([resourceValues[NSURLIsDirectoryKey] boolValue]) {
+            continue;
+        }
+
+        // Only files named after a key digest belong to the cache
+        NSString *fileName = [fileURL lastPathComponent];
+        unsigned char digest[16];
+        if (!SDImageCacheIndexDigestFromFileName(fileName, digest)) {
+            continue;
+        }
+
+        NSTimeInterval modificationTime = [resourceValues[NSURLContentModificationDateKey] timeIntervalSinceReferenceDate];
+
+        SDImageCacheIndexEntry *entry = [[SDImageCacheIndexEntry alloc] initWithFileName:fileName];
+        entry.size = [resourceValues[NSURLFileSizeKey] unsignedLongLongValue];
+        entry.creationTime = modificationTime;
+        entry.lastAccessTime = modificationTime;
+        entry.sharded = sharded;
+        [self _setEntry:entry];
+    }
+}
+
+#pragma mark Entries (inside the write lock, or the load)
+
+- (void)_setEntry:(SDImageCacheIndexEntry *)entry {
+    SDImageCacheIndexEntry *previousEntry = self.entries[entry.fileName];
+    if (previousEntry) {
+        _totalSize -= previousEntry.size;
+        if (!previousEntry.sharded) --_flatCount;
+    } else {
+        ++_count;
+    }
+
+    self.entries[entry.fileName] = entry;
+    _totalSize += entry.size;
+    if (!entry.sharded) ++_flatCount;
+}
+
+- (void)_removeEntry:(SDImageCacheIndexEntry *)entry {
+    _totalSize -= entry.size;
+    --_count;
+    if (!entry.sharded) --_flatCount;
+    [self.entries removeObjectForKey:entry.fileName];
+}
+
+- (NSData *)_recordForEntry:(SDImageCacheIndexEntry *)entry operation:(SDImageCacheIndexOperation)operation {
+    SDImageCacheIndexRecord record;
+    memset(&record, 0, sizeof(record));
+
+    if (!SDImageCacheIndexDigestFromFileName(entry.fileName, record.digest)) {
+        return nil;
+    }
+
+    record.length = sizeof(record);
+    record.operation = operation;
+    record.flags = entry.sharded ? SDImageCacheIndexRecordFlagSharded : 0;
+
+    if (operation == SDImageCacheIndexOperationRemove) {
+        return [NSData dataWithBytes:&record length:sizeof(record)];
+    }
+
+    record.size = entry.size;
+    record.creationTime = entry.creationTime;
+    record.lastAccessTime = entry.lastAccessTime;
+    record.expirationTime = entry.expirationTime;
+
+    SDImageCacheIndexSegmentLocationExtension location;
+    if (entry.segment) {
+        memset(&location, 0, sizeof(location));
+        location.header.type = SDImageCacheIndexExtensionSegmentLocation;
+        location.header.length = sizeof(location);
+        location.segment = entry.segment;
+        location.offset = entry.segmentOffset;
+        record.length += sizeof(location);
+    }
+
+    SDImageCacheIndexAccessCountExtension accessCount;
+    if (entry.accessCount) {
+        memset(&accessCount, 0, sizeof(accessCount));
+        accessCount.header.type = SDImageCacheIndexExtensionAccessCount;
+        accessCount.header.length = sizeof(accessCount);
+        accessCount.accessCount = entry.accessCount;
+        record.length += sizeof(accessCount);
+    }
+
+    SDImageCacheIndexContentDigestExtension contentDigest;
+    memset(&contentDigest, 0, sizeof(contentDigest));
+    BOOL hasContentDigest = entry.contentFileName && SDImageCacheIndexDigestFromFileName(entry.contentFileName, contentDigest.digest);
+    if (hasContentDigest) {
+        contentDigest.header.type = SDImageCacheIndexExtensionContentDigest;
+        contentDigest.header.length = sizeof(contentDigest);
+        record.length += sizeof(contentDigest);
+    }
+
+    // Validators too long to journal are dropped, the entry is then downloaded again once stale
+    NSData *entityTag = [entry.entityTag dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *lastModified = [entry.lastModified dataUsingEncoding:NSUTF8StringEncoding];
+    if (entityTag.length > kMaxValidatorLength) entityTag = nil;
+    if (lastModified.length > kMaxValidatorLength) lastModified = nil;
+
+    SDImageCacheIndexValidatorsExtension validators;
+    BOOL hasValidators = entityTag.length || lastModified.length;
+    if (hasValidators) {
+        memset(&validators, 0, sizeof(validators));
+        validators.header.type = SDImageCacheIndexExtensionValidators;
+        validators.header.length = sizeof(validators) + entityTag.length + lastModified.length;
+        validators.entityTagLength = entityTag.length;
+        validators.lastModifiedLength = lastModified.length;
+        record.length += validators.header.length;
+    }
+
+    NSMutableData *recordData = [[NSMutableData alloc] initWithBytes:&record length:sizeof(record)];
+    if (entry.segment) {
+        [recordData appendBytes:&location length:sizeof(location)];
+    }
+    if (entry.accessCount) {
+        [recordData appendBytes:&accessCount length:sizeof(accessCount)];
+    }
+    if (hasContentDigest) {
+        [recordData appendBytes:&contentDigest length:sizeof(contentDigest)];
+    }
+    if (hasValidators) {
+        [recordData appendBytes:&validators length:sizeof(validators)];
+        if (entityTag) [recordData appendData:entityTag];
+        if (lastModified) [recordData appendData:lastModified];
+    }
+
+    return recordData;
+}
+
+- (void)_appendRecordForEntry:(SDImageCacheIndexEntry *)entry operation:(SDImageCacheIndexOperation)operation {
+    // Encoded now, while the entry can't change; records are full snapshots, so appending them behind a compaction that
+    // already saw a later state is harmless
+    NSData *record = [self _recordForEntry:entry operation:operation];
+    if (!record) {
+        return;
+    }
+
+    entry.journaledAccessTime = entry.lastAccessTime;
+
+    dispatch_async(self.journalQueue, ^{
+        [self _writeRecord:record];
+    });
+}
+
+#pragma mark Journal (on journalQueue)
+
+- (void)_writeRecord:(NSData *)record {
+    if (_journalFileDescriptor < 0) {
+        // The journal is opened by `load`; mutations recorded before that only live in memory until the next compaction
+        return;
+    }
+
+    if (write(_journalFileDescriptor, record.bytes, record.length) == (ssize_t)record.length) {
+        ++_journalRecordCount;
+
+        [self _compactIfNeeded];
+    }
+}
+
+- (void)_compactIfNeeded {
+    pthread_rwlock_rdlock(&_lock);
+    NSUInteger count = _count;
+    pthread_rwlock_unlock(&_lock);
+
+    if (_journalRecordCount > kCompactionMinimumRecords && _journalRecordCount > count * 2) {
+        [self _writeJournal];
+    }
+}
+
+- (void)_writeJournal {
+    if (_journalFileDescriptor >= 0) {
+        close(_journalFileDescriptor);
+        _journalFileDescriptor = -1;
+    }
+
+    [[NSFileManager new] createDirectoryAtPath:self.directory withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    NSString *temporaryPath = [self.journalPath stringByAppendingPathExtension:@"tmp"];
+
+    // Only the encoding happens under the lock, the write below doesn't hold up anyone
+    pthread_rwlock_rdlock(&_lock);
+    NSMutableData *journal = [[NSMutableData alloc] initWithCapacity:sizeof(SDImageCacheIndexJournalHeader) + _count * sizeof(SDImageCacheIndexRecord)];
+
+    SDImageCacheIndexJournalHeader header = { kJournalMagic, kJournalVersion };
+    [journal appendBytes:&header length:sizeof(header)];
+
+    NSUInteger recordCount = 0;
+    for (SDImageCacheIndexEntry *entry in [self.entries objectEnumerator]) {
+        NSData *record = [self _recordForEntry:entry operation:SDImageCacheIndexOperationSet];
+        if (record) {
+            [journal appendData:record];
+            ++recordCount;
+        }
+    }
+    pthread_rwlock_unlock(&_lock);
+
+    // Write aside and rename so a crash mid-compaction leaves the previous journal intact
+    if ([journal writeToFile:temporaryPath atomically:NO] && rename([temporaryPath fileSystemRepresentation], [self.journalPath fileSystemRepresentation]) == 0) {
+        _journalRecordCount = recordCount;
+        _journalFileDescriptor = open([self.journalPath fileSystemRepresentation], O_WRONLY | O_APPEND);
+    }
+}
+
+@end
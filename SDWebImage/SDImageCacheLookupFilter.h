@@ -0,0 +1,72 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A Bloom filter over the cache file names of one directory. A negative answer is definite, so a miss can be
+ * returned without probing the file system; a positive answer still has to be confirmed by reading the file.
+ *
+ * Names must be added before the filter is shared between threads; lookups and counters are thread safe.
+ */
+@interface SDImageCacheLookupFilter : NSObject
+
+/**
+ * Number of lookups answered.
+ */
+@property (assign, nonatomic, readonly) int64_t lookupCount;
+
+/**
+ * Number of lookups answered with a definite miss.
+ */
+@property (assign, nonatomic, readonly) int64_t negativeCount;
+
+/**
+ * Number of positive answers the caller reported as misses through `recordFalsePositive`.
+ */
+@property (assign, nonatomic, readonly) int64_t falsePositiveCount;
+
+/**
+ * Share of lookups for absent keys the filter answered positively, comparable to `expectedFalsePositiveRate`.
+ */
+@property (assign, nonatomic, readonly) double falsePositiveRate;
+
+/**
+ * The false positive rate the filter was sized for.
+ */
+@property (assign, nonatomic, readonly) double expectedFalsePositiveRate;
+
+/**
+ * Init a filter sized for the given number of names.
+ *
+ * @param capacity          The expected number of names
+ * @param falsePositiveRate The target false positive rate, e.g. 0.01
+ */
+- (id)initWithCapacity:(NSUInteger)capacity falsePositiveRate:(double)falsePositiveRate;
+
+/**
+ * Add a cache file name (32 hex characters) to the filter.
+ */
+- (void)addFileName:(NSString *)fileName;
+
+/**
+ * Returns NO if the file name was definitely never added.
+ */
+- (BOOL)mayContainFileName:(NSString *)fileName;
+
+/**
+ * Report that a positive answer turned out to be a miss.
+ */
+- (void)recordFalsePositive;
+
+/**
+ * The counters as a dictionary (lookups, negatives, falsePositives, falsePositiveRate, expectedFalsePositiveRate).
+ */
+- (NSDictionary *)statistics;
+
+@end
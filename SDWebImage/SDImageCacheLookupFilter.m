@@ -0,0 +1,114 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageCacheLookupFilter.h"
+#import "SDImageCacheIndex.h"
+#import <libkern/OSAtomic.h>
+
+static const NSUInteger kMinimumBitCount = 64;
+
+@implementation SDImageCacheLookupFilter {
+    uint8_t *_bits;
+    uint64_t _bitCount;
+    NSUInteger _hashCount;
+    volatile int64_t _lookupCount;
+    volatile int64_t _negativeCount;
+    volatile int64_t _falsePositiveCount;
+}
+
+- (id)initWithCapacity:(NSUInteger)capacity falsePositiveRate:(double)falsePositiveRate {
+    if ((self = [super init])) {
+        capacity = MAX(capacity, 1);
+        falsePositiveRate = MIN(MAX(falsePositiveRate, 0.0001), 0.5);
+
+        // Optimal Bloom filter sizing: m = -n ln p / (ln 2)^2 bits, k = m / n ln 2 hashes
+        _bitCount = MAX((uint64_t)ceil(-(double)capacity * log(falsePositiveRate) / (M_LN2 * M_LN2)), kMinimumBitCount);
+        _hashCount = MAX((NSUInteger)round((double)_bitCount / capacity * M_LN2), 1);
+        _bits = calloc((size_t)((_bitCount + 7) / 8), 1);
+        _expectedFalsePositiveRate = falsePositiveRate;
+
+        if (!_bits) return nil;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    free(_bits);
+}
+
+// The file name already is a uniformly distributed digest, so its two halves seed the double hashing directly
+static BOOL SDLookupFilterHashes(NSString *fileName, uint64_t *h1, uint64_t *h2) {
+    unsigned char digest[16];
+    if (!SDImageCacheIndexDigestFromFileName(fileName, digest)) return NO;
+
+    memcpy(h1, digest, sizeof(*h1));
+    memcpy(h2, digest + 8, sizeof(*h2));
+    *h2 |= 1; // Never step by zero
+
+    return YES;
+}
+
+- (void)addFileName:(NSString *)fileName {
+    uint64_t h1, h2;
+    if (!SDLookupFilterHashes(fileName, &h1, &h2)) return;
+
+    for (NSUInteger i = 0; i < _hashCount; ++i) {
+        uint64_t bit = (h1 + i * h2) % _bitCount;
+        _bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+}
+
+- (BOOL)mayContainFileName:(NSString *)fileName {
+    OSAtomicIncrement64(&_lookupCount);
+
+    uint64_t h1, h2;
+    if (!SDLookupFilterHashes(fileName, &h1, &h2)) return YES;
+
+    for (NSUInteger i = 0; i < _hashCount; ++i) {
+        uint64_t bit = (h1 + i * h2) % _bitCount;
+
+        if (!(_bits[bit / 8] & (1 << (bit % 8)))) {
+            OSAtomicIncrement64(&_negativeCount);
+            return NO;
+        }
+    }
+
+    return YES;
+}
+
+- (void)recordFalsePositive {
+    OSAtomicIncrement64(&_falsePositiveCount);
+}
+
+- (int64_t)lookupCount {
+    return _lookupCount;
+}
+
+- (int64_t)negativeCount {
+    return _negativeCount;
+}
+
+- (int64_t)falsePositiveCount {
+    return _falsePositiveCount;
+}
+
+- (double)falsePositiveRate {
+    // Out of the lookups for keys that aren't there: those the filter rejected plus those it let through
+    int64_t absentKeys = _negativeCount + _falsePositiveCount;
+    return absentKeys > 0 ? (double)_falsePositiveCount / absentKeys : 0;
+}
+
+- (NSDictionary *)statistics {
+    return @{@"lookups": @(self.lookupCount),
+             @"negatives": @(self.negativeCount),
+             @"falsePositives": @(self.falsePositiveCount),
+             @"falsePositiveRate": @(self.falsePositiveRate),
+             @"expectedFalsePositiveRate": @(self.expectedFalsePositiveRate)};
+}
+
+@end
@@ -0,0 +1,92 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * SDImageCacheSegmentStore packs small cache payloads into large append-only segment files instead of writing one
+ * file per key. Each payload is preceded by a small header (magic, length and file name digest) so segments can be
+ * re-scanned if the cache index is lost; the magic tells which disk layout the file name belongs to. The location of
+ * live payloads is kept in SDImageCacheIndex.
+ *
+ * Writes, releases and compaction must be serialized by the caller (SDImageCache does them on its ioQueue).
+ * Reads can be issued from any thread.
+ */
+@interface SDImageCacheSegmentStore : NSObject
+
+/**
+ * The directory holding the segment files.
+ */
+@property (strong, nonatomic, readonly) NSString *directory;
+
+/**
+ * A segment stops receiving payloads once it reaches this size, in bytes. Defaults to 4 MB.
+ */
+@property (assign, nonatomic) unsigned long long maxSegmentSize;
+
+/**
+ * Number of bytes written to disk for a payload of the given length (payload plus its header).
+ */
++ (unsigned long long)storedSizeForPayloadLength:(unsigned long long)length;
+
+/**
+ * Init a store in the given directory. The directory is created on first write.
+ */
+- (id)initWithDirectory:(NSString *)directory;
+
+/**
+ * Scan the existing segment files and account the given live payloads against them.
+ *
+ * @param liveBytesBySegment A dictionary mapping NSNumber segment identifiers to NSNumber live payload bytes
+ */
+- (void)loadWithLiveBytesBySegment:(NSDictionary *)liveBytesBySegment;
+
+/**
+ * Append a payload to the active segment.
+ *
+ * @param data     The payload
+ * @param fileName The cache file name the payload belongs to
+ * @param sharded  Whether the file name is one of the sharded layout
+ * @param segment  On success, the segment identifier the payload was written to
+ * @param offset   On success, the offset of the payload header inside that segment
+ *
+ * @return YES if the payload was written
+ */
+- (BOOL)appendData:(NSData *)data fileName:(NSString *)fileName sharded:(BOOL)sharded segment:(uint32_t *)segment offset:(uint64_t *)offset;
+
+/**
+ * Read a payload back. Returns nil if the segment or the payload header can't be read.
+ */
+- (NSData *)dataInSegment:(uint32_t)segment offset:(uint64_t)offset length:(unsigned long long)length;
+
+/**
+ * Mark a payload as dead. Its bytes are reclaimed when the segment is compacted.
+ */
+- (void)releaseSegment:(uint32_t)segment length:(unsigned long long)length;
+
+/**
+ * Identifiers (NSNumber) of the sealed segments whose live bytes dropped below half of their size.
+ */
+- (NSArray *)segmentsNeedingCompaction;
+
+/**
+ * Delete a segment file once all its live payloads were moved elsewhere.
+ */
+- (void)removeSegment:(uint32_t)segment;
+
+/**
+ * Delete every segment.
+ */
+- (void)removeAllSegments;
+
+/**
+ * Walk every payload header of every segment, oldest first. Used to rebuild a lost index.
+ */
+- (void)enumeratePayloadsUsingBlock:(void (^)(NSString *fileName, BOOL sharded, uint32_t segment, uint64_t offset, unsigned long long length))block;
+
+@end
@@ -0,0 +1,257 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageCacheSegmentStore.h"
+#import "SDImageCacheIndex.h"
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/uio.h>
+
+static NSString *const kSegmentPathExtension = @"segment";
+static const uint32_t kPayloadMagic = 0x4C424453; // "SDBL", a flat layout file name
+static const uint32_t kShardedPayloadMagic = 0x53424453; // "SDBS", a sharded layout file name
+static const unsigned long long kDefaultMaxSegmentSize = 4 * 1024 * 1024;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;
+    unsigned char digest[16];
+} SDImageCacheSegmentPayloadHeader;
+
+@interface SDImageCacheSegmentStore ()
+
+@property (strong, nonatomic, readwrite) NSString *directory;
+@property (strong, nonatomic) NSMutableDictionary *segmentSizes; // segment -> bytes written
+@property (strong, nonatomic) NSMutableDictionary *liveBytes;    // segment -> bytes still referenced
+
+@end
+
+@implementation SDImageCacheSegmentStore {
+    uint32_t _activeSegment;
+    int _activeFileDescriptor;
+    unsigned long long _activeSize;
+}
+
++ (unsigned long long)storedSizeForPayloadLength:(unsigned long long)length {
+    return sizeof(SDImageCacheSegmentPayloadHeader) + length;
+}
+
+- (id)initWithDirectory:(NSString *)directory {
+    if ((self = [super init])) {
+        _directory = [directory copy];
+        _maxSegmentSize = kDefaultMaxSegmentSize;
+        _segmentSizes = [NSMutableDictionary new];
+        _liveBytes = [NSMutableDictionary new];
+        _activeFileDescriptor = -1;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_activeFileDescriptor >= 0) {
+        close(_activeFileDescriptor);
+    }
+}
+
+- (NSString *)pathForSegment:(uint32_t)segment {
+    return [self.directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%08x.%@", segment, kSegmentPathExtension]];
+}
+
+- (NSArray *)existingSegments {
+    NSMutableArray *segments = [NSMutableArray new];
+
+    for (NSString *fileName in [[NSFileManager new] contentsOfDirectoryAtPath:self.directory error:NULL]) {
+        if (![[fileName pathExtension] isEqualToString:kSegmentPathExtension]) continue;
+
+        unsigned int segment = 0;
+        if ([[NSScanner scannerWithString:[fileName stringByDeletingPathExtension]] scanHexInt:&segment] && segment > 0) {
+            [segments addObject:@(segment)];
+        }
+    }
+
+    return [segments sortedArrayUsingSelector:@selector(compare:)];
+}
+
+#pragma mark Accounting
+
+- (void)loadWithLiveBytesBySegment:(NSDictionary *)liveBytesBySegment {
+    [self.segmentSizes removeAllObjects];
+    [self.liveBytes removeAllObjects];
+
+    for (NSNumber *segment in [self existingSegments]) {
+        NSDictionary *attributes = [[NSFileManager new] attributesOfItemAtPath:[self pathForSegment:segment.unsignedIntValue] error:NULL];
+        self.segmentSizes[segment] = @([attributes fileSize]);
+        self.liveBytes[segment] = liveBytesBySegment[segment] ?: @0;
+
+        _activeSegment = MAX(_activeSegment, segment.unsignedIntValue);
+    }
+
+    // Never append to a segment written by a previous session, its tail may be torn
+    _activeSize = self.maxSegmentSize;
+}
+
+- (void)releaseSegment:(uint32_t)segment length:(unsigned long long)length {
+    NSNumber *key = @(segment);
+    unsigned long long liveBytes = [self.liveBytes[key] unsignedLongLongValue];
+    unsigned long long storedSize = [[self class] storedSizeForPayloadLength:length];
+
+    self.liveBytes[key] = @(liveBytes > storedSize ? liveBytes - storedSize : 0);
+}
+
+- (NSArray *)segmentsNeedingCompaction {
+    NSMutableArray *segments = [NSMutableArray new];
+
+    for (NSNumber *segment in self.segmentSizes) {
+        if (segment.unsignedIntValue == _activeSegment && _activeSize < self.maxSegmentSize) continue;
+
+        if ([self.liveBytes[segment] unsignedLongLongValue] * 2 < [self.segmentSizes[segment] unsignedLongLongValue]) {
+            [segments addObject:segment];
+        }
+    }
+
+    return segments;
+}
+
+#pragma mark Reading & writing
+
+- (BOOL)appendData:(NSData *)data fileName:(NSString *)fileName sharded:(BOOL)sharded segment:(uint32_t *)segment offset:(uint64_t *)offset {
+    SDImageCacheSegmentPayloadHeader header;
+    header.magic = sharded ? kShardedPayloadMagic : kPayloadMagic;
+    header.length = (uint32_t)data.length;
+    if (!SDImageCacheIndexDigestFromFileName(fileName, header.digest)) {
+        return NO;
+    }
+
+    if (_activeFileDescriptor < 0 || _activeSize + sizeof(header) + data.length > self.maxSegmentSize) {
+        if (![self openNextSegment]) {
+            return NO;
+        }
+    }
+
+    struct iovec vectors[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)data.bytes, .iov_len = data.length },
+    };
+    ssize_t written = writev(_activeFileDescriptor, vectors, 2);
+
+    if (written != (ssize_t)(sizeof(header) + data.length)) {
+        // Don't leave a partial payload for the next append to land behind
+        if (written > 0) ftruncate(_activeFileDescriptor, _activeSize);
+        return NO;
+    }
+
+    *segment = _activeSegment;
+    *offset = _activeSize;
+
+    _activeSize += written;
+
+    NSNumber *key = @(_activeSegment);
+    self.segmentSizes[key] = @(_activeSize);
+    self.liveBytes[key] = @([self.liveBytes[key] unsignedLongLongValue] + written);
+
+    return YES;
+}
+
+- (BOOL)openNextSegment {
+    if (_activeFileDescriptor >= 0) {
+        close(_activeFileDescriptor);
+        _activeFileDescriptor = -1;
+    }
+
+    [[NSFileManager new] createDirectoryAtPath:self.directory withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    uint32_t segment = _activeSegment + 1;
+    int fileDescriptor = open([[self pathForSegment:segment] fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fileDescriptor < 0) {
+        return NO;
+    }
+
+    _activeSegment = segment;
+    _activeFileDescriptor = fileDescriptor;
+    _activeSize = 0;
+
+    self.segmentSizes[@(segment)] = @0;
+    self.liveBytes[@(segment)] = @0;
+
+    return YES;
+}
+
+- (NSData *)dataInSegment:(uint32_t)segment offset:(uint64_t)offset length:(unsigned long long)length {
+    int fileDescriptor = open([[self pathForSegment:segment] fileSystemRepresentation], O_RDONLY);
+    if (fileDescriptor < 0) {
+        return nil;
+    }
+
+    NSMutableData *data = nil;
+    SDImageCacheSegmentPayloadHeader header;
+
+    if (pread(fileDescriptor, &header, sizeof(header), (off_t)offset) == sizeof(header) && (header.magic == kPayloadMagic || header.magic == kShardedPayloadMagic) && header.length == length) {
+        data = [[NSMutableData alloc] initWithLength:(NSUInteger)length];
+
+        if (pread(fileDescriptor, data.mutableBytes, (size_t)length, (off_t)(offset + sizeof(header))) != (ssize_t)length) {
+            data = nil;
+        }
+    }
+
+    close(fileDescriptor);
+
+    return data;
+}
+
+#pragma mark Maintenance
+
+- (void)removeSegment:(uint32_t)segment {
+    NSNumber *key = @(segment);
+
+    if (segment == _activeSegment && _activeFileDescriptor >= 0) {
+        close(_activeFileDescriptor);
+        _activeFileDescriptor = -1;
+        _activeSize = self.maxSegmentSize;
+    }
+
+    [[NSFileManager new] removeItemAtPath:[self pathForSegment:segment] error:NULL];
+    [self.segmentSizes removeObjectForKey:key];
+    [self.liveBytes removeObjectForKey:key];
+}
+
+- (void)removeAllSegments {
+    if (_activeFileDescriptor >= 0) {
+        close(_activeFileDescriptor);
+        _activeFileDescriptor = -1;
+    }
+
+    [[NSFileManager new] removeItemAtPath:self.directory error:NULL];
+    [self.segmentSizes removeAllObjects];
+    [self.liveBytes removeAllObjects];
+    _activeSegment = 0;
+    _activeSize = 0;
+}
+
+- (void)enumeratePayloadsUsingBlock:(void (^)(NSString *fileName, BOOL sharded, uint32_t segment, uint64_t offset, unsigned long long length))block {
+    for (NSNumber *segment in [self existingSegments]) {
+        @autoreleasepool {
+            NSData *contents = [NSData dataWithContentsOfFile:[self pathForSegment:segment.unsignedIntValue] options:NSDataReadingMappedIfSafe error:NULL];
+            const unsigned char *bytes = contents.bytes;
+            uint64_t offset = 0;
+
+            while (offset + sizeof(SDImageCacheSegmentPayloadHeader) <= contents.length) {
+                SDImageCacheSegmentPayloadHeader header;
+                memcpy(&header, bytes + offset, sizeof(header));
+
+                if ((header.magic != kPayloadMagic && header.magic != kShardedPayloadMagic) || offset + sizeof(header) + header.length > contents.length) {
+                    break;
+                }
+
+                block(SDImageCacheIndexFileNameFromDigest(header.digest), header.magic == kShardedPayloadMagic, segment.unsignedIntValue, offset, header.length);
+                offset += sizeof(header) + header.length;
+            }
+        }
+    }
+}
+
+@end
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+@class SDImageMemoryCache;
+
+/**
+ * One memory limit shared by several memory caches, typically those of several SDImageCache namespaces.
+ *
+ * Each cache keeps enforcing its own `totalCostLimit` (0 lets the budget alone decide). On top of that, whenever an
+ * insertion takes the caches together past `totalCostLimit`, the budget evicts from the cache that uses the most
+ * relative to its weight, least valuable objects first, until the total is back under the limit. A cache may use more
+ * than its weighted share as long as the others leave room, and is never trimmed below its minimum cost.
+ *
+ * All methods are thread safe.
+ */
+@interface SDImageMemoryBudget : NSObject
+
+/**
+ * The maximum total cost of all the caches sharing the budget, in bytes. 0 means no limit, the default.
+ */
+@property (assign, nonatomic) NSUInteger totalCostLimit;
+
+/**
+ * Current total cost of all the caches sharing the budget.
+ */
+@property (assign, nonatomic, readonly) NSUInteger totalCost;
+
+/**
+ * Share the budget with a cache. A cache shares at most one budget; adding it again updates its settings.
+ *
+ * @param cache       The cache, held weakly
+ * @param name        The name the cache is reported under in `usage`
+ * @param weight      The relative share of the budget the cache is entitled to under pressure, e.g. 1
+ * @param minimumCost The cost, in bytes, the budget never trims the cache below to make room for others
+ */
+- (void)addCache:(SDImageMemoryCache *)cache name:(NSString *)name weight:(double)weight minimumCost:(NSUInteger)minimumCost;
+
+/**
+ * Stop sharing the budget with a cache.
+ */
+- (void)removeCache:(SDImageMemoryCache *)cache;
+
+/**
+ * Evicts across the caches until their total cost is back under `totalCostLimit`. Called after every insertion into
+ * one of the caches.
+ */
+- (void)enforceLimit;
+
+/**
+ * Usage per cache, keyed by name. Each value holds `cost`, `count`, `share` (the weighted share of `totalCostLimit`),
+ * `weight`, `minimumCost` and `evictedCost` (bytes the budget, rather than the cache's own limits, evicted from it).
+ */
+- (NSDictionary *)usage;
+
+@end
@@ -0,0 +1,193 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageMemoryBudget.h"
+#import "SDImageMemoryCache.h"
+#import <libkern/OSAtomic.h>
+
+static const double kMinimumWeight = 0.000001;
+
+@interface SDImageMemoryCache (SDImageMemoryBudget)
+- (void)setMemoryBudget:(SDImageMemoryBudget *)memoryBudget;
+@end
+
+// A cache sharing the budget, with its settings
+@interface SDImageMemoryBudgetMember : NSObject {
+@package
+    volatile int64_t _evictedCost;
+}
+@property (weak, nonatomic) SDImageMemoryCache *cache;
+@property (strong, nonatomic) NSString *name;
+@property (assign, nonatomic) double weight;
+@property (assign, nonatomic) NSUInteger minimumCost;
+@end
+@implementation SDImageMemoryBudgetMember
+@end
+
+@interface SDImageMemoryBudget ()
+
+@property (strong, atomic) NSArray *members; // Replaced, never mutated, so it can be enumerated from any thread
+
+@end
+
+@implementation SDImageMemoryBudget
+
+- (id)init {
+    if ((self = [super init])) {
+        _members = @[];
+    }
+    return self;
+}
+
+- (void)setTotalCostLimit:(NSUInteger)totalCostLimit {
+    _totalCostLimit = totalCostLimit;
+    [self enforceLimit];
+}
+
+- (NSUInteger)totalCost {
+    NSUInteger totalCost = 0;
+
+    for (SDImageMemoryBudgetMember *member in self.members) {
+        totalCost += member.cache.totalCost;
+    }
+
+    return totalCost;
+}
+
+- (void)addCache:(SDImageMemoryCache *)cache name:(NSString *)name weight:(double)weight minimumCost:(NSUInteger)minimumCost {
+    if (!cache) return;
+
+    SDImageMemoryBudgetMember *member = [SDImageMemoryBudgetMember new];
+    member.cache = cache;
+    member.name = name ?: cache.name;
+    member.weight = MAX(weight, kMinimumWeight);
+    member.minimumCost = minimumCost;
+
+    [cache.memoryBudget removeCache:cache];
+
+    @synchronized (self) {
+        NSMutableArray *members = [NSMutableArray new];
+
+        // Drop the previous settings of the cache, and members whose cache is gone
+        for (SDImageMemoryBudgetMember *existingMember in self.members) {
+            SDImageMemoryCache *existingCache = existingMember.cache;
+            if (existingCache && existingCache != cache) {
+                [members addObject:existingMember];
+            }
+        }
+
+        [members addObject:member];
+        self.members = members;
+        cache.memoryBudget = self;
+    }
+
+    [self enforceLimit];
+}
+
+- (void)removeCache:(SDImageMemoryCache *)cache {
+    @synchronized (self) {
+        NSMutableArray *members = [NSMutableArray new];
+
+        for (SDImageMemoryBudgetMember *member in self.members) {
+            SDImageMemoryCache *memberCache = member.cache;
+            if (memberCache && memberCache != cache) {
+                [members addObject:member];
+            }
+        }
+
+        self.members = members;
+
+        if (cache.memoryBudget == self) {
+            cache.memoryBudget = nil;
+        }
+    }
+}
+
+- (void)enforceLimit {
+    NSUInteger totalCostLimit = self.totalCostLimit;
+    if (totalCostLimit == 0) return;
+
+    NSArray *members = self.members;
+    NSUInteger memberCount = members.count;
+    if (memberCount == 0) return;
+
+    // No lock held while evicting: the caches take their own, and their delegates may call back into us
+    NSUInteger costs[memberCount];
+
+    while (YES) {
+        NSUInteger totalCost = 0;
+
+        for (NSUInteger i = 0; i < memberCount; ++i) {
+            costs[i] = [members[i] cache].totalCost;
+            totalCost += costs[i];
+        }
+
+        if (totalCost <= totalCostLimit) return;
+
+        // The cache furthest above its weighted share gives first, then the runner-up, so the weights are honored
+        NSInteger victim = -1;
+        double victimLoad = 0, runnerUpLoad = 0;
+
+        for (NSUInteger i = 0; i < memberCount; ++i) {
+            SDImageMemoryBudgetMember *member = members[i];
+            if (costs[i] <= member.minimumCost) continue;
+
+            double load = costs[i] / member.weight;
+            if (victim < 0 || load > victimLoad) {
+                runnerUpLoad = victim < 0 ? 0 : victimLoad;
+                victimLoad = load;
+                victim = i;
+            } else if (load > runnerUpLoad) {
+                runnerUpLoad = load;
+            }
+        }
+
+        if (victim < 0) return;
+
+        SDImageMemoryBudgetMember *member = members[victim];
+        NSUInteger cost = costs[victim];
+        NSUInteger excess = totalCost - totalCostLimit;
+
+        // Trim down to the runner-up's load, or by the whole excess if that's less; on a tie, by the whole excess
+        NSUInteger floorCost = MAX(member.minimumCost, (NSUInteger)(runnerUpLoad * member.weight));
+        NSUInteger targetCost = floorCost < cost ? cost - MIN(excess, cost - floorCost) : cost - MIN(excess, cost - member.minimumCost);
+
+        NSUInteger evictedCost = [member.cache trimToCost:targetCost];
+        if (evictedCost == 0) return;
+
+        OSAtomicAdd64((int64_t)evictedCost, &member->_evictedCost);
+    }
+}
+
+- (NSDictionary *)usage {
+    NSArray *members = self.members;
+    NSUInteger totalCostLimit = self.totalCostLimit;
+    double totalWeight = 0;
+
+    for (SDImageMemoryBudgetMember *member in members) {
+        totalWeight += member.weight;
+    }
+
+    NSMutableDictionary *usage = [NSMutableDictionary new];
+
+    for (SDImageMemoryBudgetMember *member in members) {
+        SDImageMemoryCache *cache = member.cache;
+        if (!cache || !member.name) continue;
+
+        usage[member.name] = @{@"cost": @(cache.totalCost),
+                               @"count": @(cache.count),
+                               @"share": @(totalCostLimit > 0 ? (NSUInteger)(totalCostLimit * member.weight / totalWeight) : 0),
+                               @"weight": @(member.weight),
+                               @"minimumCost": @(member.minimumCost),
+                               @"evictedCost": @(OSAtomicAdd64(0, &member->_evictedCost))};
+    }
+
+    return usage;
+}
+
+@end
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SDWebImageCompat.h"
+
+@class SDImageMemoryBudget;
+
+/**
+ * Returns the number of bytes the decoded bitmap of the given image occupies (bytes per row times height, summed over
+ * every frame of an animated image). This is the cost SDImageCache charges against `maxMemoryCost`.
+ */
+extern NSUInteger SDImageMemoryCostForImage(UIImage *image);
+
+typedef NS_OPTIONS(NSUInteger, SDImageMemoryCacheObjectOptions) {
+    /**
+     * The object can be recreated without any I/O, e.g. a frame of an animated image.
+     */
+    SDImageMemoryCacheObjectRegenerable = 1 << 0,
+    /**
+     * The object was cached ahead of use, e.g. prefetched. Cleared by the first lookup that finds it.
+     */
+    SDImageMemoryCacheObjectSpeculative = 1 << 1,
+};
+
+/**
+ * The memory cache used by SDImageCache.
+ *
+ * Unlike NSCache, whose eviction order is undocumented, SDImageMemoryCache evicts with a segmented LRU policy:
+ *
+ * - New objects enter the probationary segment.
+ * - An object hit while on probation is promoted to the protected segment, which may hold at most
+ *   `protectedCostRatio` of `totalCostLimit`. Objects pushed out of the protected segment go back on probation.
+ * - When a limit is exceeded, the least recently used probationary object is evicted first, then the least recently
+ *   used protected one.
+ *
+ * One-off images (e.g. scrolled past once) therefore never displace the images that are actually reused.
+ *
+ * It is an NSCache subclass so it can keep standing in for one, but it neither uses NSCache's storage nor discards
+ * objects on its own; limits are enforced synchronously on every insertion. Like NSCache's, `totalCostLimit` and
+ * `countLimit` default to 0, which means no limit. All methods are thread safe.
+ */
+@interface SDImageMemoryCache : NSCache
+
+/**
+ * The budget this cache shares with others, if any; see `-[SDImageMemoryBudget addCache:name:weight:minimumCost:]`.
+ */
+@property (weak, nonatomic, readonly) SDImageMemoryBudget *memoryBudget;
+
+/**
+ * Share of `totalCostLimit` the protected segment may hold, between 0 and 1. Defaults to 0.8.
+ */
+@property (assign, nonatomic) double protectedCostRatio;
+
+/**
+ * Number of objects currently in the cache.
+ */
+@property (assign, nonatomic, readonly) NSUInteger count;
+
+/**
+ * Sum of the costs of the objects currently in the cache.
+ */
+@property (assign, nonatomic, readonly) NSUInteger totalCost;
+
+/**
+ * Number of lookups that found an object.
+ */
+@property (assign, nonatomic, readonly) int64_t hitCount;
+
+/**
+ * Number of lookups that found nothing.
+ */
+@property (assign, nonatomic, readonly) int64_t missCount;
+
+/**
+ * Number of objects discarded to honor `totalCostLimit` or `countLimit`.
+ */
+@property (assign, nonatomic, readonly) int64_t evictionCount;
+
+/**
+ * Returns every object currently in the cache.
+ */
+- (NSArray *)allObjects;
+
+/**
+ * Whether an object is cached for the key. Unlike `objectForKey:`, neither counts as a lookup nor affects eviction order.
+ */
+- (BOOL)containsObjectForKey:(id)key;
+
+/**
+ * Same as `setObject:forKey:cost:`, tagging the object for `removeObjectsPassingTest:`.
+ */
+- (void)setObject:(id)object forKey:(id)key cost:(NSUInteger)cost options:(SDImageMemoryCacheObjectOptions)options;
+
+/**
+ * Removes every object the predicate returns YES for. The predicate is called with the cache locked and must not use
+ * the cache.
+ *
+ * @param predicate Called with each key and object, its options, and the time since it was last looked up or stored
+ *
+ * @return The cost removed
+ */
+- (NSUInteger)removeObjectsPassingTest:(BOOL (^)(id key, id object, SDImageMemoryCacheObjectOptions options, NSTimeInterval idleTime))predicate;
+
+/**
+ * Evicts objects, least valuable first, until the total cost is no more than the given cost. Evicted objects are
+ * reported to the delegate and counted in `evictionCount`.
+ *
+ * @return The cost evicted
+ */
+- (NSUInteger)trimToCost:(NSUInteger)cost;
+
+/**
+ * Enumerates the cached objects from the most to the least worth keeping: the protected segment, then the
+ * probationary one, each from the most recently used end. Neither affects eviction order. The block is called outside
+ * the cache's lock on a copy of its contents, with the options each object was stored with.
+ */
+- (void)enumerateKeysAndObjectsInRetentionOrderUsingBlock:(void (^)(id key, id object, NSUInteger cost, SDImageMemoryCacheObjectOptions options, BOOL *stop))block;
+
+/**
+ * The counters as a dictionary (count, totalCost, hits, misses, evictions).
+ */
+- (NSDictionary *)statistics;
+
+@end
@@ -0,0 +1,469 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDImageMemoryCache.h"
+#import "SDImageMemoryBudget.h"
+#import <pthread.h>
+
+static const double kDefaultProtectedCostRatio = 0.8;
+
+static NSUInteger SDImageMemoryCostForCGImage(CGImageRef imageRef) {
+    return imageRef ? CGImageGetBytesPerRow(imageRef) * CGImageGetHeight(imageRef) : 0;
+}
+
+NSUInteger SDImageMemoryCostForImage(UIImage *image) {
+    if (!image) return 0;
+
+#if TARGET_OS_IPHONE
+    if (image.images.count > 0) {
+        NSUInteger cost = 0;
+        for (UIImage *frame in image.images) {
+            cost += SDImageMemoryCostForCGImage(frame.CGImage);
+        }
+        return cost;
+    }
+
+    NSUInteger cost = SDImageMemoryCostForCGImage(image.CGImage);
+    if (cost > 0) return cost;
+
+    // No backing bitmap (yet), assume 32 bits per pixel
+    return (NSUInteger)(image.size.width * image.scale * image.size.height * image.scale * 4);
+#else
+    return (NSUInteger)(image.size.width * image.size.height * 4);
+#endif
+}
+
+typedef NS_ENUM(NSInteger, SDImageMemoryCacheSegment) {
+    SDImageMemoryCacheSegmentProbation,
+    SDImageMemoryCacheSegmentProtected,
+};
+
+@interface SDImageMemoryCacheNode : NSObject {
+@package
+    id _key;
+    id _object;
+    NSUInteger _cost;
+    SDImageMemoryCacheObjectOptions _options;
+    CFAbsoluteTime _lastAccessTime;
+    SDImageMemoryCacheSegment _segment;
+    __unsafe_unretained SDImageMemoryCacheNode *_previous; // Towards the most recently used end
+    __unsafe_unretained SDImageMemoryCacheNode *_next;     // Towards the least recently used end
+}
+@end
+
+@implementation SDImageMemoryCacheNode
+@end
+
+// A doubly linked list in recency order; the nodes are owned by the cache's dictionary
+typedef struct {
+    __unsafe_unretained SDImageMemoryCacheNode *head; // Most recently used
+    __unsafe_unretained SDImageMemoryCacheNode *tail; // Least recently used
+    NSUInteger cost;
+} SDImageMemoryCacheList;
+
+static void SDImageMemoryCacheListInsertAtHead(SDImageMemoryCacheList *list, SDImageMemoryCacheNode *node) {
+    node->_previous = nil;
+    node->_next = list->head;
+    if (list->head) list->head->_previous = node;
+    list->head = node;
+    if (!list->tail) list->tail = node;
+    list->cost += node->_cost;
+}
+
+static void SDImageMemoryCacheListRemove(SDImageMemoryCacheList *list, SDImageMemoryCacheNode *node) {
+    if (node->_previous) node->_previous->_next = node->_next;
+    else list->head = node->_next;
+    if (node->_next) node->_next->_previous = node->_previous;
+    else list->tail = node->_previous;
+    node->_previous = node->_next = nil;
+    list->cost -= node->_cost;
+}
+
+@interface SDImageMemoryCache ()
+
+@property (weak, nonatomic, readwrite) SDImageMemoryBudget *memoryBudget;
+
+@end
+
+@implementation SDImageMemoryCache {
+    pthread_mutex_t _lock;
+    NSMutableDictionary *_nodes;
+    SDImageMemoryCacheList _probation;
+    SDImageMemoryCacheList _protected;
+    int64_t _hitCount;
+    int64_t _missCount;
+    int64_t _evictionCount;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        pthread_mutex_init(&_lock, NULL);
+        _nodes = [NSMutableDictionary new];
+        _protectedCostRatio = kDefaultProtectedCostRatio;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark NSCache
+
+- (id)objectForKey:(id)key {
+    if (!key) return nil;
+
+    pthread_mutex_lock(&_lock);
+
+    SDImageMemoryCacheNode *node = _nodes[key];
+    id object = nil;
+
+    if (node) {
+        object = node->_object;
+        node->_options &= ~SDImageMemoryCacheObjectSpeculative;
+        node->_lastAccessTime = CFAbsoluteTimeGetCurrent();
+        _hitCount++;
+
+        if (node->_segment == SDImageMemoryCacheSegmentProbation) {
+            SDImageMemoryCacheListRemove(&_probation, node);
+            node->_segment = SDImageMemoryCacheSegmentProtected;
+        } else {
+            SDImageMemoryCacheListRemove(&_protected, node);
+        }
+        SDImageMemoryCacheListInsertAtHead(&_protected, node);
+
+        [self _balanceSegments];
+    } else {
+        _missCount++;
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    return object;
+}
+
+- (void)setObject:(id)object forKey:(id)key {
+    [self setObject:object forKey:key cost:0];
+}
+
+- (void)setObject:(id)object forKey:(id)key cost:(NSUInteger)cost {
+    [self setObject:object forKey:key cost:cost options:0];
+}
+
+- (void)setObject:(id)object forKey:(id)key cost:(NSUInteger)cost options:(SDImageMemoryCacheObjectOptions)options {
+    if (!key) return;
+    if (!object) {
+        [self removeObjectForKey:key];
+        return;
+    }
+
+    id previousObject = nil;
+
+    pthread_mutex_lock(&_lock);
+
+    SDImageMemoryCacheNode *node = _nodes[key];
+
+    if (node) {
+        previousObject = node->_object; // Released outside the lock, not reported as an eviction
+        [self _unlinkNode:node];
+    } else {
+        node = [SDImageMemoryCacheNode new];
+        node->_key = [key conformsToProtocol:@protocol(NSCopying)] ? [key copy] : key;
+        _nodes[node->_key] = node;
+    }
+
+    node->_object = object;
+    node->_cost = cost;
+    node->_options = options;
+    node->_lastAccessTime = CFAbsoluteTimeGetCurrent();
+
+    // A replaced object keeps its segment, a new one starts on probation
+    if (node->_segment == SDImageMemoryCacheSegmentProtected) {
+        SDImageMemoryCacheListInsertAtHead(&_protected, node);
+        [self _balanceSegments];
+    } else {
+        SDImageMemoryCacheListInsertAtHead(&_probation, node);
+    }
+
+    NSArray *evictedNodes = [self _evictToLimits];
+
+    pthread_mutex_unlock(&_lock);
+
+    [self _notifyEvictionOfNodes:evictedNodes];
+    previousObject = nil;
+
+    // Outside the lock, the budget takes the locks of every cache it shares
+    [self.memoryBudget enforceLimit];
+}
+
+- (void)removeObjectForKey:(id)key {
+    if (!key) return;
+
+    pthread_mutex_lock(&_lock);
+
+    SDImageMemoryCacheNode *node = _nodes[key];
+    if (node) {
+        [self _unlinkNode:node];
+        [_nodes removeObjectForKey:key];
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    node = nil; // Let the image go outside the lock
+}
+
+- (void)removeAllObjects {
+    pthread_mutex_lock(&_lock);
+
+    NSMutableDictionary *nodes = _nodes;
+    _nodes = [NSMutableDictionary new];
+    _probation = (SDImageMemoryCacheList){ nil, nil, 0 };
+    _protected = (SDImageMemoryCacheList){ nil, nil, 0 };
+
+    pthread_mutex_unlock(&_lock);
+
+    // Let the images go outside the lock
+    [nodes removeAllObjects];
+}
+
+- (void)setTotalCostLimit:(NSUInteger)totalCostLimit {
+    [super setTotalCostLimit:totalCostLimit];
+    [self _trim];
+}
+
+- (void)setCountLimit:(NSUInteger)countLimit {
+    [super setCountLimit:countLimit];
+    [self _trim];
+}
+
+- (void)setProtectedCostRatio:(double)protectedCostRatio {
+    pthread_mutex_lock(&_lock);
+    _protectedCostRatio = MIN(MAX(protectedCostRatio, 0), 1);
+    [self _balanceSegments];
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark Cache pairs
+
+- (id)objectForCachePairKey:(id)key {
+    return [self objectForKey:key];
+}
+
+- (void)setObject:(id)object forCachePairKey:(id)key cost:(NSUInteger)cost {
+    [self setObject:object forKey:key cost:cost];
+}
+
+- (void)removeObjectForCachePairKey:(id)key {
+    [self removeObjectForKey:key];
+}
+
+- (NSArray *)allObjects {
+    NSMutableArray *objects = [NSMutableArray new];
+
+    pthread_mutex_lock(&_lock);
+    for (SDImageMemoryCacheNode *node in [_nodes objectEnumerator]) {
+        [objects addObject:node->_object];
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return objects;
+}
+
+- (BOOL)containsObjectForKey:(id)key {
+    if (!key) return NO;
+
+    pthread_mutex_lock(&_lock);
+    BOOL contains = _nodes[key] != nil;
+    pthread_mutex_unlock(&_lock);
+
+    return contains;
+}
+
+- (NSUInteger)removeObjectsPassingTest:(BOOL (^)(id key, id object, SDImageMemoryCacheObjectOptions options, NSTimeInterval idleTime))predicate {
+    if (!predicate) return 0;
+
+    NSMutableArray *removedNodes = [NSMutableArray new];
+    NSUInteger removedCost = 0;
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+    pthread_mutex_lock(&_lock);
+    for (SDImageMemoryCacheNode *node in [_nodes allValues]) {
+        if (predicate(node->_key, node->_object, node->_options, now - node->_lastAccessTime)) {
+            [self _unlinkNode:node];
+            [_nodes removeObjectForKey:node->_key];
+            [removedNodes addObject:node];
+            removedCost += node->_cost;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    // Let the objects go outside the lock
+    [removedNodes removeAllObjects];
+
+    return removedCost;
+}
+
+- (NSUInteger)trimToCost:(NSUInteger)cost {
+    pthread_mutex_lock(&_lock);
+    NSUInteger previousCost = _probation.cost + _protected.cost;
+    NSArray *evictedNodes = [self _evictToCost:cost count:NSUIntegerMax];
+    NSUInteger evictedCost = previousCost - (_probation.cost + _protected.cost);
+    pthread_mutex_unlock(&_lock);
+
+    [self _notifyEvictionOfNodes:evictedNodes];
+
+    return evictedCost;
+}
+
+- (void)enumerateKeysAndObjectsInRetentionOrderUsingBlock:(void (^)(id key, id object, NSUInteger cost, SDImageMemoryCacheObjectOptions options, BOOL *stop))block {
+    if (!block) return;
+
+    NSMutableArray *keys = [NSMutableArray new];
+    NSMutableArray *objects = [NSMutableArray new];
+    NSMutableArray *costs = [NSMutableArray new];
+    NSMutableArray *options = [NSMutableArray new];
+
+    pthread_mutex_lock(&_lock);
+    SDImageMemoryCacheList *lists[] = {&_protected, &_probation};
+    for (NSUInteger i = 0; i < 2; ++i) {
+        for (SDImageMemoryCacheNode *node = lists[i]->head; node; node = node->_next) {
+            [keys addObject:node->_key];
+            [objects addObject:node->_object];
+            [costs addObject:@(node->_cost)];
+            [options addObject:@(node->_options)];
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    BOOL stop = NO;
+    for (NSUInteger i = 0; i < keys.count && !stop; ++i) {
+        block(keys[i], objects[i], [costs[i] unsignedIntegerValue], [options[i] unsignedIntegerValue], &stop);
+    }
+}
+
+#pragma mark Statistics
+
+- (NSUInteger)count {
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = _nodes.count;
+    pthread_mutex_unlock(&_lock);
+
+    return count;
+}
+
+- (NSUInteger)totalCost {
+    pthread_mutex_lock(&_lock);
+    NSUInteger totalCost = _probation.cost + _protected.cost;
+    pthread_mutex_unlock(&_lock);
+
+    return totalCost;
+}
+
+- (int64_t)hitCount {
+    pthread_mutex_lock(&_lock);
+    int64_t hitCount = _hitCount;
+    pthread_mutex_unlock(&_lock);
+
+    return hitCount;
+}
+
+- (int64_t)missCount {
+    pthread_mutex_lock(&_lock);
+    int64_t missCount = _missCount;
+    pthread_mutex_unlock(&_lock);
+
+    return missCount;
+}
+
+- (int64_t)evictionCount {
+    pthread_mutex_lock(&_lock);
+    int64_t evictionCount = _evictionCount;
+    pthread_mutex_unlock(&_lock);
+
+    return evictionCount;
+}
+
+- (NSDictionary *)statistics {
+    pthread_mutex_lock(&_lock);
+    NSDictionary *statistics = @{@"count": @(_nodes.count),
+                                 @"totalCost": @(_probation.cost + _protected.cost),
+                                 @"hits": @(_hitCount),
+                                 @"misses": @(_missCount),
+                                 @"evictions": @(_evictionCount)};
+    pthread_mutex_unlock(&_lock);
+
+    return statistics;
+}
+
+#pragma mark Private (called with the lock held)
+
+- (void)_unlinkNode:(SDImageMemoryCacheNode *)node {
+    SDImageMemoryCacheListRemove(node->_segment == SDImageMemoryCacheSegmentProtected ? &_protected : &_probation, node);
+}
+
+- (void)_balanceSegments {
+    NSUInteger totalCostLimit = self.totalCostLimit;
+    if (totalCostLimit == 0) return;
+
+    NSUInteger protectedCostLimit = (NSUInteger)(totalCostLimit * _protectedCostRatio);
+
+    // Demote the coldest protected objects, keeping at least the one just promoted
+    while (_protected.cost > protectedCostLimit && _protected.tail != _protected.head) {
+        SDImageMemoryCacheNode *node = _protected.tail;
+        SDImageMemoryCacheListRemove(&_protected, node);
+        node->_segment = SDImageMemoryCacheSegmentProbation;
+        SDImageMemoryCacheListInsertAtHead(&_probation, node);
+    }
+}
+
+- (NSArray *)_evictToLimits {
+    NSUInteger totalCostLimit = self.totalCostLimit;
+    NSUInteger countLimit = self.countLimit;
+
+    return [self _evictToCost:(totalCostLimit > 0 ? totalCostLimit : NSUIntegerMax) count:(countLimit > 0 ? countLimit : NSUIntegerMax)];
+}
+
+- (NSArray *)_evictToCost:(NSUInteger)cost count:(NSUInteger)count {
+    NSMutableArray *evictedNodes = nil;
+
+    while (_probation.cost + _protected.cost > cost || _nodes.count > count) {
+        SDImageMemoryCacheNode *node = _probation.tail ?: _protected.tail;
+        if (!node) break;
+
+        [self _unlinkNode:node];
+        [_nodes removeObjectForKey:node->_key];
+        _evictionCount++;
+
+        if (!evictedNodes) evictedNodes = [NSMutableArray new];
+        [evictedNodes addObject:node];
+    }
+
+    return evictedNodes;
+}
+
+#pragma mark Private
+
+- (void)_trim {
+    pthread_mutex_lock(&_lock);
+    [self _balanceSegments];
+    NSArray *evictedNodes = [self _evictToLimits];
+    pthread_mutex_unlock(&_lock);
+
+    [self _notifyEvictionOfNodes:evictedNodes];
+}
+
+- (void)_notifyEvictionOfNodes:(NSArray *)nodes {
+    id<NSCacheDelegate> delegate = self.delegate;
+    if (![delegate respondsToSelector:@selector(cache:willEvictObject:)]) return;
+
+    for (SDImageMemoryCacheNode *node in nodes) {
+        [delegate cache:self willEvictObject:node->_object];
+    }
+}
+
+@end
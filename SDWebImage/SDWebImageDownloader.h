@@ -9,6 +9,7 @@
 #import <Foundation/Foundation.h>
 #import "SDWebImageCompat.h"
 #import "SDWebImageOperation.h"
+#import "SDWebImageDownloaderConcurrencyController.h"
 
 typedef NS_OPTIONS(NSUInteger, SDWebImageDownloaderOptions) {
     SDWebImageDownloaderProgressiveDownload = 1 << 1,
@@ -96,13 +97,28 @@ typedef void(^SDWebImageDownloaderCompletedBlock)(UIImage *image, NSData *data,
  */
 @interface SDWebImageDownloader : NSObject
 
+/**
+ * The maximum number of concurrent downloads, unless `adaptiveConcurrency` is on. Defaults to 2.
+ */
 @property (assign, nonatomic) NSInteger maxConcurrentDownloads;
 
+/**
+ * Lets `concurrencyController` pick the number of concurrent downloads from the time to first byte, throughput and
+ * failures of completed transfers, instead of `maxConcurrentDownloads`. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL adaptiveConcurrency;
+
+/**
+ * Picks the number of concurrent downloads in adaptive mode. Its `minimumLimit` and `maximumLimit` bound it,
+ * `currentLimit` and `changes` tell what it decided and why.
+ */
+@property (strong, nonatomic, readonly) SDWebImageDownloaderConcurrencyController *concurrencyController;
+
 /**
  * Shows the current amount of downloads that still need to be downloaded
  */
 
-@property (readonly, nonatomic) NSUInteger currentDownloadCount;
+@property (readonly, atomic) NSUInteger currentDownloadCount;
 
 
 /**
@@ -177,6 +193,20 @@ typedef void(^SDWebImageDownloaderCompletedBlock)(UIImage *image, NSData *data,
                                                progress:(SDWebImageDownloaderProgressBlock)progressBlock
                                               completed:(SDWebImageDownloaderCompletedBlock)completedBlock;
 
+/**
+ * Same as `downloadImageWithURL:options:progress:completed:`, with headers for this request only, set over
+ * `HTTPHeaders` (e.g. the conditional headers revalidating a cached image).
+ *
+ * When a conditional request is answered with 304 Not Modified, the completed block is called with no image, data
+ * or error; `response` of the returned operation holds the answer. The call only joins a running download of the URL
+ * started with the same headers, so a 304 never reaches a caller that didn't ask for it.
+ */
+- (SDWebImageDownloaderOperation *)downloadImageWithURL:(NSURL *)url
+                                                options:(SDWebImageDownloaderOptions)options
+                                            HTTPHeaders:(NSDictionary *)headers
+                                               progress:(SDWebImageDownloaderProgressBlock)progressBlock
+                                              completed:(SDWebImageDownloaderCompletedBlock)completedBlock;
+
 - (SDWebImageDownloaderOperation *)downloaderOperationForURL:(NSURL *)url;
 
 /**
@@ -192,9 +222,26 @@ typedef void(^SDWebImageDownloaderCompletedBlock)(UIImage *image, NSData *data,
 @property (assign, nonatomic) NSUInteger maxPrefetchedImageDownloadSize; // bytes
 @property (assign, nonatomic) NSUInteger maxPrefetchedGifImageDownloadSize; // bytes
 
-@property (assign, nonatomic) NSUInteger highPriorityOperations;
-@property (assign, nonatomic) NSUInteger medPriorityOperations;
+/**
+ * Pending and running operations of high and medium priority
+ */
+@property (readonly, atomic) NSUInteger highPriorityOperations;
+@property (readonly, atomic) NSUInteger medPriorityOperations;
 
-- (void)recalculateReadyStatuses;
+/**
+ * Reschedules an operation after its priority options changed
+ */
+- (void)operationPriorityDidChange:(SDWebImageDownloaderOperation *)operation;
+
+/**
+ * Feeds a finished transfer to `concurrencyController` in adaptive mode. `error` is nil on success
+ */
+- (void)operationDidFinishTransfer:(SDWebImageDownloaderOperation *)operation error:(NSError *)error;
+
+/**
+ * Frees the operation's download slot once it finished or was cancelled, so the next one starts without waiting for the
+ * completion blocks on the main queue
+ */
+- (void)operationDidFinish:(SDWebImageDownloaderOperation *)operation;
 
 @end
@@ -8,19 +8,21 @@
 
 #import "SDWebImageDownloader.h"
 #import "SDWebImageDownloaderOperation.h"
+#import "SDWebImageDownloaderScheduler.h"
 #import <ImageIO/ImageIO.h>
 
 NSString *const SDWebImageDownloadStartNotification = @"SDWebImageDownloadStartNotification";
 NSString *const SDWebImageDownloadStopNotification = @"SDWebImageDownloadStopNotification";
 
-static NSString *const kProgressCallbackKey = @"progress";
-static NSString *const kCompletedCallbackKey = @"completed";
-
 @interface SDWebImageDownloader ()
 
 @property (strong, nonatomic) NSOperationQueue *downloadQueue;
-@property (weak, nonatomic) NSOperation *lastAddedOperation;
-@property (strong, nonatomic) NSMutableDictionary *URLCallbacks;
+// Holds the operations until they may start, only used on the barrierQueue
+@property (strong, nonatomic) SDWebImageDownloaderScheduler *scheduler;
+// Copied from the scheduler whenever it changes, so they can be read from any thread without a barrierQueue round trip
+@property (assign, atomic, readwrite) NSUInteger currentDownloadCount;
+@property (assign, atomic, readwrite) NSUInteger highPriorityOperations;
+@property (assign, atomic, readwrite) NSUInteger medPriorityOperations;
 @property (strong, nonatomic) NSMutableDictionary *downloadOperations;
 @property (strong, nonatomic) NSMutableDictionary *HTTPHeaders;
 // This queue is used to serialize the handling of the network responses of all the download operation in a single queue
@@ -28,6 +30,24 @@ static NSString *const kCompletedCallbackKey = @"completed";
 
 @end
 
+static inline SDWebImageDownloaderPriorityClass SDWebImageDownloaderPriorityClassForOptions(SDWebImageDownloaderOptions options) {
+    if (options & SDWebImageDownloaderHighPriority) return SDWebImageDownloaderPriorityClassHigh;
+    if (options & SDWebImageDownloaderLowPriority) return SDWebImageDownloaderPriorityClassLow;
+    return SDWebImageDownloaderPriorityClassMedium;
+}
+
+// Requests with headers of their own, like revalidations carrying validators, only share an operation with requests
+// sending the very same headers
+static id SDWebImageDownloaderOperationKey(NSURL *url, NSDictionary *headers) {
+    if (!headers.count) return url;
+    
+    NSMutableString *key = [url.absoluteString mutableCopy];
+    for (NSString *field in [headers.allKeys sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)]) {
+        [key appendFormat:@"\n%@: %@", field, headers[field]];
+    }
+    return key;
+}
+
 @implementation SDWebImageDownloader
 
 + (void)initialize {
@@ -65,12 +85,14 @@ static NSString *const kCompletedCallbackKey = @"completed";
 - (id)init {
     if ((self = [super init])) {
         _executionOrder = SDWebImageDownloaderFIFOExecutionOrder;
+        // No limit on the queue itself, the scheduler only hands it as many operations as may run
         _downloadQueue = [NSOperationQueue new];
-        _downloadQueue.maxConcurrentOperationCount = 2;
         if ([_downloadQueue respondsToSelector:@selector(setQualityOfService:)])
             _downloadQueue.qualityOfService = NSQualityOfServiceUtility;
+        _maxConcurrentDownloads = 2;
+        _concurrencyController = [SDWebImageDownloaderConcurrencyController new];
+        _scheduler = [SDWebImageDownloaderScheduler new];
         _downloadOperations = [NSMutableDictionary new];
-        _URLCallbacks = [NSMutableDictionary new];
         _HTTPHeaders = [NSMutableDictionary dictionaryWithObject:@"image/webp,image/*;q=0.8" forKey:@"Accept"];
         _barrierQueue = dispatch_queue_create("com.hackemist.SDWebImageDownloaderBarrierQueue", DISPATCH_QUEUE_CONCURRENT);
         _downloadTimeout = 30.0;
@@ -98,22 +120,39 @@ static NSString *const kCompletedCallbackKey = @"completed";
 }
 
 - (void)setMaxConcurrentDownloads:(NSInteger)maxConcurrentDownloads {
-    _downloadQueue.maxConcurrentOperationCount = maxConcurrentDownloads;
+    _maxConcurrentDownloads = maxConcurrentDownloads;
+    
+    dispatch_barrier_async(self.barrierQueue, ^{
+        [self _dispatchOperations];
+    });
 }
 
-- (NSUInteger)currentDownloadCount {
-    return _downloadQueue.operationCount;
+- (void)setAdaptiveConcurrency:(BOOL)adaptiveConcurrency {
+    _adaptiveConcurrency = adaptiveConcurrency;
+    
+    dispatch_barrier_async(self.barrierQueue, ^{
+        [self _dispatchOperations];
+    });
 }
 
-- (NSInteger)maxConcurrentDownloads {
-    return _downloadQueue.maxConcurrentOperationCount;
+- (void)setExecutionOrder:(SDWebImageDownloaderExecutionOrder)executionOrder {
+    _executionOrder = executionOrder;
+    
+    dispatch_barrier_async(self.barrierQueue, ^{
+        self.scheduler.lastInFirstOut = (executionOrder == SDWebImageDownloaderLIFOExecutionOrder);
+    });
 }
 
 - (SDWebImageDownloaderOperation *)downloadImageWithURL:(NSURL *)url options:(SDWebImageDownloaderOptions)options progress:(void (^)(NSInteger, NSInteger))progressBlock completed:(void (^)(UIImage *, NSData *, NSError *, BOOL))completedBlock {
+    return [self downloadImageWithURL:url options:options HTTPHeaders:nil progress:progressBlock completed:completedBlock];
+}
+
+- (SDWebImageDownloaderOperation *)downloadImageWithURL:(NSURL *)url options:(SDWebImageDownloaderOptions)options HTTPHeaders:(NSDictionary *)headers progress:(void (^)(NSInteger, NSInteger))progressBlock completed:(void (^)(UIImage *, NSData *, NSError *, BOOL))completedBlock {
     __block SDWebImageDownloaderOperation *operation = nil;
     __weak SDWebImageDownloader *wself = self;
+    id operationKey = SDWebImageDownloaderOperationKey(url, headers);
     
-    [self addProgressCallback:progressBlock andCompletedBlock:completedBlock forURL:url createCallback:^{
+    [self addProgressCallback:progressBlock andCompletedBlock:completedBlock forKey:operationKey createCallback:^{
         NSTimeInterval timeoutInterval = wself.downloadTimeout;
         if (timeoutInterval <= FLT_EPSILON)
             timeoutInterval = 30.0;
@@ -128,37 +167,40 @@ static NSString *const kCompletedCallbackKey = @"completed";
         else
             request.allHTTPHeaderFields = wself.HTTPHeaders;
         
+        for (NSString *field in headers) {
+            [request setValue:headers[field] forHTTPHeaderField:field];
+        }
+        
+        // The fan-out reads the operation's current callbacks snapshot, no barrierQueue round trip and no copy
+        __block __weak SDWebImageDownloaderOperation *woperation = nil;
+        
         operation = [[SDWebImageDownloaderOperation alloc] initWithRequest:request options:options progress:^(NSInteger receivedSize, NSInteger expectedSize) {
-            __strong SDWebImageDownloader *sself = wself;
-            if (!sself) return;
-            
-            NSArray *callbacksForURL = [sself callbacksForURL:url];
-            
-            for (NSDictionary *callbacks in callbacksForURL) {
-                SDWebImageDownloaderProgressBlock callback = callbacks[kProgressCallbackKey];
-                if (callback) callback(receivedSize, expectedSize);
+            for (SDWebImageDownloaderCallbacks *callbacks in woperation.callbacks) {
+                if (callbacks.progressBlock) callbacks.progressBlock(receivedSize, expectedSize);
             }
         } completed:^(UIImage *image, NSData *data, NSError *error, BOOL finished) {
-            __strong SDWebImageDownloader *sself = wself;
-            if (!sself) return;
+            __strong SDWebImageDownloaderOperation *soperation = woperation;
             
-            NSArray *callbacksForURL = [sself callbacksForURL:url];
+            // Once finished, requests for the URL that come later get an operation of their own
+            NSArray *callbacksForURL = finished ? [soperation closeCallbacks] : soperation.callbacks;
             
             if (finished)
-                [sself removeOperationAndCallbacksForURL:url];
+                [wself removeOperation:soperation forKey:operationKey];
             
-            for (NSDictionary *callbacks in callbacksForURL) {
-                SDWebImageDownloaderCompletedBlock callback = callbacks[kCompletedCallbackKey];
-                if (callback) callback(image, data, error, finished);
+            for (SDWebImageDownloaderCallbacks *callbacks in callbacksForURL) {
+                if (callbacks.completedBlock) callbacks.completedBlock(image, data, error, finished);
             }
         } cancelled:^{
-            __strong SDWebImageDownloader *sself = wself;
-            if (!sself) return;
+            __strong SDWebImageDownloaderOperation *soperation = woperation;
             
-            [sself removeOperationAndCallbacksForURL:url];
+            [soperation closeCallbacks];
+            [wself removeOperation:soperation forKey:operationKey];
         }];
         
-        wself.downloadOperations[url] = operation;
+        woperation = operation;
+        [operation addCallbacksWithProgress:progressBlock completed:completedBlock];
+        
+        wself.downloadOperations[operationKey] = operation;
         operation.parentImageDownloader = wself;
         
         operation.maxImageDownloadSize = wself.maxImageDownloadSize;
@@ -170,30 +212,23 @@ static NSString *const kCompletedCallbackKey = @"completed";
             operation.credential = [NSURLCredential credentialWithUser:wself.username password:wself.password persistence:NSURLCredentialPersistenceForSession];
         }
         
-        if (wself.executionOrder == SDWebImageDownloaderLIFOExecutionOrder) {
-            // Emulate LIFO execution order by systematically adding new operations as last operation's dependency
-            [wself.lastAddedOperation addDependency:operation];
-            wself.lastAddedOperation = operation;
-        }
-        
-        [wself _recalculateReadyStatuses];
-        
-        // NOTE: The queue priority here is meaningless. The actual item ordering performed depends upon the dynamically set isReady flag, which depends on what items are in the system and what their priority setting is. --Johanna
-        operation.queuePriority = NSOperationQueuePriorityNormal;
-        [wself.downloadQueue addOperation:operation];
+        // The operation only reaches the download queue once the scheduler lets it start, in priority and execution order
+        [wself.scheduler addOperation:operation priorityClass:SDWebImageDownloaderPriorityClassForOptions(options)];
+        [wself _dispatchOperations];
     } didNotCreateCallback:^{
-        operation = [wself.downloadOperations objectForKey:url];
+        operation = [wself.downloadOperations objectForKey:operationKey];
         
         [operation _changeDownloaderPriorityAndSizeLimitOptions:options];
-        [wself _recalculateReadyStatuses];
+        [wself.scheduler setPriorityClass:SDWebImageDownloaderPriorityClassForOptions(operation.options) forOperation:operation];
+        [wself _dispatchOperations];
     }];
     
     return operation;
 }
 
-- (void)addProgressCallback:(void (^)(NSInteger, NSInteger))progressBlock andCompletedBlock:(void (^)(UIImage *, NSData *data, NSError *, BOOL))completedBlock forURL:(NSURL *)url createCallback:(void (^)())createCallback didNotCreateCallback:(void (^)())didNotCreateCallback {
-    // The URL will be used as the key to the callbacks dictionary so it cannot be nil. If it is nil immediately call the completed block with no image or data.
-    if (url == nil) {
+- (void)addProgressCallback:(void (^)(NSInteger, NSInteger))progressBlock andCompletedBlock:(void (^)(UIImage *, NSData *data, NSError *, BOOL))completedBlock forKey:(id)key createCallback:(void (^)())createCallback didNotCreateCallback:(void (^)())didNotCreateCallback {
+    // The key, derived from the URL, is the key to the operations dictionary so it cannot be nil. If it is nil immediately call the completed block with no image or data.
+    if (key == nil) {
         if (completedBlock != nil) {
             completedBlock(nil, nil, nil, NO);
         }
@@ -201,26 +236,16 @@ static NSString *const kCompletedCallbackKey = @"completed";
     }
     
     dispatch_barrier_sync(self.barrierQueue, ^{
-        BOOL first = NO;
-        if (!self.URLCallbacks[url]) {
-            self.URLCallbacks[url] = [NSMutableArray new];
-            first = YES;
-        }
-        
-        // Handle single download of simultaneous download request for the same URL
-        NSMutableDictionary *callbacks = [NSMutableDictionary new];
-        if (progressBlock) callbacks[kProgressCallbackKey] = [progressBlock copy];
-        if (completedBlock) callbacks[kCompletedCallbackKey] = [completedBlock copy];
-        
-        NSMutableArray *callbacksForURL = self.URLCallbacks[url];
-        [callbacksForURL addObject:callbacks];
+        SDWebImageDownloaderOperation *operation = self.downloadOperations[key];
         
-        if (first) {
-            if (createCallback)
-                createCallback();
-        } else {
+        // Handle single download of simultaneous download request for the same URL and headers, unless that download already
+        // handed out its result
+        if ([operation addCallbacksWithProgress:progressBlock completed:completedBlock]) {
             if (didNotCreateCallback)
                 didNotCreateCallback();
+        } else {
+            if (createCallback)
+                createCallback();
         }
     });
 }
@@ -235,34 +260,23 @@ static NSString *const kCompletedCallbackKey = @"completed";
     return operation;
 }
 
-- (NSArray *)callbacksForURL:(NSURL *)url {
-    __block NSArray *callbacksForURL;
+- (void)removeOperation:(SDWebImageDownloaderOperation *)operation forKey:(id)key {
+    if (!operation) return;
     
-    dispatch_sync(self.barrierQueue, ^{
-        callbacksForURL = self.URLCallbacks[url];
-    });
-    
-    return [callbacksForURL copy];
-}
-
-- (void)removeOperationAndCallbacksForURL:(NSURL *)url {
-    __block NSArray *callbacksForURL = nil;
-    __block SDWebImageDownloaderOperation *operation = nil;
+    __block SDWebImageDownloaderOperation *removedOperation = operation;
     
     dispatch_barrier_async(self.barrierQueue, ^{
-        callbacksForURL = self.URLCallbacks[url];
-        operation = self.downloadOperations[url];
+        // A newer operation may already serve the key
+        if (self.downloadOperations[key] == removedOperation)
+            [self.downloadOperations removeObjectForKey:key];
         
-        [self.URLCallbacks removeObjectForKey:url];
-        [self.downloadOperations removeObjectForKey:url];
+        [self.scheduler removeOperation:removedOperation];
+        [self _dispatchOperations];
         
         // NOTE: Removing these objects on main thread prevents this barrierQueue from having issues with deallocs that need to dispatch sync onto main thread, which can cause deadlock situations. --Johanna
         dispatch_async_main_queue(^{
-            callbacksForURL = nil;
-            operation = nil;
+            removedOperation = nil;
         });
-        
-        [self _recalculateReadyStatuses];
     });
 }
 
@@ -270,30 +284,58 @@ static NSString *const kCompletedCallbackKey = @"completed";
     [self.downloadQueue setSuspended:suspended];
 }
 
-- (void)recalculateReadyStatuses {
+- (void)operationPriorityDidChange:(SDWebImageDownloaderOperation *)operation {
     dispatch_barrier_async(self.barrierQueue, ^{
-        [self _recalculateReadyStatuses];
+        // Does nothing for an operation that already finished and left the scheduler
+        [self.scheduler setPriorityClass:SDWebImageDownloaderPriorityClassForOptions(operation.options) forOperation:operation];
+        [self _dispatchOperations];
     });
 }
 
-- (void)_recalculateReadyStatuses {
-    NSArray *downloadOperations = self.downloadOperations.allValues;
+- (void)operationDidFinishTransfer:(SDWebImageDownloaderOperation *)operation error:(NSError *)error {
+    if (!self.adaptiveConcurrency) return;
     
-    _highPriorityOperations = _medPriorityOperations = 0;
+    // Other errors, like a bad URL or a refused certificate, say nothing about the network's capacity
+    BOOL failed = [error.domain isEqualToString:NSURLErrorDomain] && (error.code == NSURLErrorTimedOut || error.code == NSURLErrorNetworkConnectionLost);
+    if (error && !failed) return;
     
-    for (SDWebImageDownloaderOperation *operation in downloadOperations) {
-        if (!operation.isFinished && !operation.isCancelled) {
-            SDWebImageDownloaderOptions options = operation.options;
-            
-            if (options & SDWebImageDownloaderHighPriority)
-                ++_highPriorityOperations;
-            else if (!(options & SDWebImageDownloaderLowPriority))
-                ++_medPriorityOperations;
-        }
+    if ([self.concurrencyController recordTransferOfSize:operation.receivedSize duration:operation.transferDuration timeToFirstByte:operation.timeToFirstByte failed:failed]) {
+        dispatch_barrier_async(self.barrierQueue, ^{
+            [self _dispatchOperations];
+        });
+    }
+}
+
+- (void)operationDidFinish:(SDWebImageDownloaderOperation *)operation {
+    __block SDWebImageDownloaderOperation *finishedOperation = operation;
+    
+    dispatch_barrier_async(self.barrierQueue, ^{
+        // removeOperation:forKey: still drops it from downloadOperations once its callbacks were called
+        [self.scheduler removeOperation:finishedOperation];
+        [self _dispatchOperations];
+        
+        // Released on the main thread, like in removeOperation:forKey:
+        dispatch_async_main_queue(^{
+            finishedOperation = nil;
+        });
+    });
+}
+
+// Already on barrierQueue
+- (void)_dispatchOperations {
+    NSInteger maxConcurrentDownloads = self.adaptiveConcurrency ? (NSInteger)self.concurrencyController.currentLimit : self.maxConcurrentDownloads;
+    
+    while (maxConcurrentDownloads < 0 || self.scheduler.runningCount < (NSUInteger)maxConcurrentDownloads) {
+        NSOperation *operation = [self.scheduler nextOperation];
+        if (!operation) break;
+        
+        [self.downloadQueue addOperation:operation];
     }
     
-    for (SDWebImageDownloaderOperation *operation in downloadOperations)
-        [operation recalculateReadyStatus];
+    // Every change to the scheduler ends here
+    self.currentDownloadCount = self.scheduler.pendingCount + self.scheduler.runningCount;
+    self.highPriorityOperations = [self.scheduler activeCountForPriorityClass:SDWebImageDownloaderPriorityClassHigh];
+    self.medPriorityOperations = [self.scheduler activeCountForPriorityClass:SDWebImageDownloaderPriorityClassMedium];
 }
 
 @end
@@ -0,0 +1,58 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Collects the body of a download.
+ *
+ * When the response announces its length, the bytes go straight into one block of that size. Otherwise they go into
+ * fixed-size chunks taken from a pool shared by all downloads, so a response of unknown length never reallocates and
+ * copies a growing block, and finished downloads hand their chunks to the next ones. The chunks are only copied into
+ * contiguous memory once, when `data` or `finishedData` asks for it.
+ *
+ * Not thread safe, an operation only uses its buffer from its connection callbacks.
+ */
+@interface SDWebImageDownloaderBuffer : NSObject
+
+/**
+ * @param expectedLength The length announced by the response, 0 if unknown
+ */
+- (id)initWithExpectedLength:(NSUInteger)expectedLength;
+
+/**
+ * Bytes received so far.
+ */
+@property (assign, nonatomic, readonly) NSUInteger length;
+
+- (void)appendData:(NSData *)data;
+
+/**
+ * The first bytes received, up to one chunk, without copying. Only valid until the next append, meant for sniffing
+ * the content type.
+ */
+- (NSData *)headData;
+
+/**
+ * All bytes received so far, contiguous. The first call copies the chunks into one block and further appends grow
+ * that block, so progressive decoders that need the whole data on every append pay for a single copy.
+ */
+- (NSData *)data;
+
+/**
+ * All bytes received, as one block of exactly that size. Returns the chunks to the pool, the buffer is empty afterwards.
+ */
+- (NSData *)finishedData;
+
+/**
+ * Counters of the shared chunk pool: `chunkSize`, `allocatedChunks` (chunks ever allocated), `reusedChunks` (chunks
+ * taken from the pool instead), `pooledChunks` and `peakChunksInUse`.
+ */
++ (NSDictionary *)poolStatistics;
+
+@end
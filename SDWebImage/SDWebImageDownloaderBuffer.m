@@ -0,0 +1,212 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDownloaderBuffer.h"
+#import "SDWebImageCompat.h"
+
+#define SDWebImageDownloaderMaxPooledChunks 32 // 2 MB pooled at most
+
+static const NSUInteger kChunkSize = 64 * 1024;
+
+// Chunks of kChunkSize bytes, kept across downloads and dropped on memory warnings
+@interface SDWebImageDownloaderChunkPool : NSObject {
+@package
+    void *_chunks[SDWebImageDownloaderMaxPooledChunks];
+    NSUInteger _chunkCount;
+    NSUInteger _chunksInUse;
+    NSUInteger _peakChunksInUse;
+    NSUInteger _allocatedChunks;
+    NSUInteger _reusedChunks;
+}
+@end
+
+@implementation SDWebImageDownloaderChunkPool
+
++ (SDWebImageDownloaderChunkPool *)sharedPool {
+    static dispatch_once_t once;
+    static id instance;
+    dispatch_once(&once, ^{
+        instance = [self new];
+    });
+    return instance;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(drain)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [self drain];
+}
+
+- (void *)takeChunk {
+    void *chunk = NULL;
+
+    @synchronized (self) {
+        if (_chunkCount) {
+            chunk = _chunks[--_chunkCount];
+            ++_reusedChunks;
+        } else {
+            ++_allocatedChunks;
+        }
+
+        _peakChunksInUse = MAX(_peakChunksInUse, ++_chunksInUse);
+    }
+
+    return chunk ?: malloc(kChunkSize);
+}
+
+- (void)returnChunks:(void **)chunks count:(NSUInteger)count {
+    @synchronized (self) {
+        _chunksInUse -= MIN(count, _chunksInUse);
+
+        while (count && _chunkCount < SDWebImageDownloaderMaxPooledChunks) {
+            _chunks[_chunkCount++] = chunks[--count];
+        }
+    }
+
+    while (count) {
+        free(chunks[--count]);
+    }
+}
+
+- (void)drain {
+    @synchronized (self) {
+        while (_chunkCount) {
+            free(_chunks[--_chunkCount]);
+        }
+    }
+}
+
+@end
+
+@implementation SDWebImageDownloaderBuffer {
+    // Chunked until the bytes are needed contiguous or the length is known up front
+    void **_chunks;
+    NSUInteger _chunkCount;
+    NSUInteger _chunkCapacity;
+    NSMutableData *_contiguousData;
+}
+
+- (id)init {
+    return [self initWithExpectedLength:0];
+}
+
+- (id)initWithExpectedLength:(NSUInteger)expectedLength {
+    if ((self = [super init])) {
+        if (expectedLength) {
+            _contiguousData = [[NSMutableData alloc] initWithCapacity:expectedLength];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self _returnChunks];
+}
+
+- (void)appendData:(NSData *)data {
+    if (_contiguousData) {
+        [_contiguousData appendData:data];
+        _length = _contiguousData.length;
+        return;
+    }
+
+    const uint8_t *bytes = data.bytes;
+    NSUInteger remaining = data.length;
+
+    while (remaining) {
+        NSUInteger offset = _length % kChunkSize;
+
+        if (!offset) {
+            if (_chunkCount == _chunkCapacity) {
+                _chunkCapacity = MAX(_chunkCapacity * 2, 8);
+                _chunks = realloc(_chunks, _chunkCapacity * sizeof(void *));
+            }
+            _chunks[_chunkCount++] = [[SDWebImageDownloaderChunkPool sharedPool] takeChunk];
+        }
+
+        NSUInteger count = MIN(remaining, kChunkSize - offset);
+        memcpy((uint8_t *)_chunks[_chunkCount - 1] + offset, bytes, count);
+
+        bytes += count;
+        remaining -= count;
+        _length += count;
+    }
+}
+
+- (NSData *)headData {
+    if (_contiguousData) return _contiguousData;
+    if (!_chunkCount) return [NSData data];
+
+    return [NSData dataWithBytesNoCopy:_chunks[0] length:MIN(_length, kChunkSize) freeWhenDone:NO];
+}
+
+- (NSData *)data {
+    if (!_contiguousData) {
+        _contiguousData = [[NSMutableData alloc] initWithLength:_length];
+        [self _copyChunksTo:_contiguousData.mutableBytes];
+        [self _returnChunks];
+    }
+
+    return _contiguousData;
+}
+
+- (NSData *)finishedData {
+    NSData *finishedData = _contiguousData;
+
+    if (!finishedData) {
+        void *bytes = malloc(MAX(_length, 1));
+        [self _copyChunksTo:bytes];
+        finishedData = [NSData dataWithBytesNoCopy:bytes length:_length freeWhenDone:YES];
+    }
+
+    [self _returnChunks];
+    _contiguousData = nil;
+    _length = 0;
+
+    return finishedData;
+}
+
+- (void)_copyChunksTo:(uint8_t *)bytes {
+    for (NSUInteger i = 0; i < _chunkCount; ++i) {
+        NSUInteger count = MIN(_length - i * kChunkSize, kChunkSize);
+        memcpy(bytes + i * kChunkSize, _chunks[i], count);
+    }
+}
+
+- (void)_returnChunks {
+    if (_chunkCount) {
+        [[SDWebImageDownloaderChunkPool sharedPool] returnChunks:_chunks count:_chunkCount];
+    }
+
+    free(_chunks);
+    _chunks = NULL;
+    _chunkCount = _chunkCapacity = 0;
+}
+
++ (NSDictionary *)poolStatistics {
+    SDWebImageDownloaderChunkPool *pool = [SDWebImageDownloaderChunkPool sharedPool];
+
+    @synchronized (pool) {
+        return @{@"chunkSize": @(kChunkSize),
+                 @"allocatedChunks": @(pool->_allocatedChunks),
+                 @"reusedChunks": @(pool->_reusedChunks),
+                 @"pooledChunks": @(pool->_chunkCount),
+                 @"peakChunksInUse": @(pool->_peakChunksInUse)};
+    }
+}
+
+@end
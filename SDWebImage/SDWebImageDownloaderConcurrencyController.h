@@ -0,0 +1,57 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Adjusts a download concurrency limit to the network, additive increase / multiplicative decrease.
+ *
+ * Completed transfers are looked at in rounds of `currentLimit` transfers. After a round without trouble the limit
+ * grows by one. It shrinks by half when transfers of the round timed out or lost their connection, and by a quarter
+ * when the round's time to first byte rose well above the best one seen (requests queue up somewhere), or when right
+ * after an increase its aggregate throughput fell clearly below the previous round's (transfers fight over the link).
+ * The limit stays within [`minimumLimit`, `maximumLimit`].
+ *
+ * All methods are thread safe.
+ */
+@interface SDWebImageDownloaderConcurrencyController : NSObject
+
+/**
+ * The lowest limit the controller goes down to. Defaults to 2.
+ */
+@property (assign, nonatomic) NSUInteger minimumLimit;
+
+/**
+ * The highest limit the controller goes up to. Defaults to 8.
+ */
+@property (assign, nonatomic) NSUInteger maximumLimit;
+
+/**
+ * The current limit, starts at `minimumLimit`.
+ */
+@property (assign, nonatomic, readonly) NSUInteger currentLimit;
+
+/**
+ * The last 32 changes of `currentLimit`, oldest first. Each holds `date`, `fromLimit`, `toLimit` and `reason`, a short
+ * human readable explanation with the measurements behind it.
+ */
+@property (strong, nonatomic, readonly) NSArray *changes;
+
+/**
+ * Account for a completed transfer.
+ *
+ * @param size            Bytes received
+ * @param duration        Time from starting the request to the last byte, in seconds
+ * @param timeToFirstByte Time from starting the request to the response, in seconds
+ * @param failed          Whether the transfer timed out or lost its connection
+ *
+ * @return Whether `currentLimit` changed
+ */
+- (BOOL)recordTransferOfSize:(long long)size duration:(NSTimeInterval)duration timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed;
+
+@end
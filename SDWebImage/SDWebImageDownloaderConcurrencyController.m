@@ -0,0 +1,159 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDownloaderConcurrencyController.h"
+
+static const NSUInteger kDefaultMinimumLimit = 2;
+static const NSUInteger kDefaultMaximumLimit = 8;
+static const NSUInteger kMaxChangeCount = 32;
+static const double kFailureDecrease = 0.5;
+static const double kCongestionDecrease = 0.75;
+static const double kLatencyInflation = 2; // Round time to first byte over the baseline that counts as queueing
+static const NSTimeInterval kMinLatencyInflation = 0.05; // Ignores inflation of tiny times to first byte
+static const double kThroughputDrop = 0.75; // Round throughput under the previous one that counts as contention
+static const double kBaselineRise = 0.1; // How fast the baseline follows times to first byte above it
+
+@implementation SDWebImageDownloaderConcurrencyController {
+    NSMutableArray *_changes;
+
+    // The round being measured
+    NSUInteger _roundTransfers;
+    NSUInteger _roundFailures;
+    long long _roundSize;
+    CFAbsoluteTime _roundStartTime;
+    NSTimeInterval _roundTimeToFirstByte;
+
+    double _lastThroughput; // Bytes per second of the previous round, 0 until measured
+    NSTimeInterval _baselineTimeToFirstByte; // 0 until measured
+    BOOL _increasedLastRound;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _minimumLimit = kDefaultMinimumLimit;
+        _maximumLimit = kDefaultMaximumLimit;
+        _currentLimit = kDefaultMinimumLimit;
+        _changes = [NSMutableArray new];
+    }
+    return self;
+}
+
+- (void)setMinimumLimit:(NSUInteger)minimumLimit {
+    @synchronized (self) {
+        _minimumLimit = MAX(minimumLimit, 1);
+        _maximumLimit = MAX(_maximumLimit, _minimumLimit);
+        [self _changeLimit:_currentLimit reason:@"Limits changed"];
+    }
+}
+
+- (void)setMaximumLimit:(NSUInteger)maximumLimit {
+    @synchronized (self) {
+        _maximumLimit = MAX(maximumLimit, 1);
+        _minimumLimit = MIN(_minimumLimit, _maximumLimit);
+        [self _changeLimit:_currentLimit reason:@"Limits changed"];
+    }
+}
+
+- (NSUInteger)currentLimit {
+    @synchronized (self) {
+        return _currentLimit;
+    }
+}
+
+- (NSArray *)changes {
+    @synchronized (self) {
+        return [_changes copy];
+    }
+}
+
+- (BOOL)recordTransferOfSize:(long long)size duration:(NSTimeInterval)duration timeToFirstByte:(NSTimeInterval)timeToFirstByte failed:(BOOL)failed {
+    @synchronized (self) {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        CFAbsoluteTime startTime = now - MAX(duration, 0);
+
+        if (!_roundTransfers || startTime < _roundStartTime) {
+            _roundStartTime = startTime;
+        }
+
+        ++_roundTransfers;
+        if (failed) {
+            ++_roundFailures;
+        } else {
+            _roundSize += MAX(size, 0);
+            _roundTimeToFirstByte += MAX(timeToFirstByte, 0);
+        }
+
+        if (_roundTransfers < _currentLimit) return NO;
+
+        return [self _finishRoundAt:now];
+    }
+}
+
+- (BOOL)_finishRoundAt:(CFAbsoluteTime)now {
+    NSUInteger succeeded = _roundTransfers - _roundFailures;
+    NSTimeInterval timeToFirstByte = succeeded ? _roundTimeToFirstByte / succeeded : 0;
+    NSTimeInterval roundDuration = now - _roundStartTime;
+    double throughput = roundDuration > 0 ? _roundSize / roundDuration : 0;
+
+    NSUInteger limit = _currentLimit;
+    NSString *reason = nil;
+
+    if (_roundFailures) {
+        limit = (NSUInteger)(limit * kFailureDecrease);
+        reason = [NSString stringWithFormat:@"%lu of %lu transfers timed out or lost their connection", (unsigned long)_roundFailures, (unsigned long)_roundTransfers];
+    }
+    else if (_baselineTimeToFirstByte > 0 && timeToFirstByte > _baselineTimeToFirstByte * kLatencyInflation && timeToFirstByte - _baselineTimeToFirstByte > kMinLatencyInflation) {
+        limit = (NSUInteger)(limit * kCongestionDecrease);
+        reason = [NSString stringWithFormat:@"Time to first byte rose to %.0f ms from a baseline of %.0f ms", timeToFirstByte * 1000, _baselineTimeToFirstByte * 1000];
+    }
+    else if (_increasedLastRound && _lastThroughput > 0 && throughput < _lastThroughput * kThroughputDrop) {
+        limit = (NSUInteger)(limit * kCongestionDecrease);
+        reason = [NSString stringWithFormat:@"Throughput fell to %.0f KB/s from %.0f KB/s after an increase", throughput / 1024, _lastThroughput / 1024];
+    }
+    else {
+        limit += 1;
+        reason = [NSString stringWithFormat:@"Round went fine at %.0f KB/s, %.0f ms to first byte", throughput / 1024, timeToFirstByte * 1000];
+    }
+
+    // The baseline drops to the best time seen right away and only slowly follows worse ones
+    if (succeeded) {
+        if (_baselineTimeToFirstByte <= 0 || timeToFirstByte < _baselineTimeToFirstByte) {
+            _baselineTimeToFirstByte = timeToFirstByte;
+        } else {
+            _baselineTimeToFirstByte += (timeToFirstByte - _baselineTimeToFirstByte) * kBaselineRise;
+        }
+    }
+
+    _lastThroughput = throughput;
+    _roundTransfers = _roundFailures = 0;
+    _roundSize = 0;
+    _roundTimeToFirstByte = 0;
+
+    NSUInteger previousLimit = _currentLimit;
+    [self _changeLimit:limit reason:reason];
+    _increasedLastRound = _currentLimit > previousLimit;
+
+    return _currentLimit != previousLimit;
+}
+
+- (void)_changeLimit:(NSUInteger)limit reason:(NSString *)reason {
+    limit = MIN(MAX(limit, _minimumLimit), _maximumLimit);
+    if (limit == _currentLimit) return;
+
+    [_changes addObject:@{@"date": [NSDate date],
+                          @"fromLimit": @(_currentLimit),
+                          @"toLimit": @(limit),
+                          @"reason": reason}];
+    if (_changes.count > kMaxChangeCount) {
+        [_changes removeObjectAtIndex:0];
+    }
+
+    _currentLimit = limit;
+}
+
+@end
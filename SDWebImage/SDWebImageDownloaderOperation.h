@@ -10,6 +10,16 @@
 #import "SDWebImageDownloader.h"
 #import "SDWebImageOperation.h"
 
+/**
+ * The callbacks of one request served by a download operation.
+ */
+@interface SDWebImageDownloaderCallbacks : NSObject
+
+@property (copy, nonatomic, readonly) SDWebImageDownloaderProgressBlock progressBlock;
+@property (copy, nonatomic, readonly) SDWebImageDownloaderCompletedBlock completedBlock;
+
+@end
+
 @interface SDWebImageDownloaderOperation : NSOperation <SDWebImageOperation>
 
 /**
@@ -31,6 +41,26 @@
  */
 @property (nonatomic, strong) NSURLCredential *credential;
 
+/**
+ * The response of the server, once received.
+ */
+@property (strong, atomic, readonly) NSURLResponse *response;
+
+/**
+ * Time from starting the connection to receiving the response, in seconds.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval timeToFirstByte;
+
+/**
+ * Time from starting the connection to its end, in seconds.
+ */
+@property (assign, nonatomic, readonly) NSTimeInterval transferDuration;
+
+/**
+ * Bytes of the response body received so far.
+ */
+@property (assign, nonatomic, readonly) long long receivedSize;
+
 /**
  * The SDWebImageDownloaderOptions for the receiver.
  */
@@ -66,12 +96,27 @@
 @property (assign, nonatomic) NSUInteger maxPrefetchedImageDownloadSize; // bytes
 @property (assign, nonatomic) NSUInteger maxPrefetchedGifImageDownloadSize; // bytes
 
+/**
+ * The callbacks of every request the operation serves, in the order they were added, as `SDWebImageDownloaderCallbacks`.
+ * The array is replaced, never mutated, so it can be enumerated from any thread.
+ */
+@property (strong, atomic, readonly) NSArray *callbacks;
+
+/**
+ * Serve one more request with the operation. Returns NO once the callbacks are closed, the request then needs an
+ * operation of its own.
+ */
+- (BOOL)addCallbacksWithProgress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDWebImageDownloaderCompletedBlock)completedBlock;
+
+/**
+ * Refuse further callbacks and return the final ones, once the download finished or was cancelled.
+ */
+- (NSArray *)closeCallbacks;
+
 - (void)changeDownloaderPriorityOption:(SDWebImageDownloaderOptions)priorityOption;
 - (void)changeDownloaderSizeLimitOptions:(SDWebImageDownloaderOptions)limitOptions;
 
 - (void)changeDownloaderPriorityAndSizeLimitOptions:(SDWebImageDownloaderOptions)downloadOptions;
 - (void)_changeDownloaderPriorityAndSizeLimitOptions:(SDWebImageDownloaderOptions)downloadOptions;
 
-- (void)recalculateReadyStatus;
-
 @end
@@ -10,10 +10,20 @@
 #import "SDWebImageDecoder.h"
 #import "UIImage+MultiFormat.h"
 #import "NSData+ImageContentType.h"
+#import "SDWebImageDownloaderBuffer.h"
 #import <ImageIO/ImageIO.h>
 
+@interface SDWebImageDownloaderCallbacks ()
+
+@property (copy, nonatomic, readwrite) SDWebImageDownloaderProgressBlock progressBlock;
+@property (copy, nonatomic, readwrite) SDWebImageDownloaderCompletedBlock completedBlock;
+
+@end
+
+@implementation SDWebImageDownloaderCallbacks
+@end
+
 @interface SDWebImageDownloaderOperation () {
-    BOOL _ready;
     BOOL _executing;
     BOOL _finished;
     
@@ -25,13 +35,15 @@
 @property (copy, nonatomic) SDWebImageDownloaderCompletedBlock completedBlock;
 @property (copy, nonatomic) void (^cancelBlock)();
 
-@property (assign, nonatomic, getter = isReady) BOOL ready;
 @property (assign, nonatomic, getter = isExecuting) BOOL executing;
 @property (assign, nonatomic, getter = isFinished) BOOL finished;
 @property (assign, nonatomic) NSInteger expectedSize;
-@property (strong, nonatomic) NSMutableData *imageData;
+@property (strong, nonatomic) SDWebImageDownloaderBuffer *imageBuffer;
 @property (strong, nonatomic) NSURLConnection *connection;
-@property (strong, atomic) NSThread *thread;
+// Serial, receives the connection callbacks; the transfer itself is driven by the system's shared loader thread
+@property (strong, nonatomic) NSOperationQueue *delegateQueue;
+@property (strong, atomic, readwrite) NSURLResponse *response;
+@property (strong, atomic, readwrite) NSArray *callbacks;
 
 #if TARGET_OS_IPHONE && __IPHONE_OS_VERSION_MAX_ALLOWED >= __IPHONE_4_0
 @property (assign, nonatomic) UIBackgroundTaskIdentifier backgroundTaskId;
@@ -43,6 +55,8 @@
     size_t width, height;
     UIImageOrientation orientation;
     BOOL _responseFromCached;
+    CFAbsoluteTime _connectionStartTime;
+    BOOL _callbacksClosed;
 }
 
 - (id)initWithRequest:(NSURLRequest *)request options:(SDWebImageDownloaderOptions)options progress:(void (^)(NSInteger, NSInteger))progressBlock completed:(void (^)(UIImage *, NSData *, NSError *, BOOL))completedBlock cancelled:(void (^)())cancelBlock {
@@ -53,22 +67,46 @@
         _progressBlock = [progressBlock copy];
         _completedBlock = [completedBlock copy];
         _cancelBlock = [cancelBlock copy];
-        _ready = NO;
         _executing = NO;
         _finished = NO;
         _expectedSize = 0;
         _responseFromCached = YES; // Initially wrong until `connection:willCacheResponse:` is called or not called
+        _callbacks = @[];
+        _delegateQueue = [NSOperationQueue new];
+        _delegateQueue.name = @"com.hackemist.SDWebImageDownloaderOperation.delegate";
+        _delegateQueue.maxConcurrentOperationCount = 1;
     }
     
     return self;
 }
 
+- (BOOL)addCallbacksWithProgress:(SDWebImageDownloaderProgressBlock)progressBlock completed:(SDWebImageDownloaderCompletedBlock)completedBlock {
+    SDWebImageDownloaderCallbacks *callbacks = [SDWebImageDownloaderCallbacks new];
+    callbacks.progressBlock = progressBlock;
+    callbacks.completedBlock = completedBlock;
+    
+    // Writers serialize here, readers only load the current array
+    @synchronized (self) {
+        if (_callbacksClosed) return NO;
+        
+        self.callbacks = [self.callbacks arrayByAddingObject:callbacks];
+    }
+    
+    return YES;
+}
+
+- (NSArray *)closeCallbacks {
+    @synchronized (self) {
+        _callbacksClosed = YES;
+        return self.callbacks;
+    }
+}
+
 - (void)changeDownloaderPriorityOption:(SDWebImageDownloaderOptions)priorityOption {
     _options &= ~(SDWebImageDownloaderLowPriority | SDWebImageDownloaderHighPriority);
     _options |= (priorityOption & (SDWebImageDownloaderLowPriority | SDWebImageDownloaderHighPriority));
     
-    if (self.parentImageDownloader.executionOrder != SDWebImageDownloaderLIFOExecutionOrder)
-        [self.parentImageDownloader recalculateReadyStatuses];
+    [self.parentImageDownloader operationPriorityDidChange:self];
 }
 
 - (void)changeDownloaderSizeLimitOptions:(SDWebImageDownloaderOptions)limitOptions {
@@ -79,8 +117,7 @@
 - (void)changeDownloaderPriorityAndSizeLimitOptions:(SDWebImageDownloaderOptions)downloadOptions {
     [self _changeDownloaderPriorityAndSizeLimitOptions:downloadOptions];
     
-    if (self.parentImageDownloader.executionOrder != SDWebImageDownloaderLIFOExecutionOrder)
-        [self.parentImageDownloader recalculateReadyStatuses];
+    [self.parentImageDownloader operationPriorityDidChange:self];
 }
 
 - (void)_changeDownloaderPriorityAndSizeLimitOptions:(SDWebImageDownloaderOptions)downloadOptions {
@@ -88,21 +125,6 @@
     _options |= (downloadOptions & (SDWebImageDownloaderLowPriority | SDWebImageDownloaderHighPriority | SDWebImageDownloaderUsePrefetcherSizeLimit | SDWebImageDownloaderIgnoreAllSizeLimits));
 }
 
-- (void)recalculateReadyStatus {
-    if (self.parentImageDownloader.executionOrder != SDWebImageDownloaderLIFOExecutionOrder) {
-        if (_options & SDWebImageDownloaderHighPriority) {
-            self.ready = YES;
-        } else if (!(_options & SDWebImageDownloaderLowPriority)) {
-            self.ready = self.parentImageDownloader.highPriorityOperations == 0;
-        } else {
-            self.ready = self.parentImageDownloader.medPriorityOperations == 0 && self.parentImageDownloader.highPriorityOperations == 0;
-        }
-    } else {
-        if (!_ready)
-            self.ready = YES;
-    }
-}
-
 - (void)start {
     @synchronized (self) {
         if (self.isCancelled) {
@@ -111,8 +133,6 @@
             return;
         }
         
-        self.ready = YES; // Safety
-        
 #if TARGET_OS_IPHONE && __IPHONE_OS_VERSION_MAX_ALLOWED >= __IPHONE_4_0
         if ([self shouldContinueWhenAppEntersBackground]) {
             __weak __typeof__ (self) wself = self;
@@ -131,12 +151,10 @@
 
         self.executing = YES;
         self.connection = [[NSURLConnection alloc] initWithRequest:self.request delegate:self startImmediately:NO];
-        self.thread = [NSThread currentThread];
+        [self.connection setDelegateQueue:self.delegateQueue];
     }
     
     if (self.connection) {
-        [self.connection start];
-        
         if (self.progressBlock) {
             dispatch_sync_main_queue_safe(^{
                 self.progressBlock(0, NSURLResponseUnknownLength);
@@ -147,13 +165,10 @@
             [[NSNotificationCenter defaultCenter] postNotificationName:SDWebImageDownloadStartNotification object:self];
         });
         
-        CFRunLoopRun();
-        
-        if (!self.isFinished) {
-            [self.connection cancel];
-            
-            [self connection:self.connection didFailWithError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:@{NSURLErrorFailingURLErrorKey : self.request.URL}]];
-        }
+        // No thread waits for the transfer: the operation stays executing until a callback finishes it, and the
+        // downloader queue's thread goes back to the pool right away
+        _connectionStartTime = CFAbsoluteTimeGetCurrent();
+        [self.connection start];
     }
     else {
         SDWebImageDownloaderCompletedBlock completionBlock = self.completedBlock;
@@ -163,20 +178,18 @@
                 completionBlock(nil, nil, [NSError errorWithDomain:NSURLErrorDomain code:0 userInfo:@{NSLocalizedDescriptionKey : @"Connection can't be initialized"}], YES);
             });
         }
+        
+        [self done];
     }
-
-#if TARGET_OS_IPHONE && __IPHONE_OS_VERSION_MAX_ALLOWED >= __IPHONE_4_0
-    if (self.backgroundTaskId != UIBackgroundTaskInvalid) {
-        [[UIApplication sharedApplication] endBackgroundTask:self.backgroundTaskId];
-        self.backgroundTaskId = UIBackgroundTaskInvalid;
-    }
-#endif
 }
 
 - (void)cancel {
     @synchronized (self) {
-        if (self.thread) {
-            [self performSelector:@selector(cancelInternalAndStop) onThread:self.thread withObject:nil waitUntilDone:NO];
+        if (self.connection) {
+            // Serialized with the connection callbacks, like they were when each download had its own thread
+            [self.delegateQueue addOperationWithBlock:^{
+                [self cancelInternal];
+            }];
         }
         else {
             [self cancelInternal];
@@ -184,12 +197,6 @@
     }
 }
 
-- (void)cancelInternalAndStop {
-    if (self.isFinished) return;
-    [self cancelInternal];
-    CFRunLoopStop(CFRunLoopGetCurrent());
-}
-
 - (void)cancelInternal {
     if (self.isFinished) return;
     [super cancel];
@@ -210,12 +217,14 @@
     }
     
     [self reset];
+    [self.parentImageDownloader operationDidFinish:self];
 }
 
 - (void)done {
     self.finished = YES;
     self.executing = NO;
     [self reset];
+    [self.parentImageDownloader operationDidFinish:self];
 }
 
 - (void)reset {
@@ -223,26 +232,17 @@
     self.completedBlock = nil;
     self.progressBlock = nil;
     self.connection = nil;
-    self.imageData = nil;
-    self.thread = nil;
+    self.imageBuffer = nil;
     
     _imgContentType = nil;
     _incrementalImage = nil;
-}
-
-- (BOOL)isReady {
-    return _ready;
-}
-
-- (void)setReady:(BOOL)ready {
-    if (_executing || _finished)
-        ready = YES;
     
-    if (_ready != ready) {
-        [self willChangeValueForKey:@"isReady"];
-        _ready = ready;
-        [self didChangeValueForKey:@"isReady"];
+#if TARGET_OS_IPHONE && __IPHONE_OS_VERSION_MAX_ALLOWED >= __IPHONE_4_0
+    if (self.backgroundTaskId != UIBackgroundTaskInvalid) {
+        [[UIApplication sharedApplication] endBackgroundTask:self.backgroundTaskId];
+        self.backgroundTaskId = UIBackgroundTaskInvalid;
     }
+#endif
 }
 
 - (BOOL)isExecuting {
@@ -276,6 +276,11 @@
 #pragma mark NSURLConnection (delegate)
 
 - (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response {
+    if (self.isFinished) return;
+    
+    self.response = response;
+    _timeToFirstByte = CFAbsoluteTimeGetCurrent() - _connectionStartTime;
+    
     NSInteger errorCode = 0;
     
     if ([response respondsToSelector:@selector(statusCode)])
@@ -294,7 +299,7 @@
                 });
             }
             
-            self.imageData = [[NSMutableData alloc] initWithCapacity:expected];
+            self.imageBuffer = [[SDWebImageDownloaderBuffer alloc] initWithExpectedLength:expected];
             
             return;
         } else
@@ -315,16 +320,19 @@
         });
     }
     
-    CFRunLoopStop(CFRunLoopGetCurrent());
     [self done];
 }
 
 - (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
-    [self.imageData appendData:data];
+    // Delivered after a cancel that was queued behind it
+    if (self.isFinished) return;
+    
+    [self.imageBuffer appendData:data];
+    _receivedSize += data.length;
     
     BOOL contentTypeDiscovered = NO;
     if (_imgContentType.length <= 3) {
-        _imgContentType = [NSData contentTypeForImageData:self.imageData];
+        _imgContentType = [NSData contentTypeForImageData:[self.imageBuffer headData]];
         contentTypeDiscovered = _imgContentType.length > 3;
     }
     
@@ -337,7 +345,7 @@
         else
             maxImageDownloadSize = (self.options & SDWebImageDownloaderUsePrefetcherSizeLimit) ? self.maxPrefetchedImageDownloadSize : self.maxImageDownloadSize;
         
-        if (maxImageDownloadSize && (self.expectedSize > maxImageDownloadSize || self.imageData.length > maxImageDownloadSize)) {
+        if (maxImageDownloadSize && (self.expectedSize > maxImageDownloadSize || self.imageBuffer.length > maxImageDownloadSize)) {
             [self.connection cancel];
             
             dispatch_async_main_queue_ifnotmain(^{
@@ -352,8 +360,6 @@
                 });
             }
             
-            CFRunLoopStop(CFRunLoopGetCurrent());
-            
             [self done];
             
             return;
@@ -365,10 +371,10 @@
             if ([_imgContentType isEqualToString:@"image/gif"] || [_imgContentType isEqualToString:@"image/apng"]) {
                 CGFloat scale = [self.request.URL.absoluteString rangeOfString:@"@3x" options:NSCaseInsensitiveSearch].location != NSNotFound ? 3 : (([self.request.URL.absoluteString rangeOfString:@"@2x" options:NSCaseInsensitiveSearch].location != NSNotFound || (self.options & SDWebImageDownloaderLoadAsRetinaImage)) ? 2 : 1);
                 
-                if (self.imageData.length >= self.expectedSize)
-                    _incrementalImage = (OLImage *)[OLImage imageWithData:self.imageData scale:scale];
+                if (self.imageBuffer.length >= self.expectedSize)
+                    _incrementalImage = (OLImage *)[OLImage imageWithData:[self.imageBuffer data] scale:scale];
                 else
-                    _incrementalImage = (OLImage *)[OLImage imageWithIncrementalData:self.imageData scale:scale];
+                    _incrementalImage = (OLImage *)[OLImage imageWithIncrementalData:[self.imageBuffer data] scale:scale];
                 
                 if (![_incrementalImage isKindOfClass:[OLImage class]])
                     _incrementalImage = nil;
@@ -376,24 +382,24 @@
                 if (_incrementalImage.isReady && (self.progressBlock || self.completedBlock)) {
                     dispatch_sync_main_queue_safe(^{
                         if (self.progressBlock) {
-                            self.progressBlock(self.imageData.length, self.expectedSize);
+                            self.progressBlock(self.imageBuffer.length, self.expectedSize);
                         }
                         if (self.completedBlock) {
-                            self.completedBlock(_incrementalImage, self.imageData, nil, NO);
+                            self.completedBlock(_incrementalImage, [self.imageBuffer data], nil, NO);
                         }
                     });
                 }
             }
         } else if (_incrementalImage) {
-            [_incrementalImage updateWithData:self.imageData final:(self.imageData.length >= self.expectedSize)];
+            [_incrementalImage updateWithData:[self.imageBuffer data] final:(self.imageBuffer.length >= self.expectedSize)];
             
             if (_incrementalImage.isReady && (self.progressBlock || self.completedBlock)) {
                 dispatch_sync_main_queue_safe(^{
                     if (self.progressBlock) {
-                        self.progressBlock(self.imageData.length, self.expectedSize);
+                        self.progressBlock(self.imageBuffer.length, self.expectedSize);
                     }
                     if (self.completedBlock) {
-                        self.completedBlock(_incrementalImage, self.imageData, nil, NO);
+                        self.completedBlock(_incrementalImage, [self.imageBuffer data], nil, NO);
                     }
                 });
             }
@@ -405,11 +411,11 @@
                 // Thanks to the author @Nyx0uf
                 
                 // Get the total bytes downloaded
-                const NSInteger totalSize = self.imageData.length;
+                const NSInteger totalSize = self.imageBuffer.length;
                 
                 // Update the data source, we must pass ALL the data, not just the new bytes
                 CGImageSourceRef imageSource = CGImageSourceCreateIncremental(NULL);
-                CGImageSourceUpdateData(imageSource, (__bridge CFDataRef)self.imageData, totalSize == self.expectedSize);
+                CGImageSourceUpdateData(imageSource, (__bridge CFDataRef)[self.imageBuffer data], totalSize == self.expectedSize);
                 
                 if (width + height == 0) {
                     CFDictionaryRef properties = CGImageSourceCopyPropertiesAtIndex(imageSource, 0, NULL);
@@ -470,10 +476,10 @@
                         
                         dispatch_sync_main_queue_safe(^{
                             if (self.progressBlock) {
-                                self.progressBlock(self.imageData.length, self.expectedSize);
+                                self.progressBlock(self.imageBuffer.length, self.expectedSize);
                             }
                             if (self.completedBlock) {
-                                self.completedBlock(image, self.imageData, nil, NO);
+                                self.completedBlock(image, [self.imageBuffer data], nil, NO);
                             }
                         });
                     }
@@ -485,7 +491,7 @@
     } else if (self.progressBlock) {
         dispatch_sync_main_queue_safe(^{
             if (self.progressBlock) {
-                self.progressBlock(self.imageData.length, self.expectedSize);
+                self.progressBlock(self.imageBuffer.length, self.expectedSize);
             }
         });
     }
@@ -521,9 +527,9 @@
 - (void)connectionDidFinishLoading:(NSURLConnection *)aConnection {
     SDWebImageDownloaderCompletedBlock completionBlock = self.completedBlock;
     
+    if (self.isFinished) return;
+    
     @synchronized(self) {
-        CFRunLoopStop(CFRunLoopGetCurrent());
-        self.thread = nil;
         self.connection = nil;
         
         dispatch_async_main_queue_ifnotmain(^{
@@ -535,20 +541,37 @@
         _responseFromCached = NO;
     }
     
+    // A response served from NSURLCache says nothing about the network
+    _transferDuration = CFAbsoluteTimeGetCurrent() - _connectionStartTime;
+    if (!_responseFromCached) {
+        [self.parentImageDownloader operationDidFinishTransfer:self error:nil];
+    }
+    
+    // A conditional request answered with 304 has no body, the caller already holds the image
+    BOOL notModified = [self.response respondsToSelector:@selector(statusCode)] && [((NSHTTPURLResponse *)self.response) statusCode] == 304;
+    
+    BOOL revalidated = [self.request valueForHTTPHeaderField:@"If-None-Match"] || [self.request valueForHTTPHeaderField:@"If-Modified-Since"];
+    
     if (completionBlock) {
-        if (self.options & SDWebImageDownloaderIgnoreCachedResponse && _responseFromCached) {
+        if (notModified && !revalidated) {
+            // Only a request carrying validators has a copy that is still good
+            dispatch_async_main_queue_ifnotmain(^{
+                completionBlock(nil, nil, [NSError errorWithDomain:NSURLErrorDomain code:304 userInfo:@{NSLocalizedDescriptionKey : @"Not modified, but nothing was revalidated"}], YES);
+            });
+        }
+        else if ((self.options & SDWebImageDownloaderIgnoreCachedResponse && _responseFromCached) || notModified) {
             dispatch_async_main_queue_ifnotmain(^{
                 completionBlock(nil, nil, nil, YES);
             });
         }
         else {
             UIImage *image = _incrementalImage;
-            NSData *imageData = _imageData;
+            NSData *imageData = [self.imageBuffer finishedData];
             
             if (!image) {
                 NSString *key = [[SDWebImageManager sharedManager] cacheKeyForURL:self.request.URL];
                 
-                image = [UIImage sd_imageWithData:self.imageData scale:[self.request.URL.absoluteString rangeOfString:@"@3x" options:NSCaseInsensitiveSearch].location != NSNotFound ? 3 : (([self.request.URL.absoluteString rangeOfString:@"@2x" options:NSCaseInsensitiveSearch].location != NSNotFound || (self.options & SDWebImageDownloaderLoadAsRetinaImage)) ? 2 : 1)];
+                image = [UIImage sd_imageWithData:imageData scale:[self.request.URL.absoluteString rangeOfString:@"@3x" options:NSCaseInsensitiveSearch].location != NSNotFound ? 3 : (([self.request.URL.absoluteString rangeOfString:@"@2x" options:NSCaseInsensitiveSearch].location != NSNotFound || (self.options & SDWebImageDownloaderLoadAsRetinaImage)) ? 2 : 1)];
                 
                 image = [self scaledImageForKey:key options:(self.options & SDWebImageDownloaderLoadAsRetinaImage) image:image];
                 image = [UIImage decodedImageWithImage:image];
@@ -571,7 +594,10 @@
 }
 
 - (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
-    CFRunLoopStop(CFRunLoopGetCurrent());
+    if (self.isFinished) return;
+    
+    _transferDuration = CFAbsoluteTimeGetCurrent() - _connectionStartTime;
+    [self.parentImageDownloader operationDidFinishTransfer:self error:error];
     
     dispatch_async_main_queue_ifnotmain(^{
         [[NSNotificationCenter defaultCenter] postNotificationName:SDWebImageDownloadStopNotification object:nil];
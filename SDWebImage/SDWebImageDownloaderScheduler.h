@@ -0,0 +1,83 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSUInteger, SDWebImageDownloaderPriorityClass) {
+    SDWebImageDownloaderPriorityClassHigh,
+    SDWebImageDownloaderPriorityClassMedium,
+    SDWebImageDownloaderPriorityClassLow,
+};
+
+/**
+ * Decides which pending download starts next.
+ *
+ * Pending operations wait in one binary heap per priority class, ordered by arrival (first or last in, first out),
+ * so adding, re-prioritising, removing and picking the next operation are all O(log n). A class only starts operations
+ * while no higher class has any pending or running. To keep that from starving lower classes, an operation that has
+ * waited in its class for longer than `agingInterval` starts ahead of everything else, oldest first. At most one such
+ * aged operation runs at a time, so an old backlog of low priority work only ever takes one slot from newer, higher
+ * priority requests instead of turning the order into first in, first out.
+ *
+ * Not thread safe. SDWebImageDownloader only uses it on its barrier queue.
+ */
+@interface SDWebImageDownloaderScheduler : NSObject
+
+/**
+ * Start the most recently added operation of a class first instead of the oldest one. Defaults to NO.
+ */
+@property (assign, nonatomic) BOOL lastInFirstOut;
+
+/**
+ * Time an operation may wait in its class before it starts regardless of priority, in seconds. Defaults to 10, 0
+ * disables aging.
+ */
+@property (assign, nonatomic) NSTimeInterval agingInterval;
+
+/**
+ * Number of operations waiting to start.
+ */
+@property (assign, nonatomic, readonly) NSUInteger pendingCount;
+
+/**
+ * Number of operations returned by `nextOperation` and not removed since.
+ */
+@property (assign, nonatomic, readonly) NSUInteger runningCount;
+
+/**
+ * Number of operations started ahead of their priority by aging.
+ */
+@property (assign, nonatomic, readonly) NSUInteger agedCount;
+
+/**
+ * Number of pending and running operations of a class.
+ */
+- (NSUInteger)activeCountForPriorityClass:(SDWebImageDownloaderPriorityClass)priorityClass;
+
+/**
+ * Queue an operation. Does nothing if the scheduler already holds it.
+ */
+- (void)addOperation:(NSOperation *)operation priorityClass:(SDWebImageDownloaderPriorityClass)priorityClass;
+
+/**
+ * Move an operation to another class. A pending operation keeps its place in the arrival order and starts waiting
+ * anew for aging purposes.
+ */
+- (void)setPriorityClass:(SDWebImageDownloaderPriorityClass)priorityClass forOperation:(NSOperation *)operation;
+
+/**
+ * Forget an operation, pending or running. Does nothing if the scheduler doesn't hold it.
+ */
+- (void)removeOperation:(NSOperation *)operation;
+
+/**
+ * Returns the operation to start next and counts it as running until it's removed, or nil if none may start now.
+ */
+- (NSOperation *)nextOperation;
+
+@end
@@ -0,0 +1,276 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageDownloaderScheduler.h"
+
+#define SDWebImageDownloaderPriorityClassCount (SDWebImageDownloaderPriorityClassLow + 1)
+
+static const NSTimeInterval kDefaultAgingInterval = 10;
+
+// Every pending entry sits in two heaps of its class: one in start order, one in waiting order for aging
+typedef NS_ENUM(NSUInteger, SDWebImageDownloaderSchedulerHeap) {
+    SDWebImageDownloaderSchedulerHeapStartOrder,
+    SDWebImageDownloaderSchedulerHeapWaitingOrder,
+};
+#define SDWebImageDownloaderSchedulerHeapCount (SDWebImageDownloaderSchedulerHeapWaitingOrder + 1)
+
+@interface SDWebImageDownloaderSchedulerEntry : NSObject {
+@package
+    NSUInteger _heapIndexes[SDWebImageDownloaderSchedulerHeapCount]; // NSNotFound while not pending
+}
+@property (strong, nonatomic) NSOperation *operation;
+@property (assign, nonatomic) SDWebImageDownloaderPriorityClass priorityClass;
+@property (assign, nonatomic) uint64_t sequence;
+@property (assign, nonatomic) CFAbsoluteTime waitingSince;
+@property (assign, nonatomic) BOOL running;
+@property (assign, nonatomic) BOOL aged; // Running ahead of its priority
+@end
+@implementation SDWebImageDownloaderSchedulerEntry
+@end
+
+@implementation SDWebImageDownloaderScheduler {
+    NSMutableArray *_heaps[SDWebImageDownloaderPriorityClassCount][SDWebImageDownloaderSchedulerHeapCount];
+    NSMutableDictionary *_entries; // Non-retained operation pointer -> entry
+    NSUInteger _runningCounts[SDWebImageDownloaderPriorityClassCount];
+    NSUInteger _agedRunningCount;
+    uint64_t _nextSequence;
+}
+
+- (id)init {
+    if ((self = [super init])) {
+        _agingInterval = kDefaultAgingInterval;
+        _entries = [NSMutableDictionary new];
+
+        for (NSUInteger priorityClass = 0; priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+            for (NSUInteger heap = 0; heap < SDWebImageDownloaderSchedulerHeapCount; ++heap) {
+                _heaps[priorityClass][heap] = [NSMutableArray new];
+            }
+        }
+    }
+    return self;
+}
+
+- (void)setLastInFirstOut:(BOOL)lastInFirstOut {
+    if (_lastInFirstOut == lastInFirstOut) return;
+    _lastInFirstOut = lastInFirstOut;
+
+    // The start order flipped, rebuild those heaps
+    for (NSUInteger priorityClass = 0; priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+        NSMutableArray *heap = _heaps[priorityClass][SDWebImageDownloaderSchedulerHeapStartOrder];
+
+        for (NSInteger index = (NSInteger)heap.count / 2 - 1; index >= 0; --index) {
+            [self _siftDownAtIndex:index inHeap:heap kind:SDWebImageDownloaderSchedulerHeapStartOrder];
+        }
+    }
+}
+
+- (NSUInteger)pendingCount {
+    NSUInteger pendingCount = 0;
+    for (NSUInteger priorityClass = 0; priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+        pendingCount += _heaps[priorityClass][SDWebImageDownloaderSchedulerHeapStartOrder].count;
+    }
+    return pendingCount;
+}
+
+- (NSUInteger)runningCount {
+    NSUInteger runningCount = 0;
+    for (NSUInteger priorityClass = 0; priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+        runningCount += _runningCounts[priorityClass];
+    }
+    return runningCount;
+}
+
+- (NSUInteger)activeCountForPriorityClass:(SDWebImageDownloaderPriorityClass)priorityClass {
+    if (priorityClass >= SDWebImageDownloaderPriorityClassCount) return 0;
+
+    return _heaps[priorityClass][SDWebImageDownloaderSchedulerHeapStartOrder].count + _runningCounts[priorityClass];
+}
+
+#pragma mark Operations
+
+- (SDWebImageDownloaderSchedulerEntry *)_entryForOperation:(NSOperation *)operation {
+    return operation ? _entries[[NSValue valueWithNonretainedObject:operation]] : nil;
+}
+
+- (void)addOperation:(NSOperation *)operation priorityClass:(SDWebImageDownloaderPriorityClass)priorityClass {
+    if (!operation || [self _entryForOperation:operation]) return;
+
+    SDWebImageDownloaderSchedulerEntry *entry = [SDWebImageDownloaderSchedulerEntry new];
+    entry.operation = operation;
+    entry.priorityClass = MIN(priorityClass, SDWebImageDownloaderPriorityClassLow);
+    entry.sequence = _nextSequence++;
+
+    _entries[[NSValue valueWithNonretainedObject:operation]] = entry;
+    [self _insertPendingEntry:entry];
+}
+
+- (void)setPriorityClass:(SDWebImageDownloaderPriorityClass)priorityClass forOperation:(NSOperation *)operation {
+    SDWebImageDownloaderSchedulerEntry *entry = [self _entryForOperation:operation];
+    priorityClass = MIN(priorityClass, SDWebImageDownloaderPriorityClassLow);
+
+    if (!entry || entry.priorityClass == priorityClass) return;
+
+    if (entry.running) {
+        --_runningCounts[entry.priorityClass];
+        entry.priorityClass = priorityClass;
+        ++_runningCounts[priorityClass];
+    } else {
+        [self _removePendingEntry:entry];
+        entry.priorityClass = priorityClass;
+        [self _insertPendingEntry:entry];
+    }
+}
+
+- (void)removeOperation:(NSOperation *)operation {
+    SDWebImageDownloaderSchedulerEntry *entry = [self _entryForOperation:operation];
+    if (!entry) return;
+
+    if (entry.running) {
+        --_runningCounts[entry.priorityClass];
+        if (entry.aged) --_agedRunningCount;
+    } else {
+        [self _removePendingEntry:entry];
+    }
+
+    [_entries removeObjectForKey:[NSValue valueWithNonretainedObject:operation]];
+}
+
+- (NSOperation *)nextOperation {
+    SDWebImageDownloaderSchedulerEntry *entry = nil;
+
+    // Whatever waited past the aging interval goes first, the longest waiting first. Only one at a time though, so a
+    // backlog that aged as a whole doesn't hold back newer requests of higher priority
+    if (self.agingInterval > 0 && !_agedRunningCount) {
+        CFAbsoluteTime agedBefore = CFAbsoluteTimeGetCurrent() - self.agingInterval;
+
+        for (NSUInteger priorityClass = 0; priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+            NSArray *heap = _heaps[priorityClass][SDWebImageDownloaderSchedulerHeapWaitingOrder];
+            if (!heap.count) continue;
+
+            SDWebImageDownloaderSchedulerEntry *oldestEntry = heap[0];
+            if (oldestEntry.waitingSince <= agedBefore && (!entry || oldestEntry.waitingSince < entry.waitingSince)) {
+                entry = oldestEntry;
+            }
+        }
+
+        if (entry && [self _higherClassIsActiveThan:entry.priorityClass]) {
+            entry.aged = YES;
+            ++_agedRunningCount;
+            ++_agedCount;
+        }
+    }
+
+    // Otherwise the first of the highest class, as long as no higher class is still running
+    for (NSUInteger priorityClass = 0; !entry && priorityClass < SDWebImageDownloaderPriorityClassCount; ++priorityClass) {
+        NSArray *heap = _heaps[priorityClass][SDWebImageDownloaderSchedulerHeapStartOrder];
+
+        if (heap.count) {
+            entry = heap[0];
+        } else if (_runningCounts[priorityClass]) {
+            break;
+        }
+    }
+
+    if (!entry) return nil;
+
+    [self _removePendingEntry:entry];
+    entry.running = YES;
+    ++_runningCounts[entry.priorityClass];
+
+    return entry.operation;
+}
+
+- (BOOL)_higherClassIsActiveThan:(SDWebImageDownloaderPriorityClass)priorityClass {
+    for (NSUInteger higherClass = 0; higherClass < priorityClass; ++higherClass) {
+        if ([self activeCountForPriorityClass:higherClass]) return YES;
+    }
+    return NO;
+}
+
+#pragma mark Heaps
+
+- (void)_insertPendingEntry:(SDWebImageDownloaderSchedulerEntry *)entry {
+    entry.running = NO;
+    entry.waitingSince = CFAbsoluteTimeGetCurrent();
+
+    for (NSUInteger kind = 0; kind < SDWebImageDownloaderSchedulerHeapCount; ++kind) {
+        NSMutableArray *heap = _heaps[entry.priorityClass][kind];
+
+        entry->_heapIndexes[kind] = heap.count;
+        [heap addObject:entry];
+        [self _siftUpAtIndex:heap.count - 1 inHeap:heap kind:kind];
+    }
+}
+
+- (void)_removePendingEntry:(SDWebImageDownloaderSchedulerEntry *)entry {
+    for (NSUInteger kind = 0; kind < SDWebImageDownloaderSchedulerHeapCount; ++kind) {
+        NSMutableArray *heap = _heaps[entry.priorityClass][kind];
+        NSUInteger index = entry->_heapIndexes[kind];
+        if (index >= heap.count || heap[index] != entry) continue;
+
+        // Swap with the last entry, drop it, then restore the heap order around the one that moved
+        NSUInteger lastIndex = heap.count - 1;
+        if (index != lastIndex) {
+            [self _swapIndex:index withIndex:lastIndex inHeap:heap kind:kind];
+        }
+
+        [heap removeLastObject];
+        entry->_heapIndexes[kind] = NSNotFound;
+
+        if (index < heap.count) {
+            [self _siftDownAtIndex:index inHeap:heap kind:kind];
+            [self _siftUpAtIndex:index inHeap:heap kind:kind];
+        }
+    }
+}
+
+- (BOOL)_entry:(SDWebImageDownloaderSchedulerEntry *)entry precedesEntry:(SDWebImageDownloaderSchedulerEntry *)otherEntry kind:(NSUInteger)kind {
+    if (kind == SDWebImageDownloaderSchedulerHeapWaitingOrder && entry.waitingSince != otherEntry.waitingSince) {
+        return entry.waitingSince < otherEntry.waitingSince;
+    }
+
+    if (kind == SDWebImageDownloaderSchedulerHeapStartOrder && self.lastInFirstOut) {
+        return entry.sequence > otherEntry.sequence;
+    }
+
+    return entry.sequence < otherEntry.sequence;
+}
+
+- (void)_swapIndex:(NSUInteger)index withIndex:(NSUInteger)otherIndex inHeap:(NSMutableArray *)heap kind:(NSUInteger)kind {
+    [heap exchangeObjectAtIndex:index withObjectAtIndex:otherIndex];
+    ((SDWebImageDownloaderSchedulerEntry *)heap[index])->_heapIndexes[kind] = index;
+    ((SDWebImageDownloaderSchedulerEntry *)heap[otherIndex])->_heapIndexes[kind] = otherIndex;
+}
+
+- (void)_siftUpAtIndex:(NSUInteger)index inHeap:(NSMutableArray *)heap kind:(NSUInteger)kind {
+    while (index > 0) {
+        NSUInteger parentIndex = (index - 1) / 2;
+        if (![self _entry:heap[index] precedesEntry:heap[parentIndex] kind:kind]) break;
+
+        [self _swapIndex:index withIndex:parentIndex inHeap:heap kind:kind];
+        index = parentIndex;
+    }
+}
+
+- (void)_siftDownAtIndex:(NSUInteger)index inHeap:(NSMutableArray *)heap kind:(NSUInteger)kind {
+    NSUInteger count = heap.count;
+
+    while (YES) {
+        NSUInteger firstIndex = index;
+        NSUInteger leftIndex = index * 2 + 1, rightIndex = index * 2 + 2;
+
+        if (leftIndex < count && [self _entry:heap[leftIndex] precedesEntry:heap[firstIndex] kind:kind]) firstIndex = leftIndex;
+        if (rightIndex < count && [self _entry:heap[rightIndex] precedesEntry:heap[firstIndex] kind:kind]) firstIndex = rightIndex;
+        if (firstIndex == index) break;
+
+        [self _swapIndex:index withIndex:firstIndex inHeap:heap kind:kind];
+        index = firstIndex;
+    }
+}
+
+@end
@@ -32,7 +32,9 @@ typedef NS_OPTIONS(NSUInteger, SDWebImageOptions) {
 
     /**
      * Even if the image is cached, respect the HTTP response cache control, and refresh the image from remote location if needed.
-     * The disk caching will be handled by NSURLCache instead of SDWebImage leading to slight performance degradation.
+     * A disk cached image still fresh per the `Cache-Control` max-age it was downloaded with is used without any request.
+     * Once stale, it is revalidated with its `ETag` / `Last-Modified`, so an unchanged image isn't transferred again.
+     * Images cached without validators are refreshed through NSURLCache, leading to slight performance degradation.
      * This option helps deal with images changing behind the same request URL, e.g. Facebook graph api profile pics.
      * If a cached image is refreshed, the completion block is called once with the cached image and again with the final image.
      *
@@ -342,4 +344,27 @@ SDWebImageManager *manager = [SDWebImageManager sharedManager];
 
 - (UIImage *)imageFromMemoryCacheForURL:(NSURL *)url options:(SDWebImageScaledOptions)options;
 
+/**
+ * Look up the cached images of several URLs at once, see `-[SDImageCache queryCacheForKeys:options:done:]`. Nothing
+ * is downloaded.
+ *
+ * @param urls       The URLs, in priority order
+ * @param options    Scaling options
+ * @param completion Called with the images found (NSURL -> UIImage), where they were found, and whether it's the last call
+ *
+ * @return The operation reading from disk, which can be cancelled, or nil if every image was in memory
+ */
+- (NSOperation *)cachedImagesForURLs:(NSArray *)urls options:(SDWebImageScaledOptions)options completion:(SDWebImageBatchQueryCompletedBlock)completion;
+
+/**
+ * Loads by source (memory, disk, network), load failures, bytes downloaded, and download and end-to-end load latencies.
+ */
+@property (strong, nonatomic, readonly) SDWebImageStatistics *statistics;
+
+/**
+ * `statistics` as a dictionary (see `-[SDWebImageStatistics snapshot]`), plus `-[SDImageCache statisticsSnapshot]`
+ * under `imageCache`.
+ */
+- (NSDictionary *)statisticsSnapshot;
+
 @end
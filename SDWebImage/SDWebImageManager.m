@@ -16,6 +16,7 @@
 @property (strong, nonatomic, readwrite) SDWebImageDownloader *imageDownloader;
 @property (strong, nonatomic) NSMutableArray *failedURLs;
 @property (strong, nonatomic) NSMutableArray *runningOperations;
+@property (strong, nonatomic, readwrite) SDWebImageStatistics *statistics;
 
 @end
 
@@ -36,6 +37,7 @@
         _imageDownloader = [SDWebImageDownloader sharedDownloader];
         _failedURLs = [NSMutableArray new];
         _runningOperations = [NSMutableArray new];
+        _statistics = [SDWebImageStatistics new];
     }
     return self;
 }
@@ -44,6 +46,12 @@
     return [SDImageCache sharedImageCache];
 }
 
+- (NSDictionary *)statisticsSnapshot {
+    NSMutableDictionary *snapshot = [[self.statistics snapshot] mutableCopy];
+    snapshot[@"imageCache"] = [self.imageCache statisticsSnapshot];
+    return snapshot;
+}
+
 - (NSString *)cacheKeyForURL:(NSURL *)url {
     if (self.cacheKeyFilter) {
         return self.cacheKeyFilter(url);
@@ -107,6 +115,36 @@
     return [self.imageCache imageFromMemoryCacheForKey:key options:options];
 }
 
+- (NSOperation *)cachedImagesForURLs:(NSArray *)urls options:(SDWebImageScaledOptions)options completion:(SDWebImageBatchQueryCompletedBlock)completion {
+    if (!completion) return nil;
+    
+    NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:urls.count];
+    NSMutableDictionary *urlsByKey = [NSMutableDictionary new]; // Several URLs may share a key
+    
+    for (NSURL *url in urls) {
+        NSString *key = [url isKindOfClass:[NSURL class]] ? [self cacheKeyForURL:url] : nil;
+        if (!key) continue;
+        
+        if (!urlsByKey[key]) {
+            urlsByKey[key] = [NSMutableArray new];
+            [keys addObject:key];
+        }
+        [urlsByKey[key] addObject:url];
+    }
+    
+    return [self.imageCache queryCacheForKeys:keys options:options done:^(NSDictionary *images, SDImageCacheType cacheType, BOOL finished) {
+        NSMutableDictionary *imagesByURL = [[NSMutableDictionary alloc] initWithCapacity:images.count];
+        
+        for (NSString *key in images) {
+            for (NSURL *url in urlsByKey[key]) {
+                imagesByURL[url] = images[key];
+            }
+        }
+        
+        completion(imagesByURL, cacheType, finished);
+    }];
+}
+
 - (NSArray *)downloadOperationsForURL:(NSURL *)url {
     NSMutableArray *operations = nil;
     
@@ -139,6 +177,8 @@
         url = nil;
     }
     
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    
     __block SDWebImageCombinedOperation *operation = [[SDWebImageCombinedOperation alloc] initWithOptions:options URL:url];
     __weak SDWebImageCombinedOperation *weakOperation = operation;
     
@@ -168,8 +208,11 @@
             return;
         }
         
-        if ((!image || weakOperation.options & SDWebImageRefreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url])) {
-            if (image && weakOperation.options & SDWebImageRefreshCached) {
+        // Even with SDWebImageRefreshCached, an image the server said is still fresh is used without asking it again
+        BOOL refreshCached = image && (weakOperation.options & SDWebImageRefreshCached) && ![self.imageCache isDiskImageFreshForKey:key];
+        
+        if ((!image || refreshCached) && (![self.delegate respondsToSelector:@selector(imageManager:shouldDownloadImageForURL:)] || [self.delegate imageManager:self shouldDownloadImageForURL:url])) {
+            if (refreshCached) {
                 dispatch_sync_main_queue_safe(^{
                     // If image was found in the cache bug SDWebImageRefreshCached is provided, notify about the cached image
                     // AND try to re-download it in order to let a chance to NSURLCache to refresh it from server.
@@ -181,11 +224,15 @@
             if (weakOperation.options & SDWebImageLowPriority) downloaderOptions |= SDWebImageDownloaderLowPriority;
             if (weakOperation.options & SDWebImageHighPriority) downloaderOptions |= SDWebImageDownloaderHighPriority;
             if (weakOperation.options & SDWebImageProgressiveDownload) downloaderOptions |= SDWebImageDownloaderProgressiveDownload;
-            if (weakOperation.options & SDWebImageRefreshCached) downloaderOptions |= SDWebImageDownloaderUseNSURLCache;
             if (weakOperation.options & SDWebImageContinueInBackground) downloaderOptions |= SDWebImageDownloaderContinueInBackground;
             if (weakOperation.options & SDWebImageHandleCookies) downloaderOptions |= SDWebImageDownloaderHandleCookies;
             if (weakOperation.options & SDWebImageAllowInvalidSSLCertificates) downloaderOptions |= SDWebImageDownloaderAllowInvalidSSLCertificates;
-            if (image && weakOperation.options & SDWebImageRefreshCached) {
+            
+            // Revalidate with the validators of the disk entry when it has some, so an unchanged image isn't transferred
+            // again. Otherwise fall back to NSURLCache, ignoring what it answers from its own storage.
+            NSDictionary *revalidationHeaders = refreshCached ? [self.imageCache revalidationHeadersForKey:key] : nil;
+            if (weakOperation.options & SDWebImageRefreshCached && !revalidationHeaders) downloaderOptions |= SDWebImageDownloaderUseNSURLCache;
+            if (refreshCached && !revalidationHeaders) {
                 // force progressive off if image already cached but forced refreshing
                 //downloaderOptions &= ~SDWebImageDownloaderProgressiveDownload;
                 // ignore image read from NSURLCache if image if cached but force refreshing
@@ -196,7 +243,12 @@
             if (weakOperation.options & SDWebImageUsePrefetcherSizeLimit) downloaderOptions |= SDWebImageDownloaderUsePrefetcherSizeLimit;
             if (weakOperation.options & SDWebImageIgnoreAllSizeLimits) downloaderOptions |= SDWebImageDownloaderIgnoreAllSizeLimits;
             
-            operation.downloadOperation = [self.imageDownloader downloadImageWithURL:url options:downloaderOptions progress:progressBlock completed:^(UIImage *downloadedImage, NSData *data, NSError *error, BOOL finished) {
+            CFAbsoluteTime downloadStartTime = CFAbsoluteTimeGetCurrent();
+            
+            operation.downloadOperation = [self.imageDownloader downloadImageWithURL:url options:downloaderOptions HTTPHeaders:revalidationHeaders progress:progressBlock completed:^(UIImage *downloadedImage, NSData *data, NSError *error, BOOL finished) {
+                NSURLResponse *response = weakOperation.downloadOperation.response;
+                BOOL notModified = [response isKindOfClass:[NSHTTPURLResponse class]] && [(NSHTTPURLResponse *)response statusCode] == 304;
+                
                 if (weakOperation.isCancelled) {
                     // Do nothing if the operation was cancelled
                     // See #699 for more details
@@ -224,8 +276,12 @@
                         }
                     }
                     
-                    if (image && weakOperation.options & SDWebImageRefreshCached && !downloadedImage) {
+                    if (refreshCached && !downloadedImage) {
                         if (finished) {
+                            if (notModified) {
+                                [self.imageCache refreshDiskImageForKey:key response:response];
+                            }
+                            
                             dispatch_sync_main_queue_safe(^{
                                 completedBlock(image, nil, cacheType, YES);
                             });
@@ -237,7 +293,7 @@
                             
                             if (transformedImage && finished) {
                                 BOOL imageWasTransformed = ![transformedImage isEqual:downloadedImage];
-                                [self.imageCache storeImage:transformedImage recalculateFromImage:imageWasTransformed imageData:data forKey:key toDisk:cacheOnDisk];
+                                [self.imageCache storeImage:transformedImage recalculateFromImage:imageWasTransformed imageData:data forKey:key toDisk:cacheOnDisk priority:(weakOperation.options & SDWebImageLowPriority) ? SDImageCacheWritePriorityLow : SDImageCacheWritePriorityDefault response:response];
                                 
                                 transformedImage = SDScaledImageForOptions((weakOperation.options & SDWebImageLoadAsRetinaImage), transformedImage);
                             }
@@ -251,7 +307,7 @@
                     }
                     else {
                         if (downloadedImage && finished) {
-                            [self.imageCache storeImage:downloadedImage recalculateFromImage:NO imageData:data forKey:key toDisk:cacheOnDisk];
+                            [self.imageCache storeImage:downloadedImage recalculateFromImage:NO imageData:data forKey:key toDisk:cacheOnDisk priority:(weakOperation.options & SDWebImageLowPriority) ? SDImageCacheWritePriorityLow : SDImageCacheWritePriorityDefault response:response];
                             
                             downloadedImage = SDScaledImageForOptions((weakOperation.options & SDWebImageLoadAsRetinaImage), downloadedImage);
                         }
@@ -265,6 +321,20 @@
                 }
                 
                 if (finished) {
+                    if (error) {
+                        [self.statistics addValue:1 toCounter:SDWebImageStatisticsLoadFailures];
+                    } else if (downloadedImage) {
+                        CFAbsoluteTime finishTime = CFAbsoluteTimeGetCurrent();
+                        
+                        [self.statistics addValue:1 toCounter:SDWebImageStatisticsLoadsFromNetwork];
+                        [self.statistics addValue:data.length toCounter:SDWebImageStatisticsNetworkBytes];
+                        [self.statistics recordLatency:finishTime - downloadStartTime inHistogram:SDWebImageStatisticsDownloadLatency];
+                        [self.statistics recordLatency:finishTime - startTime inHistogram:SDWebImageStatisticsLoadLatency];
+                    } else if (refreshCached && notModified) {
+                        [self.statistics addValue:1 toCounter:SDWebImageStatisticsLoadsRevalidated];
+                        [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsLoadLatency];
+                    }
+                    
                     @synchronized (self.runningOperations) {
                         [self.runningOperations removeObject:weakOperation];
                     }
@@ -280,6 +350,9 @@
             };
         }
         else if (image) {
+            [self.statistics addValue:1 toCounter:(cacheType == SDImageCacheTypeMemory ? SDWebImageStatisticsLoadsFromMemory : SDWebImageStatisticsLoadsFromDisk)];
+            [self.statistics recordLatency:CFAbsoluteTimeGetCurrent() - startTime inHistogram:SDWebImageStatisticsLoadLatency];
+            
             dispatch_sync_main_queue_safe(^{
                 if (!weakOperation.isCancelled) {
                     completedBlock(image, nil, cacheType, YES);
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSUInteger, SDWebImageStatisticsCounter) {
+    // SDImageCache
+    SDWebImageStatisticsMemoryHits,
+    SDWebImageStatisticsMemoryMisses,
+    SDWebImageStatisticsWarmUpHits,         // Memory hits on images loaded by the launch warm-up, the first one per image
+    SDWebImageStatisticsDiskHits,
+    SDWebImageStatisticsDiskMisses,
+    SDWebImageStatisticsDecodedBitmapHits,
+    SDWebImageStatisticsEncodedMemoryHits,  // Answered from the in-memory encoded data, not counted as disk hits
+    SDWebImageStatisticsDiskBytesRead,
+    SDWebImageStatisticsDiskBytesWritten,
+    SDWebImageStatisticsDiskEvictions,
+    // SDWebImageManager
+    SDWebImageStatisticsLoadsFromMemory,
+    SDWebImageStatisticsLoadsFromDisk,
+    SDWebImageStatisticsLoadsFromNetwork,
+    SDWebImageStatisticsLoadsRevalidated,   // Stale disk entries the server confirmed unchanged (304), served without a transfer
+    SDWebImageStatisticsLoadFailures,
+    SDWebImageStatisticsNetworkBytes,
+
+    SDWebImageStatisticsCounterCount
+};
+
+typedef NS_ENUM(NSUInteger, SDWebImageStatisticsHistogram) {
+    // SDImageCache
+    SDWebImageStatisticsDiskReadLatency,  // Reading the encoded data of a disk hit
+    SDWebImageStatisticsDecodeLatency,    // Decoding it into an image
+    SDWebImageStatisticsQueryLatency,     // queryCacheForKey:, from the call until the result is handed to the main queue
+    SDWebImageStatisticsCleanupSliceTime, // One slice of a disk cleanup, during which the IO queue serves nothing else
+    // SDWebImageManager
+    SDWebImageStatisticsDownloadLatency,  // From starting a download until it finished
+    SDWebImageStatisticsLoadLatency,      // downloadWithURL:, from the call until the final completion, whatever the source
+
+    SDWebImageStatisticsHistogramCount
+};
+
+/**
+ * Counters and latency histograms cheap enough to update on every query.
+ *
+ * Updates are lock free: each thread adds to one of a few stripes with an atomic add, so concurrent readers don't
+ * contend on a single cache line. Latencies go into power-of-two microsecond buckets. `snapshot` sums the stripes.
+ */
+@interface SDWebImageStatistics : NSObject
+
+/**
+ * Add to a counter.
+ */
+- (void)addValue:(int64_t)value toCounter:(SDWebImageStatisticsCounter)counter;
+
+/**
+ * Record one latency sample, in seconds.
+ */
+- (void)recordLatency:(NSTimeInterval)latency inHistogram:(SDWebImageStatisticsHistogram)histogram;
+
+/**
+ * The current value of a counter.
+ */
+- (int64_t)valueOfCounter:(SDWebImageStatisticsCounter)counter;
+
+/**
+ * A copy of every counter and histogram, suitable for telemetry:
+ *
+ *     @{ @"counters": @{ @"memoryHits": @12, ... },
+ *        @"histograms": @{ @"diskReadLatency": @{ @"count": @3, @"totalTime": @0.004, @"p50": ..., @"p90": ...,
+ *                                                 @"p99": ..., @"buckets": @[ ... ] }, ... } }
+ *
+ * Bucket 0 counts samples under 1 µs, bucket i samples in [2^(i-1), 2^i) µs. Percentiles are bucket upper bounds,
+ * in seconds. Only counters and histograms that were used are included.
+ */
+- (NSDictionary *)snapshot;
+
+/**
+ * Zero every counter and histogram.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,163 @@
+/*
+ * This file is part of the SDWebImage package.
+ * (c) Olivier Poitrey <rs@dailymotion.com>
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#import "SDWebImageStatistics.h"
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
+
+#define SDWebImageStatisticsStripeCount 8
+#define SDWebImageStatisticsBucketCount 32
+
+static NSString *const kCounterNames[SDWebImageStatisticsCounterCount] = {
+    @"memoryHits",
+    @"memoryMisses",
+    @"warmUpHits",
+    @"diskHits",
+    @"diskMisses",
+    @"decodedBitmapHits",
+    @"encodedMemoryHits",
+    @"diskBytesRead",
+    @"diskBytesWritten",
+    @"diskEvictions",
+    @"loadsFromMemory",
+    @"loadsFromDisk",
+    @"loadsFromNetwork",
+    @"loadsRevalidated",
+    @"loadFailures",
+    @"networkBytes",
+};
+
+static NSString *const kHistogramNames[SDWebImageStatisticsHistogramCount] = {
+    @"diskReadLatency",
+    @"decodeLatency",
+    @"queryLatency",
+    @"cleanupSliceTime",
+    @"downloadLatency",
+    @"loadLatency",
+};
+
+typedef struct {
+    volatile int64_t counters[SDWebImageStatisticsCounterCount];
+    volatile int64_t buckets[SDWebImageStatisticsHistogramCount][SDWebImageStatisticsBucketCount];
+    volatile int64_t totalMicroseconds[SDWebImageStatisticsHistogramCount];
+    int64_t padding[8]; // Keeps neighbouring stripes off each other's cache lines
+} SDWebImageStatisticsStripe;
+
+static inline NSUInteger SDWebImageStatisticsCurrentStripe(void) {
+    // Thread structures are page aligned or close to it, drop the low bits before picking a stripe
+    uintptr_t thread = (uintptr_t)pthread_self();
+    return (NSUInteger)((thread >> 12) ^ (thread >> 16)) % SDWebImageStatisticsStripeCount;
+}
+
+static inline int64_t SDWebImageStatisticsLoad(volatile int64_t *value) {
+    return OSAtomicAdd64(0, value);
+}
+
+@implementation SDWebImageStatistics {
+    SDWebImageStatisticsStripe _stripes[SDWebImageStatisticsStripeCount];
+}
+
+- (void)addValue:(int64_t)value toCounter:(SDWebImageStatisticsCounter)counter {
+    if (counter >= SDWebImageStatisticsCounterCount) return;
+
+    OSAtomicAdd64(value, &_stripes[SDWebImageStatisticsCurrentStripe()].counters[counter]);
+}
+
+- (void)recordLatency:(NSTimeInterval)latency inHistogram:(SDWebImageStatisticsHistogram)histogram {
+    if (histogram >= SDWebImageStatisticsHistogramCount) return;
+
+    uint64_t microseconds = latency > 0 ? (uint64_t)(latency * 1000000) : 0;
+    NSUInteger bucket = microseconds ? MIN(64 - __builtin_clzll(microseconds), SDWebImageStatisticsBucketCount - 1) : 0;
+
+    SDWebImageStatisticsStripe *stripe = &_stripes[SDWebImageStatisticsCurrentStripe()];
+    OSAtomicIncrement64(&stripe->buckets[histogram][bucket]);
+    OSAtomicAdd64((int64_t)microseconds, &stripe->totalMicroseconds[histogram]);
+}
+
+- (int64_t)valueOfCounter:(SDWebImageStatisticsCounter)counter {
+    if (counter >= SDWebImageStatisticsCounterCount) return 0;
+
+    int64_t value = 0;
+    for (NSUInteger i = 0; i < SDWebImageStatisticsStripeCount; ++i) {
+        value += SDWebImageStatisticsLoad(&_stripes[i].counters[counter]);
+    }
+    return value;
+}
+
+- (NSDictionary *)snapshot {
+    NSMutableDictionary *counters = [NSMutableDictionary new];
+    NSMutableDictionary *histograms = [NSMutableDictionary new];
+
+    for (NSUInteger counter = 0; counter < SDWebImageStatisticsCounterCount; ++counter) {
+        int64_t value = [self valueOfCounter:counter];
+        if (value) {
+            counters[kCounterNames[counter]] = @(value);
+        }
+    }
+
+    for (NSUInteger histogram = 0; histogram < SDWebImageStatisticsHistogramCount; ++histogram) {
+        int64_t buckets[SDWebImageStatisticsBucketCount] = {0};
+        int64_t count = 0, totalMicroseconds = 0;
+
+        for (NSUInteger i = 0; i < SDWebImageStatisticsStripeCount; ++i) {
+            for (NSUInteger bucket = 0; bucket < SDWebImageStatisticsBucketCount; ++bucket) {
+                buckets[bucket] += SDWebImageStatisticsLoad(&_stripes[i].buckets[histogram][bucket]);
+            }
+            totalMicroseconds += SDWebImageStatisticsLoad(&_stripes[i].totalMicroseconds[histogram]);
+        }
+
+        NSMutableArray *bucketValues = [[NSMutableArray alloc] initWithCapacity:SDWebImageStatisticsBucketCount];
+        for (NSUInteger bucket = 0; bucket < SDWebImageStatisticsBucketCount; ++bucket) {
+            count += buckets[bucket];
+            [bucketValues addObject:@(buckets[bucket])];
+        }
+
+        if (!count) continue;
+
+        histograms[kHistogramNames[histogram]] = @{@"count": @(count),
+                                                   @"totalTime": @(totalMicroseconds / 1000000.0),
+                                                   @"p50": @([self percentile:0.5 buckets:buckets count:count]),
+                                                   @"p90": @([self percentile:0.9 buckets:buckets count:count]),
+                                                   @"p99": @([self percentile:0.99 buckets:buckets count:count]),
+                                                   @"buckets": bucketValues};
+    }
+
+    return @{@"counters": counters, @"histograms": histograms};
+}
+
+- (NSTimeInterval)percentile:(double)percentile buckets:(const int64_t *)buckets count:(int64_t)count {
+    int64_t rank = (int64_t)ceil(percentile * count), seen = 0;
+
+    for (NSUInteger bucket = 0; bucket < SDWebImageStatisticsBucketCount; ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return (double)(1ULL << bucket) / 1000000.0;
+        }
+    }
+
+    return (double)(1ULL << (SDWebImageStatisticsBucketCount - 1)) / 1000000.0;
+}
+
+- (void)reset {
+    for (NSUInteger i = 0; i < SDWebImageStatisticsStripeCount; ++i) {
+        SDWebImageStatisticsStripe *stripe = &_stripes[i];
+
+        for (NSUInteger counter = 0; counter < SDWebImageStatisticsCounterCount; ++counter) {
+            OSAtomicAdd64(-SDWebImageStatisticsLoad(&stripe->counters[counter]), &stripe->counters[counter]);
+        }
+
+        for (NSUInteger histogram = 0; histogram < SDWebImageStatisticsHistogramCount; ++histogram) {
+            for (NSUInteger bucket = 0; bucket < SDWebImageStatisticsBucketCount; ++bucket) {
+                OSAtomicAdd64(-SDWebImageStatisticsLoad(&stripe->buckets[histogram][bucket]), &stripe->buckets[histogram][bucket]);
+            }
+            OSAtomicAdd64(-SDWebImageStatisticsLoad(&stripe->totalMicroseconds[histogram]), &stripe->totalMicroseconds[histogram]);
+        }
+    }
+}
+
+@end
@@ -34,4 +34,7 @@ FOUNDATION_EXPORT const unsigned char WebImageVersionString[];
 #import <WebImage/SDWebImageDecoder.h>
 #import <WebImage/UIImage+WebP.h>
 #import <WebImage/UIImage+GIF.h>
-#import <WebImage/NSData+ImageContentType.h>
\ No newline at end of file
+#import <WebImage/NSData+ImageContentType.h>
+#import <WebImage/SDImageCacheEvictionPolicy.h>
+#import <WebImage/SDWebImageStatistics.h>
+#import <WebImage/SDImageMemoryBudget.h>
\ No newline at end of file